@@ -0,0 +1,586 @@
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "battery.h"
+#include "history.h"
+#include "trace.h"
+
+#define PROGRAM_NAME "batify-analyze"
+#define UNKNOWN_MODEL "unknown"
+
+#define ANALYZE_BLOCK_SAMPLES 4096
+#define ANALYZE_MAX_THRESHOLDS 8
+/* Discharge rates in whole percent per hour, the last bin holds the rest */
+#define ANALYZE_RATE_BINS 100
+/* Shorter discharges say more about the 1% steps than about the rate */
+#define ANALYZE_MIN_DISCHARGE 600
+#define ANALYZE_MIN_SPAN (30 * 86400)
+#define ANALYZE_MONTH (30 * 86400.0)
+#define ANALYZE_MAX_GAP (2 * HISTORY_MAX_GAP)
+
+/* The SAMPLE_HAS_CAPACITY flag batify records with every sample */
+#define TRACE_HAS_CAPACITY (1 << 0)
+
+typedef enum
+{
+    UNKNOWN_FILE,
+    HISTORY_FILE,
+    TRACE_FILE,
+} FILE_KIND;
+
+/*
+ * Samples are decoded into columns so the kernels below are plain loops
+ * over arrays, without branches where they can be avoided, which the
+ * compiler turns into vector code. The last sample of a block is carried
+ * over as the first of the next one, so no pair of samples is lost.
+ */
+typedef struct _Block
+{
+    guint length;
+    gint64 timestamps[ANALYZE_BLOCK_SAMPLES];
+    gint32 capacities[ANALYZE_BLOCK_SAMPLES];
+    guint8 discharging[ANALYZE_BLOCK_SAMPLES];
+} Block;
+
+/* One battery pack of one file; timestamps are in seconds */
+typedef struct _Pack
+{
+    gchar* model;
+    gboolean wall_clock;
+    Block* block;
+    gint32 capacity;
+    guint64 samples;
+    gint64 on_battery;
+    gint64 drained;
+    guint hits[ANALYZE_MAX_THRESHOLDS];
+    guint discharges;
+    guint rates[ANALYZE_RATE_BINS];
+    gboolean discharge;
+    gint64 discharge_start;
+    gint32 discharge_capacity;
+    /* Least squares of the runtime per full charge over the months */
+    guint points;
+    gint64 first;
+    gint64 last;
+    gdouble sx, sy, sxx, sxy;
+} Pack;
+
+typedef struct _Model
+{
+    guint packs;
+    guint64 samples;
+    gint64 on_battery;
+    gint64 drained;
+    guint hits[ANALYZE_MAX_THRESHOLDS];
+    guint discharges;
+    guint rates[ANALYZE_RATE_BINS];
+    guint decay_packs;
+    gdouble decay;
+} Model;
+
+static struct config
+{
+    gint jobs;
+    gchar** thresholds;
+} config = { 0, NULL };
+
+/* Filled by the workers under the lock */
+static struct analysis
+{
+    GMutex lock;
+    GHashTable* models;
+    gboolean failed;
+    gint32 thresholds[ANALYZE_MAX_THRESHOLDS];
+    guint n_thresholds;
+} analysis;
+
+static GOptionEntry entries[] = {
+    { "jobs",
+      'j',
+      0,
+      G_OPTION_ARG_INT,
+      &config.jobs,
+      "Number of files analyzed at once (default: number of processors)",
+      "N" },
+    { "threshold",
+      't',
+      0,
+      G_OPTION_ARG_STRING_ARRAY,
+      &config.thresholds,
+      "Count discharges crossing this level (repeatable, default: 20 and 10)",
+      "PERCENT" },
+    { NULL }
+};
+
+/* Seconds between samples of one discharge and the percents lost meanwhile */
+static void
+kernel_drain(const Block* block, gint64* on_battery, gint64* drained)
+{
+    guint i;
+    gint64 delta, seen, drop, time = 0, lost = 0;
+    const gint64* timestamps = block->timestamps;
+    const gint32* capacities = block->capacities;
+    const guint8* discharging = block->discharging;
+
+    for (i = 1; i < block->length; i++) {
+        delta = timestamps[i] - timestamps[i - 1];
+        seen = discharging[i - 1] & (delta > 0) & (delta <= ANALYZE_MAX_GAP);
+        drop = capacities[i - 1] - capacities[i];
+        time += seen * delta;
+        lost += seen * (drop > 0 ? drop : 0);
+    }
+    *on_battery += time;
+    *drained += lost;
+}
+
+/* Discharging samples at or below the threshold right after one above it */
+static guint
+kernel_hits(const Block* block, gint32 threshold)
+{
+    guint i, hits = 0;
+    const gint32* capacities = block->capacities;
+    const guint8* discharging = block->discharging;
+
+    for (i = 1; i < block->length; i++)
+        hits += discharging[i] & (capacities[i - 1] > threshold) & (capacities[i] <= threshold);
+    return hits;
+}
+
+static void
+pack_end_discharge(Pack* pack, gint64 timestamp, gint32 capacity)
+{
+    gdouble rate, runtime, x;
+    gint64 duration = timestamp - pack->discharge_start;
+    gint32 drop = pack->discharge_capacity - capacity;
+
+    pack->discharge = FALSE;
+    pack->discharges++;
+    if (duration < ANALYZE_MIN_DISCHARGE || drop <= 0)
+        return;
+
+    rate = drop * 3600.0 / duration;
+    pack->rates[MIN((guint)rate, ANALYZE_RATE_BINS - 1)]++;
+    if (pack->wall_clock == FALSE)
+        return;
+
+    /* A shrinking pack lasts less per full charge at the same load */
+    runtime = 100 / rate;
+    if (pack->points++ == 0)
+        pack->first = pack->discharge_start;
+    pack->last = pack->discharge_start;
+    x = (pack->discharge_start - pack->first) / ANALYZE_MONTH;
+    pack->sx += x;
+    pack->sy += runtime;
+    pack->sxx += x * x;
+    pack->sxy += x * runtime;
+}
+
+/* Discharges are split where a sample is missing, like history_summarize() does */
+static void
+kernel_discharges(const Block* block, Pack* pack)
+{
+    guint i;
+    gint64 delta;
+    const gint64* timestamps = block->timestamps;
+    const gint32* capacities = block->capacities;
+    const guint8* discharging = block->discharging;
+
+    for (i = 1; i < block->length; i++) {
+        delta = timestamps[i] - timestamps[i - 1];
+        if (discharging[i - 1] && delta > 0 && delta <= ANALYZE_MAX_GAP) {
+            if (pack->discharge == FALSE) {
+                pack->discharge = TRUE;
+                pack->discharge_start = timestamps[i - 1];
+                pack->discharge_capacity = capacities[i - 1];
+            }
+        } else if (pack->discharge == TRUE)
+            pack_end_discharge(pack, timestamps[i - 1], capacities[i - 1]);
+    }
+}
+
+static void
+pack_flush(Pack* pack)
+{
+    guint i;
+    Block* block = pack->block;
+
+    if (block->length < 2)
+        return;
+
+    kernel_drain(block, &pack->on_battery, &pack->drained);
+    for (i = 0; i < analysis.n_thresholds; i++)
+        pack->hits[i] += kernel_hits(block, analysis.thresholds[i]);
+    kernel_discharges(block, pack);
+
+    block->timestamps[0] = block->timestamps[block->length - 1];
+    block->capacities[0] = block->capacities[block->length - 1];
+    block->discharging[0] = block->discharging[block->length - 1];
+    block->length = 1;
+}
+
+static Pack*
+pack_new(const gchar* model, gboolean wall_clock)
+{
+    Pack* pack = g_new0(Pack, 1);
+
+    pack->model = g_strdup(model != NULL && *model != '\0' ? model : UNKNOWN_MODEL);
+    pack->wall_clock = wall_clock;
+    pack->block = g_new(Block, 1);
+    pack->block->length = 0;
+    pack->capacity = -1;
+    return pack;
+}
+
+/* A sample without capacity keeps the last one known */
+static void
+pack_add(Pack* pack, gint64 timestamp, BATTERY_STATUS status, gint32 capacity)
+{
+    Block* block = pack->block;
+
+    if (capacity >= 0)
+        pack->capacity = capacity;
+    if (pack->capacity < 0 || status < UNKNOWN_STATUS)
+        return;
+
+    pack->samples++;
+    block->timestamps[block->length] = timestamp;
+    block->capacities[block->length] = pack->capacity;
+    block->discharging[block->length] = status == DISCHARGING_STATUS;
+    if (++block->length == ANALYZE_BLOCK_SAMPLES)
+        pack_flush(pack);
+}
+
+static void
+model_add_pack(Model* model, const Pack* pack)
+{
+    guint i;
+    gdouble n = pack->points, slope, mean;
+
+    model->packs++;
+    model->samples += pack->samples;
+    model->on_battery += pack->on_battery;
+    model->drained += pack->drained;
+    model->discharges += pack->discharges;
+    for (i = 0; i < ANALYZE_MAX_THRESHOLDS; i++)
+        model->hits[i] += pack->hits[i];
+    for (i = 0; i < ANALYZE_RATE_BINS; i++)
+        model->rates[i] += pack->rates[i];
+
+    if (pack->points < 3 || pack->last - pack->first < ANALYZE_MIN_SPAN)
+        return;
+    slope = (n * pack->sxy - pack->sx * pack->sy) / (n * pack->sxx - pack->sx * pack->sx);
+    mean = pack->sy / n;
+    model->decay += 100 * slope / mean;
+    model->decay_packs++;
+}
+
+static void
+pack_free(Pack* pack)
+{
+    g_free(pack->block);
+    g_free(pack->model);
+    g_free(pack);
+}
+
+static void
+pack_finish(Pack* pack)
+{
+    Model* model;
+    Block* block = pack->block;
+
+    pack_flush(pack);
+    if (pack->discharge == TRUE)
+        pack_end_discharge(pack, block->timestamps[0], block->capacities[0]);
+
+    g_mutex_lock(&analysis.lock);
+    model = g_hash_table_lookup(analysis.models, pack->model);
+    if (model == NULL) {
+        model = g_new0(Model, 1);
+        g_hash_table_insert(analysis.models, g_strdup(pack->model), model);
+    }
+    model_add_pack(model, pack);
+    g_mutex_unlock(&analysis.lock);
+    pack_free(pack);
+}
+
+static void
+add_history_sample(const HistorySample* sample, Pack* pack)
+{
+    pack_add(pack, sample->timestamp, sample->status, (gint32)sample->capacity);
+}
+
+static gboolean
+analyze_history(const gchar* path, GError** error)
+{
+    HistoryInfo info = { NULL };
+    Pack* pack = pack_new(NULL, TRUE);
+
+    if (history_read(path, &info, (HistoryFunc)add_history_sample, pack, error) == FALSE) {
+        pack_free(pack);
+        return FALSE;
+    }
+
+    g_free(pack->model);
+    pack->model = g_strdup(*info.model != '\0' ? info.model : UNKNOWN_MODEL);
+    history_info_clear(&info);
+    pack_finish(pack);
+    return TRUE;
+}
+
+/* Trace time is monotonic, so it gives rates and hits but no age */
+static gboolean
+analyze_trace(const gchar* path, GError** error)
+{
+    Pack* pack;
+    TraceRecord record;
+    GHashTable* packs;
+    GHashTableIter iter;
+    TraceReader* reader = trace_reader_new(path, error);
+
+    if (reader == NULL)
+        return FALSE;
+
+    packs = g_hash_table_new(g_direct_hash, g_direct_equal);
+    while (trace_reader_next(reader, &record, error) == TRUE) {
+        switch (record.type) {
+            case TRACE_BATTERY:
+                pack = pack_new(record.battery->model_name, FALSE);
+                g_hash_table_insert(packs, GUINT_TO_POINTER(record.id), pack);
+                battery_unref(record.battery);
+                break;
+            case TRACE_SAMPLE:
+                pack = g_hash_table_lookup(packs, GUINT_TO_POINTER(record.id));
+                if (pack != NULL)
+                    pack_add(pack,
+                             record.timestamp / G_USEC_PER_SEC,
+                             record.status,
+                             (record.flags & TRACE_HAS_CAPACITY) ? (gint32)record.capacity : -1);
+                break;
+            case TRACE_RETIRE:
+                pack = g_hash_table_lookup(packs, GUINT_TO_POINTER(record.id));
+                if (pack != NULL) {
+                    g_hash_table_remove(packs, GUINT_TO_POINTER(record.id));
+                    pack_finish(pack);
+                }
+                break;
+        }
+    }
+
+    /* A truncated trace still counts up to the cut */
+    g_hash_table_iter_init(&iter, packs);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer*)&pack) == TRUE)
+        pack_finish(pack);
+    g_hash_table_destroy(packs);
+    trace_reader_free(reader);
+    return error == NULL || *error == NULL;
+}
+
+static FILE_KIND
+get_file_kind(const gchar* path)
+{
+    gchar magic[sizeof(HISTORY_MAGIC) - 1];
+    FILE_KIND kind = UNKNOWN_FILE;
+    FILE* file = fopen(path, "rb");
+
+    if (file == NULL)
+        return UNKNOWN_FILE;
+    if (fread(magic, 1, sizeof(magic), file) == sizeof(magic)) {
+        if (memcmp(magic, HISTORY_MAGIC, sizeof(magic)) == 0)
+            kind = HISTORY_FILE;
+        else if (memcmp(magic, TRACE_MAGIC, sizeof(magic)) == 0)
+            kind = TRACE_FILE;
+    }
+    fclose(file);
+    return kind;
+}
+
+static void
+analyze_file(const gchar* path, gpointer user_data)
+{
+    gboolean result;
+    GError* error = NULL;
+
+    if (get_file_kind(path) == HISTORY_FILE)
+        result = analyze_history(path, &error);
+    else
+        result = analyze_trace(path, &error);
+
+    if (result == FALSE) {
+        g_warning("Skip %s: %s", path, error != NULL ? error->message : "unknown error");
+        g_clear_error(&error);
+        g_mutex_lock(&analysis.lock);
+        analysis.failed = TRUE;
+        g_mutex_unlock(&analysis.lock);
+    }
+}
+
+/* Files named on the command line are always tried, in directories only batify files */
+static void
+collect_files(const gchar* path, gboolean explicit, GPtrArray* files)
+{
+    GDir* dir;
+    const gchar* name;
+    GError* error = NULL;
+
+    if (g_file_test(path, G_FILE_TEST_IS_DIR) == FALSE) {
+        if (explicit == TRUE || get_file_kind(path) != UNKNOWN_FILE)
+            g_ptr_array_add(files, g_strdup(path));
+        return;
+    }
+
+    dir = g_dir_open(path, 0, &error);
+    if (dir == NULL) {
+        g_warning("Skip %s: %s", path, error->message);
+        g_error_free(error);
+        analysis.failed = TRUE;
+        return;
+    }
+    while ((name = g_dir_read_name(dir)) != NULL) {
+        gchar* child = g_build_filename(path, name, NULL);
+        collect_files(child, FALSE, files);
+        g_free(child);
+    }
+    g_dir_close(dir);
+}
+
+static guint
+get_rate_percentile(const Model* model, guint percent)
+{
+    guint i, count = 0, total = 0;
+
+    for (i = 0; i < ANALYZE_RATE_BINS; i++)
+        total += model->rates[i];
+    for (i = 0; i < ANALYZE_RATE_BINS; i++) {
+        count += model->rates[i];
+        if (count * 100 >= total * percent)
+            break;
+    }
+    return i;
+}
+
+static void
+print_model(const gchar* name, const Model* model)
+{
+    guint i, rated = 0;
+
+    printf("%s: %u packs, %" G_GUINT64_FORMAT " samples, %u discharges, %" G_GINT64_FORMAT
+           "h on battery",
+           name,
+           model->packs,
+           model->samples,
+           model->discharges,
+           model->on_battery / 3600);
+    if (model->on_battery > 0)
+        printf(", %.1f %%/h", model->drained * 3600.0 / model->on_battery);
+    printf("\n");
+
+    for (i = 0; i < ANALYZE_RATE_BINS; i++)
+        rated += model->rates[i];
+    if (rated > 0)
+        printf("  drain p10 %u, p50 %u, p90 %u %%/h\n",
+               get_rate_percentile(model, 10),
+               get_rate_percentile(model, 50),
+               get_rate_percentile(model, 90));
+    if (model->decay_packs > 0)
+        printf("  runtime per full charge %+.2f %%/month over %u packs\n",
+               model->decay / model->decay_packs,
+               model->decay_packs);
+    for (i = 0; i < analysis.n_thresholds && model->discharges > 0; i++)
+        printf("  below %d%%: %u hits, %.1f per 100 discharges\n",
+               analysis.thresholds[i],
+               model->hits[i],
+               model->hits[i] * 100.0 / model->discharges);
+}
+
+static gboolean
+options_init(int* argc, char*** argv)
+{
+    guint i;
+    gchar* end;
+    guint64 value;
+    GError* error = NULL;
+    GOptionContext* context = g_option_context_new("PATH...");
+
+    g_option_context_set_summary(context,
+                                 "Summarize batify histories and traces per battery model.\n"
+                                 "Directories are searched for history and trace files.");
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (g_option_context_parse(context, argc, argv, &error) == FALSE) {
+        g_option_context_free(context);
+        g_warning("Option parsing failed: %s", error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+    g_option_context_free(context);
+
+    if (*argc < 2) {
+        g_warning("No history or trace given");
+        return FALSE;
+    }
+    if (config.jobs <= 0)
+        config.jobs = g_get_num_processors();
+
+    if (config.thresholds == NULL) {
+        /* The default low and critical levels of batify */
+        analysis.thresholds[analysis.n_thresholds++] = 20;
+        analysis.thresholds[analysis.n_thresholds++] = 10;
+    }
+    for (i = 0; config.thresholds != NULL && config.thresholds[i] != NULL; i++) {
+        value = g_ascii_strtoull(config.thresholds[i], &end, 10);
+        if (end == config.thresholds[i] || *end != '\0' || value > 100) {
+            g_warning("Invalid threshold \"%s\"! Use a percent from 0 to 100",
+                      config.thresholds[i]);
+            return FALSE;
+        }
+        if (analysis.n_thresholds == ANALYZE_MAX_THRESHOLDS) {
+            g_warning("At most %d thresholds", ANALYZE_MAX_THRESHOLDS);
+            return FALSE;
+        }
+        analysis.thresholds[analysis.n_thresholds++] = (gint32)value;
+    }
+    return TRUE;
+}
+
+int
+main(int argc, char* argv[])
+{
+    gint i;
+    GList *names, *iter;
+    GPtrArray* files;
+    GThreadPool* pool;
+    GError* error = NULL;
+
+    g_set_prgname(PROGRAM_NAME);
+    if (options_init(&argc, &argv) == FALSE)
+        return 1;
+
+    g_mutex_init(&analysis.lock);
+    analysis.models = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+    /* g_option_context_parse() left only the paths */
+    files = g_ptr_array_new_with_free_func(g_free);
+    for (i = 1; i < argc; i++)
+        collect_files(argv[i], TRUE, files);
+
+    pool = g_thread_pool_new((GFunc)analyze_file, NULL, config.jobs, TRUE, &error);
+    if (pool == NULL) {
+        g_warning("Cannot start workers: %s", error->message);
+        g_error_free(error);
+        return 1;
+    }
+    for (i = 0; i < (gint)files->len; i++)
+        g_thread_pool_push(pool, g_ptr_array_index(files, i), NULL);
+    g_thread_pool_free(pool, FALSE, TRUE);
+
+    names = g_list_sort(g_hash_table_get_keys(analysis.models), (GCompareFunc)g_strcmp0);
+    for (iter = names; iter != NULL; iter = g_list_next(iter))
+        print_model(iter->data, g_hash_table_lookup(analysis.models, iter->data));
+    g_list_free(names);
+
+    g_hash_table_destroy(analysis.models);
+    g_ptr_array_free(files, TRUE);
+    g_strfreev(config.thresholds);
+    g_mutex_clear(&analysis.lock);
+    return analysis.failed == TRUE ? 1 : 0;
+}
@@ -1,7 +1,23 @@
+#define _DEFAULT_SOURCE
+
+#include <glib-unix.h>
 #include <glib.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <linux/netlink.h>
+#include <string.h>
+#include <linux/magic.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <unistd.h>
 
 #include "battery.h"
+#include "estimator.h"
+#include "probes.h"
+#include "simulation.h"
+#include "stats.h"
+#include "upower.h"
 
 #define PROPAGATE_ERROR(error, _error) \
     if (_error != NULL) \
@@ -11,9 +27,174 @@
 
 G_DEFINE_QUARK(battery-error-quark, battery_error)
 
-const gdouble HOUR = 3600.0;
 const guint64 PERCENTAGE = 100;
 
+static gchar* sysfs_path = NULL;
+
+static struct changed
+{
+    BatteryChanged handler;
+    gpointer user_data;
+} changed = { NULL, NULL };
+
+static struct supply_changed
+{
+    BatterySupplyChanged handler;
+    gpointer user_data;
+} supply_changed = { NULL, NULL };
+
+static struct alarm_level
+{
+    BatteryAlarmLevel handler;
+    gpointer user_data;
+} alarm_level = { NULL, NULL };
+
+/*
+ * Kernel uevents of the power supply class and the batteries of the last
+ * scan by name, so a change uevent maps to the identity of its battery.
+ */
+static struct uevent
+{
+    gint fd;
+    GSource* source;
+    GHashTable* identities;
+} uevent = { -1, NULL, NULL };
+
+/*
+ * An open sysfs attribute. The fd stays registered with the notify source,
+ * reading it re-arms POLLPRI. Once the driver has called sysfs_notify() on
+ * it, the attribute is trusted to notify and is answered from value.
+ */
+typedef struct _Attribute
+{
+    gint fd;
+    gpointer tag;
+    gchar* name;
+    const gchar* identity;
+    gchar* value;
+    gboolean notifies;
+} Attribute;
+
+static struct notify
+{
+    GSource* source;
+    GHashTable* attributes;
+} notify = { NULL, NULL };
+
+/*
+ * Time estimation state of a battery. The full level barely moves, so it
+ * is read again only every SYSFS_FULL_REFRESH samples, and a rate
+ * attribute that does not exist is not looked for again.
+ */
+#define SYSFS_FULL_REFRESH 64
+
+typedef struct _Estimate
+{
+    gchar* name;
+    const gchar* identity;
+    BATTERY_STATUS status;
+    gboolean has_rate;
+    guint64 full;
+    guint samples;
+    Estimator estimator;
+} Estimate;
+
+static GHashTable* estimates = NULL;
+
+/*
+ * Firmware alarm of a battery: the value found before the first write,
+ * restored on exit, and the level armed last, so a scan re-arms the alarm
+ * only when the policy of the battery changed.
+ */
+typedef struct _Alarm
+{
+    gchar* sys_filename;
+    const gchar* identity;
+    gchar* original;
+    guint level;
+} Alarm;
+
+static GHashTable* alarms = NULL;
+
+/*
+ * Selection and metadata of the supplies of the last scan by name. An entry
+ * is read again only when its directory was replaced, a uevent reported
+ * the supply, or every SYSFS_SUPPLY_REFRESH scans for swaps nothing
+ * reported, so rescanning unchanged supplies costs one lstat each.
+ */
+#define SYSFS_SUPPLY_REFRESH 60
+
+typedef struct _Supply
+{
+    ino_t inode;
+    guint scans;
+    gboolean stale;
+    Battery* battery;
+} Supply;
+
+static GHashTable* supplies = NULL;
+
+static const gchar* notify_attributes[] = { BATTERY_STATUS_FILENAME, BATTERY_CAPACITY_FILENAME, NULL };
+
+static struct selection
+{
+    gboolean peripherals;
+    gchar** include;
+    gchar** exclude;
+} selection = { FALSE, NULL, NULL };
+
+void battery_set_sysfs_path(const gchar* path)
+{
+    g_free(sysfs_path);
+    sysfs_path = g_strdup(path);
+}
+
+const gchar* battery_get_sysfs_path(void)
+{
+    if (sysfs_path == NULL)
+        return SYSFS_BASE_PATH;
+    return sysfs_path;
+}
+
+/*
+ * Include and exclude are shell globs on the supply name. Device scoped
+ * supplies (mice, keyboards, controllers, USB packs) are selected when
+ * peripherals are enabled or when include globs are given explicitly.
+ */
+void battery_set_selection(gboolean peripherals, gchar** include, gchar** exclude)
+{
+    g_strfreev(selection.include);
+    g_strfreev(selection.exclude);
+    selection.peripherals = peripherals;
+    selection.include = g_strdupv(include);
+    selection.exclude = g_strdupv(exclude);
+    if (supplies != NULL)
+        g_hash_table_remove_all(supplies);
+}
+
+static gboolean _attribute_read(Attribute* attribute, const gchar* sys_filename, GError** error)
+{
+    gssize length;
+    gchar buffer[4096];
+
+    length = pread(attribute->fd, buffer, sizeof(buffer) - 1, 0);
+    if (length < 0)
+    {
+        g_set_error(
+            error,
+            G_FILE_ERROR,
+            g_file_error_from_errno(errno),
+            "Failed to read from file \"%s\": %s",
+            sys_filename,
+            g_strerror(errno));
+        return FALSE;
+    }
+
+    g_free(attribute->value);
+    attribute->value = g_strndup(buffer, length);
+    return TRUE;
+}
+
 static gboolean _get_sysattr_string_by_path(
     const gchar* battery_name,
     const gchar* sys_path,
@@ -23,11 +204,34 @@ static gboolean _get_sysattr_string_by_path(
 {
     gchar *sys_filename;
     gboolean result;
+    gint64 start_time, latency;
+    Attribute* attribute = NULL;
 
     sys_filename = g_build_filename(sys_path, sys_attr, NULL);
+    if (notify.attributes != NULL)
+        attribute = g_hash_table_lookup(notify.attributes, sys_filename);
+
+    /* Unchanged since its last notification, no sysfs read */
+    if (attribute != NULL && attribute->notifies == TRUE)
+    {
+        *value = g_strdup(attribute->value);
+        g_free(sys_filename);
+        return TRUE;
+    }
     g_debug("Get attr: \"%s\" for battery: \"%s\"", sys_attr, battery_name);
 
-    result = g_file_get_contents(sys_filename, value, NULL, error);
+    start_time = g_get_monotonic_time();
+    if (attribute != NULL)
+    {
+        result = _attribute_read(attribute, sys_filename, error);
+        if (result == TRUE)
+            *value = g_strdup(attribute->value);
+    }
+    else
+        result = g_file_get_contents(sys_filename, value, NULL, error);
+    latency = g_get_monotonic_time() - start_time;
+    stats_attr_read(sys_attr, latency, result);
+    BATIFY_PROBE4(attr_read, battery_name, sys_attr, latency, result);
     g_free(sys_filename);
 
     return result;
@@ -72,61 +276,226 @@ static gboolean _get_sysattr_int(
     return result;
 }
 
-gboolean battery_init(Battery* battery, gchar* name, GError** error)
+static gboolean _get_sysattr_string_optional(
+    const gchar* battery_name,
+    const gchar* sys_path,
+    const gchar* sys_attr,
+    gchar** value,
+    GError** error)
+{
+    GError* _error = NULL;
+
+    if (_get_sysattr_string_by_path(battery_name, sys_path, sys_attr, value, &_error) == TRUE)
+        return TRUE;
+
+    /* Peripherals rarely expose the full set of identification attributes */
+    if (g_error_matches(_error, G_FILE_ERROR, G_FILE_ERROR_NOENT) == TRUE)
+    {
+        g_error_free(_error);
+        *value = g_strdup("");
+        return TRUE;
+    }
+
+    PROPAGATE_ERROR(error, _error);
+    return FALSE;
+}
+
+static gboolean _match_any(gchar** patterns, const gchar* name)
+{
+    for (; *patterns != NULL; patterns++)
+    {
+        if (g_pattern_match_simple(*patterns, name) == TRUE)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+static gboolean _is_name_selected(const gchar* name)
+{
+    if (selection.include != NULL && _match_any(selection.include, name) == FALSE)
+        return FALSE;
+    if (selection.exclude != NULL && _match_any(selection.exclude, name) == TRUE)
+        return FALSE;
+    return TRUE;
+}
+
+static gboolean _is_peripheral_selected(void)
+{
+    return selection.peripherals == TRUE || selection.include != NULL;
+}
+
+gboolean battery_is_selected(const gchar* name, gboolean peripheral)
+{
+    if (_is_name_selected(name) == FALSE)
+        return FALSE;
+    return peripheral == FALSE || _is_peripheral_selected() == TRUE;
+}
+
+static gboolean _is_supply_selected(const gchar* name, gboolean* peripheral)
 {
     gboolean result;
-    gchar* model_name, *manufacture, *technology, *serial_number;
-    gchar* sys_path = g_strjoin("", SYSFS_BASE_PATH, name, NULL);
+    gchar* sys_path, *type, *scope;
+
+    /* Name globs first, they cost no sysfs reads */
+    if (_is_name_selected(name) == FALSE)
+        return FALSE;
+
+    *peripheral = FALSE;
+    sys_path = g_build_filename(battery_get_sysfs_path(), name, NULL);
+    if (_get_sysattr_string_by_path(name, sys_path, BATTERY_TYPE_FILENAME, &type, NULL) == FALSE)
+    {
+        g_free(sys_path);
+        return g_str_has_prefix(name, SYSFS_BATTERY_PREFIX);
+    }
+
+    result = g_str_has_prefix(type, SYSFS_TYPE_BATTERY);
+    g_free(type);
+
+    if (result == TRUE &&
+        _get_sysattr_string_by_path(name, sys_path, BATTERY_SCOPE_FILENAME, &scope, NULL) == TRUE)
+    {
+        *peripheral = g_str_has_prefix(scope, SYSFS_SCOPE_DEVICE);
+        g_free(scope);
+    }
+    g_free(sys_path);
+
+    if (*peripheral == TRUE)
+        return _is_peripheral_selected();
+    return result;
+}
+
+/*
+ * Interned "<sys_path>|<serial>", so identities compare by pointer. The path
+ * alone is reused by the next device in the slot, the serial alone is empty
+ * or duplicated on many packs and peripherals. The string is refcounted and
+ * leaves the intern table with its last holder, so churn does not grow it.
+ */
+static const gchar* _get_battery_identity(const gchar* sys_path, const gchar* serial_number)
+{
+    const gchar* identity;
+    gchar* key = g_strjoin("|", sys_path, serial_number, NULL);
+
+    identity = g_ref_string_new_intern(key);
+    g_free(key);
+    return identity;
+}
+
+static gchar* _pack_string(gchar** cursor, const gchar* value)
+{
+    gchar* result = *cursor;
+    gsize length = strlen(value) + 1;
+
+    memcpy(result, value, length);
+    *cursor += length;
+    return result;
+}
+
+/* One allocation: the struct followed by all of its strings */
+static Battery* _battery_pack(
+    const gchar* name,
+    const gchar* sys_path,
+    const gchar* model_name,
+    const gchar* manufacture,
+    const gchar* technology,
+    const gchar* serial_number)
+{
+    Battery* battery;
+    gchar* cursor;
+    gsize size = strlen(name) + strlen(sys_path) + strlen(model_name) + strlen(manufacture) +
+                 strlen(technology) + strlen(serial_number) + 6;
+
+    battery = g_malloc(sizeof(Battery) + size);
+    stats_counter_inc(STAT_ALLOCATIONS);
+    cursor = battery->strings;
+    battery->ref_count = 1;
+    battery->name = _pack_string(&cursor, name);
+    battery->sys_path = _pack_string(&cursor, sys_path);
+    battery->model_name = _pack_string(&cursor, model_name);
+    battery->manufacture = _pack_string(&cursor, manufacture);
+    battery->technology = _pack_string(&cursor, technology);
+    battery->serial_number = _pack_string(&cursor, serial_number);
+    battery->identity = NULL;
+    battery->use_charge = FALSE;
+    battery->peripheral = FALSE;
+    return battery;
+}
+
+Battery* battery_new_full(
+    const gchar* name,
+    const gchar* sys_path,
+    const gchar* model_name,
+    const gchar* manufacture,
+    const gchar* technology,
+    const gchar* serial_number)
+{
+    Battery* battery = _battery_pack(name, sys_path, model_name, manufacture, technology, serial_number);
+
+    battery->identity = _get_battery_identity(sys_path, battery->serial_number);
+    return battery;
+}
+
+Battery* battery_new(const gchar* name, GError** error)
+{
+    gboolean result;
+    Battery* battery = NULL;
+    gchar* model_name = NULL, *manufacture = NULL, *technology = NULL, *serial_number = NULL;
+    gchar* sys_path = g_build_filename(battery_get_sysfs_path(), name, NULL);
     gchar* charge_file_path;
-    
-    result = _get_sysattr_string_by_path(name, sys_path, BATTERY_MANUFACTUR_FILENAME, &manufacture, error);
-    g_return_val_if_fail(result, FALSE);
-
-    result = _get_sysattr_string_by_path(name, sys_path, BATTERY_MODEL_NAME_FILENAME, &model_name, error);
-    g_return_val_if_fail(result, FALSE);
-
-    result = _get_sysattr_string_by_path(name, sys_path, BATTERY_TECHNOLOGY_FILENAME, &technology, error);
-    g_return_val_if_fail(result, FALSE);
-    result = _get_sysattr_string_by_path(name, sys_path, BATTERY_SERIAL_NUMBER_FILENAME, &serial_number, error);
-    g_return_val_if_fail(result, FALSE);
-
-    charge_file_path = g_build_filename(sys_path, BATTERY_CHARGE_NOW_FILENAME, NULL);
-    battery->use_charge = g_file_test(charge_file_path, G_FILE_TEST_EXISTS);
-    g_free(charge_file_path);
-
-    battery->sys_path = sys_path;
-    battery->name = name;
-    battery->model_name = g_strstrip(model_name);
-    battery->manufacture = g_strstrip(manufacture);
-    battery->technology = g_strstrip(technology);
-    battery->serial_number = g_strstrip(serial_number);
-    return TRUE;
+
+    result = _get_sysattr_string_optional(name, sys_path, BATTERY_MANUFACTUR_FILENAME, &manufacture, error);
+    if (result == TRUE)
+        result = _get_sysattr_string_optional(name, sys_path, BATTERY_MODEL_NAME_FILENAME, &model_name, error);
+    if (result == TRUE)
+        result = _get_sysattr_string_optional(name, sys_path, BATTERY_TECHNOLOGY_FILENAME, &technology, error);
+    if (result == TRUE)
+        result = _get_sysattr_string_optional(name, sys_path, BATTERY_SERIAL_NUMBER_FILENAME, &serial_number, error);
+
+    if (result == TRUE)
+    {
+        battery = battery_new_full(
+            name,
+            sys_path,
+            g_strstrip(model_name),
+            g_strstrip(manufacture),
+            g_strstrip(technology),
+            g_strstrip(serial_number));
+
+        charge_file_path = g_build_filename(sys_path, BATTERY_CHARGE_NOW_FILENAME, NULL);
+        battery->use_charge = g_file_test(charge_file_path, G_FILE_TEST_EXISTS);
+        g_free(charge_file_path);
+    }
+
+    g_free(manufacture);
+    g_free(model_name);
+    g_free(technology);
+    g_free(serial_number);
+    g_free(sys_path);
+    return battery;
 }
 
-Battery* battery_copy(const Battery* battery)
+Battery* battery_new_virtual(const gchar* name, const gchar* technology)
 {
-    Battery* new_battery = g_new(Battery, 1);
-    new_battery->name = g_strdup(battery->name);
-    new_battery->sys_path = g_strdup(battery->sys_path);
-    new_battery->model_name = g_strdup(battery->model_name);
-    new_battery->manufacture = g_strdup(battery->manufacture);
-    new_battery->technology = g_strdup(battery->technology);
-    new_battery->serial_number = g_strdup(battery->serial_number);
-    new_battery->use_charge = battery->use_charge;
-    return new_battery;
+    return _battery_pack(name, "", "", "", technology, "");
 }
 
-void battery_free(Battery* battery)
+Battery* battery_ref(Battery* battery)
 {
-    g_free(battery->name);
-    g_free(battery->sys_path);
-    g_free(battery->model_name);
-    g_free(battery->manufacture);
-    g_free(battery->technology);
-    g_free(battery->serial_number);
+    g_atomic_int_inc(&battery->ref_count);
+    return battery;
 }
 
-gboolean get_battery_status(const Battery* battery, BATTERY_STATUS* status, GError** error)
+void battery_unref(Battery* battery)
+{
+    if (g_atomic_int_dec_and_test(&battery->ref_count))
+    {
+        if (battery->identity != NULL)
+            g_ref_string_release((gchar*)battery->identity);
+        stats_counter_inc(STAT_FREES);
+        g_free(battery);
+    }
+}
+
+static gboolean _sysfs_get_battery_status(const Battery* battery, BATTERY_STATUS* status, GError** error)
 {
     gboolean result;
     GError* _error = NULL;
@@ -163,7 +532,7 @@ static gboolean _get_battery_capacity(
 {
     gboolean result;
     guint64 now, full;
-    GError* _error;
+    GError* _error = NULL;
 
     result = _get_sysattr_int(battery, now_filename, &now, &_error);
     if (result == FALSE)
@@ -203,7 +572,7 @@ static gboolean _get_battery_capacity_energy(const Battery* battery, guint64* ca
         error);
 }
 
-gboolean get_battery_capacity(const Battery* battery, guint64* capacity, GError** error)
+static gboolean _sysfs_get_battery_capacity(const Battery* battery, guint64* capacity, GError** error)
 {
     gboolean result;
 
@@ -218,6 +587,42 @@ gboolean get_battery_capacity(const Battery* battery, guint64* capacity, GError*
     return result;
 }
 
+static void _estimate_free(Estimate* estimate)
+{
+    g_ref_string_release((gchar*)estimate->identity);
+    g_free(estimate->name);
+    g_free(estimate);
+}
+
+static Estimate* _get_estimate(const Battery* battery, const gchar* rate_filename)
+{
+    gchar* sys_filename;
+    Estimate* estimate;
+
+    if (estimates == NULL)
+        estimates = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)_estimate_free);
+
+    estimate = g_hash_table_lookup(estimates, battery->identity);
+    if (estimate != NULL)
+        return estimate;
+
+    sys_filename = g_build_filename(battery->sys_path, rate_filename, NULL);
+    estimate = g_new0(Estimate, 1);
+    estimate->name = g_strdup(battery->name);
+    estimate->identity = g_ref_string_acquire((gchar*)battery->identity);
+    estimate->has_rate = g_file_test(sys_filename, G_FILE_TEST_EXISTS);
+    estimator_reset(&estimate->estimator);
+    g_hash_table_insert(estimates, (gpointer)battery->identity, estimate);
+    g_free(sys_filename);
+    return estimate;
+}
+
+static gboolean _estimate_is_stale(const gchar* identity, const Estimate* estimate, GHashTable* identities)
+{
+    return g_hash_table_lookup(identities, estimate->name) != identity;
+}
+
+/* Without an estimate yet, a rate of 0 or no rate attribute, seconds is 0 */
 static gboolean _get_battery_time(
     const Battery* battery, 
     const gchar* now_filename,
@@ -229,7 +634,15 @@ static gboolean _get_battery_time(
 {
     gboolean result;
     GError* _error = NULL;
-    guint64 charge_now, charge_full, current_now;
+    guint64 charge_now, remaining, current_now = 0;
+    Estimate* estimate = _get_estimate(battery, power_filename);
+
+    /* The rate of the other direction says nothing about this one */
+    if (status != estimate->status)
+    {
+        estimator_reset(&estimate->estimator);
+        estimate->status = status;
+    }
     
     result = _get_sysattr_int(battery, now_filename, &charge_now, &_error);
     if (result == FALSE)
@@ -238,34 +651,38 @@ static gboolean _get_battery_time(
         return FALSE;
     }
     
-    result = _get_sysattr_int(battery, full_filename, &charge_full, &_error);
-    if (result == FALSE)
+    if (estimate->samples % SYSFS_FULL_REFRESH == 0 || charge_now > estimate->full)
     {
-        PROPAGATE_ERROR(error, _error);
-        return FALSE;
+        result = _get_sysattr_int(battery, full_filename, &estimate->full, &_error);
+        if (result == FALSE)
+        {
+            PROPAGATE_ERROR(error, _error);
+            return FALSE;
+        }
     }
+    estimate->samples++;
 
-    result = _get_sysattr_int(battery, power_filename, &current_now, &_error);
-    if (result == FALSE)
-    {
-        PROPAGATE_ERROR(error, _error);
-        return FALSE;
-    }
+    if (estimate->has_rate == TRUE && _get_sysattr_int(battery, power_filename, &current_now, NULL) == FALSE)
+        current_now = 0;
+    estimator_update(&estimate->estimator, g_get_monotonic_time(), charge_now, current_now);
     
     switch (status)
     {
         case DISCHARGING_STATUS:
         case NOT_CHARGING_STATUS:
-            *seconds = (guint64)(HOUR * charge_now / current_now);
+            remaining = charge_now;
             break;
         case CHARGING_STATUS:
         case CHARGED_STATUS:
-            *seconds = (guint64)(HOUR * (charge_full - charge_now) / current_now);
+            remaining = estimate->full - MIN(charge_now, estimate->full);
             break;
         default:
             g_set_error(error, BATTERY_ERROR, BATTERY_INVALID_STATUS, "Invalid status for get_battery_time: \"%d\"", status);
             return FALSE;
     }
+
+    if (estimator_get_time(&estimate->estimator, remaining, seconds) == FALSE)
+        *seconds = 0;
     return TRUE;
 }
 
@@ -301,8 +718,11 @@ static gboolean _get_battery_time_energy(
         error);
 }
 
-
-gboolean get_battery_time(const Battery* battery, BATTERY_STATUS status, guint64* seconds, GError** error)
+static gboolean _sysfs_get_battery_time(
+    const Battery* battery,
+    BATTERY_STATUS status,
+    guint64* seconds,
+    GError** error)
 {
     gboolean result;
 
@@ -313,24 +733,550 @@ gboolean get_battery_time(const Battery* battery, BATTERY_STATUS status, guint64
     return result;
 }
 
-gboolean get_batteries_supply(GSList** list, GError** error)
+static gboolean _get_battery_energy(
+    const Battery* battery,
+    const gchar* now_filename,
+    const gchar* full_filename,
+    const gchar* rate_filename,
+    guint64* now,
+    guint64* full,
+    guint64* rate,
+    GError** error)
+{
+    gboolean result;
+    GError* _error = NULL;
+
+    result = _get_sysattr_int(battery, now_filename, now, &_error);
+    if (result == FALSE)
+    {
+        PROPAGATE_ERROR(error, _error);
+        return FALSE;
+    }
+
+    result = _get_sysattr_int(battery, full_filename, full, &_error);
+    if (result == FALSE)
+    {
+        PROPAGATE_ERROR(error, _error);
+        return FALSE;
+    }
+
+    /* Firmware without a rate attribute still reports a usable level */
+    if (rate != NULL && _get_sysattr_int(battery, rate_filename, rate, NULL) == FALSE)
+        *rate = 0;
+    return TRUE;
+}
+
+/*
+ * Energy in uWh and power in uW. Charge based batteries report uAh and uA,
+ * they are converted with the present voltage so that batteries of both
+ * kinds can be summed.
+ */
+static gboolean _sysfs_get_battery_energy(
+    const Battery* battery,
+    guint64* now,
+    guint64* full,
+    guint64* rate,
+    GError** error)
+{
+    gboolean result;
+    GError* _error = NULL;
+    guint64 voltage;
+
+    if (battery->use_charge == FALSE)
+        return _get_battery_energy(
+            battery,
+            BATTERY_ENERGY_NOW_FILENAME,
+            BATTERY_ENERGY_FULL_FILENAME,
+            BATTERY_POWER_NOW_FILENAME,
+            now,
+            full,
+            rate,
+            error);
+
+    result = _get_battery_energy(
+        battery,
+        BATTERY_CHARGE_NOW_FILENAME,
+        BATTERY_CHARGE_FULL_FILENAME,
+        BATTERY_CURRENT_NOW_FILENAME,
+        now,
+        full,
+        rate,
+        error);
+    if (result == FALSE)
+        return FALSE;
+
+    result = _get_sysattr_int(battery, BATTERY_VOLTAGE_NOW_FILENAME, &voltage, &_error);
+    if (result == FALSE)
+    {
+        PROPAGATE_ERROR(error, _error);
+        return FALSE;
+    }
+
+    *now = *now * voltage / 1000000;
+    *full = *full * voltage / 1000000;
+    if (rate != NULL)
+        *rate = *rate * voltage / 1000000;
+    return TRUE;
+}
+
+/* Attributes are written in place, sysfs has no rename */
+static gboolean _set_sysattr_string(const gchar* sys_filename, const gchar* value, GError** error)
+{
+    gint fd;
+    gssize written;
+
+    fd = open(sys_filename, O_WRONLY | O_CLOEXEC);
+    written = fd < 0 ? -1 : write(fd, value, strlen(value));
+    if (written < 0)
+    {
+        g_set_error(
+            error,
+            G_FILE_ERROR,
+            g_file_error_from_errno(errno),
+            "Cannot write \"%s\": %s",
+            sys_filename,
+            g_strerror(errno));
+    }
+    if (fd >= 0)
+        close(fd);
+    return written >= 0;
+}
+
+/*
+ * The alarm attribute is the remaining energy (or charge) below which the
+ * firmware raises an event, the kernel turns it into a change uevent.
+ */
+static gboolean _sysfs_set_battery_alarm(const Battery* battery, const Alarm* alarm, GError** error)
+{
+    guint64 full;
+    gchar value[32];
+
+    if (access(alarm->sys_filename, W_OK) != 0)
+    {
+        g_set_error(error, BATTERY_ERROR, BATTERY_NO_ALARM, "Alarm of battery \"%s\" is not writable", battery->name);
+        return FALSE;
+    }
+
+    if (_get_sysattr_int(
+            battery,
+            battery->use_charge ? BATTERY_CHARGE_FULL_FILENAME : BATTERY_ENERGY_FULL_FILENAME,
+            &full,
+            error) == FALSE)
+        return FALSE;
+
+    g_snprintf(value, sizeof(value), "%" G_GUINT64_FORMAT "\n", full * alarm->level / PERCENTAGE);
+    if (_set_sysattr_string(alarm->sys_filename, value, error) == FALSE)
+        return FALSE;
+    g_debug("Battery(%s) alarm set to %s", battery->name, g_strstrip(value));
+    return TRUE;
+}
+
+static void _alarm_free(Alarm* alarm)
+{
+    g_ref_string_release((gchar*)alarm->identity);
+    g_free(alarm->sys_filename);
+    g_free(alarm->original);
+    g_free(alarm);
+}
+
+/* A pack swapped into the slot of another one starts over from its own value */
+static void _alarm_update(const Battery* battery, guint level)
+{
+    Alarm* alarm;
+    GError* _error = NULL;
+
+    if (alarms == NULL)
+        alarms = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)_alarm_free);
+
+    alarm = g_hash_table_lookup(alarms, battery->name);
+    if (alarm != NULL && alarm->identity == battery->identity)
+    {
+        if (alarm->level == level)
+            return;
+    }
+    else
+    {
+        alarm = g_new0(Alarm, 1);
+        alarm->sys_filename = g_build_filename(battery->sys_path, BATTERY_ALARM_FILENAME, NULL);
+        alarm->identity = g_ref_string_acquire((gchar*)battery->identity);
+        if (_get_sysattr_string(battery, BATTERY_ALARM_FILENAME, &alarm->original, NULL) == TRUE)
+            g_strstrip(alarm->original);
+        g_hash_table_replace(alarms, g_strdup(battery->name), alarm);
+    }
+
+    alarm->level = level;
+    if (_sysfs_set_battery_alarm(battery, alarm, &_error) == FALSE)
+    {
+        g_debug("Cannot arm battery(%s) alarm, keep polling: %s", battery->name, _error->message);
+        g_error_free(_error);
+    }
+}
+
+static gboolean _alarm_is_stale(const gchar* name, const Alarm* alarm, GHashTable* identities)
+{
+    return g_hash_table_lookup(identities, name) != alarm->identity;
+}
+
+/* Only alarms that were read before being armed have something to go back to */
+static void _alarm_restore(const gchar* name, const Alarm* alarm)
+{
+    GError* _error = NULL;
+
+    if (alarm->original == NULL)
+        return;
+
+    if (_set_sysattr_string(alarm->sys_filename, alarm->original, &_error) == FALSE)
+    {
+        g_debug("Cannot restore battery(%s) alarm: %s", name, _error->message);
+        g_error_free(_error);
+        return;
+    }
+    g_debug("Battery(%s) alarm restored to %s", name, alarm->original);
+}
+
+static gboolean _uevent_dispatch(gint fd, GIOCondition condition, gpointer user_data)
+{
+    gssize length;
+    gchar buffer[4096];
+    const gchar *iter, *end, *name = NULL, *identity;
+    gboolean power_supply = FALSE;
+    Supply* supply;
+
+    length = recv(fd, buffer, sizeof(buffer) - 1, MSG_DONTWAIT);
+    if (length <= 0)
+        return G_SOURCE_CONTINUE;
+    buffer[length] = '\0';
+
+    /* "<action>@<devpath>" followed by NUL separated KEY=VALUE pairs */
+    end = buffer + length;
+    for (iter = buffer; iter < end; iter += strlen(iter) + 1)
+    {
+        if (g_strcmp0(iter, "SUBSYSTEM=power_supply") == 0)
+            power_supply = TRUE;
+        else if (g_str_has_prefix(iter, "POWER_SUPPLY_NAME=") == TRUE)
+            name = iter + strlen("POWER_SUPPLY_NAME=");
+    }
+    if (power_supply == FALSE || name == NULL)
+        return G_SOURCE_CONTINUE;
+
+    /* Whatever happened to the supply, the next scan reads it again */
+    supply = supplies != NULL ? g_hash_table_lookup(supplies, name) : NULL;
+    if (supply != NULL)
+        supply->stale = TRUE;
+    if (g_str_has_prefix(buffer, "change@") == FALSE)
+        return G_SOURCE_CONTINUE;
+
+    identity = g_hash_table_lookup(uevent.identities, name);
+    if (identity != NULL)
+        battery_changed(identity);
+    return G_SOURCE_CONTINUE;
+}
+
+/*
+ * Polling stays the fallback: without a netlink socket (sandboxes, old
+ * kernels) batteries are still sampled on their interval.
+ */
+static void _uevent_init(void)
+{
+    struct sockaddr_nl address = { 0 };
+
+    uevent.identities = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_ref_string_release);
+
+    address.nl_family = AF_NETLINK;
+    address.nl_groups = 1;
+    uevent.fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+    if (uevent.fd < 0 || bind(uevent.fd, (struct sockaddr*)&address, sizeof(address)) < 0)
+    {
+        g_info("Cannot listen to uevents, poll batteries only: %s", g_strerror(errno));
+        if (uevent.fd >= 0)
+            close(uevent.fd);
+        uevent.fd = -1;
+        return;
+    }
+
+    uevent.source = g_unix_fd_source_new(uevent.fd, G_IO_IN);
+    g_source_set_callback(uevent.source, (GSourceFunc)_uevent_dispatch, NULL, NULL);
+    g_source_attach(uevent.source, g_main_context_get_thread_default());
+}
+
+static void _attribute_free(Attribute* attribute)
+{
+    if (attribute->tag != NULL)
+        g_source_remove_unix_fd(notify.source, attribute->tag);
+    close(attribute->fd);
+    g_ref_string_release((gchar*)attribute->identity);
+    g_free(attribute->name);
+    g_free(attribute->value);
+    g_free(attribute);
+}
+
+static gboolean _notify_dispatch(GSource* source, GSourceFunc callback, gpointer user_data)
+{
+    GHashTableIter iter;
+    const gchar* sys_filename;
+    Attribute* attribute;
+    GError* _error = NULL;
+
+    g_hash_table_iter_init(&iter, notify.attributes);
+    while (g_hash_table_iter_next(&iter, (gpointer*)&sys_filename, (gpointer*)&attribute))
+    {
+        if (attribute->tag == NULL ||
+            (g_source_query_unix_fd(source, attribute->tag) & (G_IO_PRI | G_IO_ERR)) == 0)
+            continue;
+
+        if (attribute->notifies == FALSE)
+            g_debug("Attribute \"%s\" notifies, stop reading it periodically", sys_filename);
+        attribute->notifies = TRUE;
+        if (_attribute_read(attribute, sys_filename, &_error) == FALSE)
+        {
+            /* A removed attribute polls as ready forever, back to periodic reads until the rescan */
+            g_debug("%s", _error->message);
+            g_clear_error(&_error);
+            g_source_remove_unix_fd(source, attribute->tag);
+            attribute->tag = NULL;
+            attribute->notifies = FALSE;
+        }
+        battery_changed(attribute->identity);
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+static GSourceFuncs notify_source_funcs = {
+    NULL,
+    NULL,
+    _notify_dispatch,
+    NULL,
+};
+
+static void _notify_init(void)
+{
+    notify.attributes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)_attribute_free);
+    notify.source = g_source_new(&notify_source_funcs, sizeof(GSource));
+    g_source_attach(notify.source, g_main_context_get_thread_default());
+}
+
+/*
+ * Only attributes on sysfs can notify, a fake tree keeps its plain reads.
+ * Whether the driver ever calls sysfs_notify() shows with the first POLLPRI.
+ */
+static void _notify_watch(const Battery* battery)
+{
+    gint fd;
+    struct statfs fs;
+    Attribute* attribute;
+    gchar* sys_filename;
+    const gchar** sys_attr;
+
+    for (sys_attr = notify_attributes; *sys_attr != NULL; sys_attr++)
+    {
+        sys_filename = g_build_filename(battery->sys_path, *sys_attr, NULL);
+        fd = open(sys_filename, O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || fstatfs(fd, &fs) < 0 || fs.f_type != SYSFS_MAGIC)
+        {
+            if (fd >= 0)
+                close(fd);
+            g_free(sys_filename);
+            continue;
+        }
+
+        attribute = g_new0(Attribute, 1);
+        attribute->fd = fd;
+        attribute->name = g_strdup(battery->name);
+        attribute->identity = g_ref_string_acquire((gchar*)battery->identity);
+        attribute->tag = g_source_add_unix_fd(notify.source, fd, G_IO_PRI | G_IO_ERR);
+        _attribute_read(attribute, sys_filename, NULL);
+        g_hash_table_replace(notify.attributes, sys_filename, attribute);
+    }
+}
+
+static gboolean _notify_is_stale(const gchar* sys_filename, const Attribute* attribute, GHashTable* identities)
+{
+    return g_hash_table_lookup(identities, attribute->name) != attribute->identity;
+}
+
+static void _sysfs_uninit(void)
+{
+    if (supplies != NULL)
+    {
+        g_hash_table_destroy(supplies);
+        supplies = NULL;
+    }
+    if (alarms != NULL)
+    {
+        g_hash_table_foreach(alarms, (GHFunc)_alarm_restore, NULL);
+        g_hash_table_destroy(alarms);
+        alarms = NULL;
+    }
+    if (estimates != NULL)
+    {
+        g_hash_table_destroy(estimates);
+        estimates = NULL;
+    }
+    if (notify.attributes != NULL)
+    {
+        g_hash_table_destroy(notify.attributes);
+        notify.attributes = NULL;
+        g_source_destroy(notify.source);
+        g_source_unref(notify.source);
+        notify.source = NULL;
+    }
+    if (uevent.source != NULL)
+    {
+        g_source_destroy(uevent.source);
+        g_source_unref(uevent.source);
+        uevent.source = NULL;
+    }
+    if (uevent.fd >= 0)
+    {
+        close(uevent.fd);
+        uevent.fd = -1;
+    }
+    if (uevent.identities != NULL)
+    {
+        g_hash_table_destroy(uevent.identities);
+        uevent.identities = NULL;
+    }
+}
+
+/* Batteries missing from the previous scan are new, their attributes get watched */
+static void _uevent_track(GHashTable* identities, const Battery* battery)
+{
+    g_hash_table_insert(identities, g_strdup(battery->name), g_ref_string_acquire((gchar*)battery->identity));
+    if (g_hash_table_lookup(uevent.identities, battery->name) == battery->identity)
+        return;
+
+    _notify_watch(battery);
+}
+
+/* Full over design capacity, the units cancel out */
+static gboolean _sysfs_get_battery_health(const Battery* battery, gdouble* health, GError** error)
+{
+    gboolean result;
+    GError* _error = NULL;
+    guint64 full, design;
+
+    result = _get_sysattr_int(
+        battery,
+        battery->use_charge ? BATTERY_CHARGE_FULL_FILENAME : BATTERY_ENERGY_FULL_FILENAME,
+        &full,
+        &_error);
+    if (result == TRUE)
+        result = _get_sysattr_int(
+            battery,
+            battery->use_charge ? BATTERY_CHARGE_FULL_DESIGN_FILENAME : BATTERY_ENERGY_FULL_DESIGN_FILENAME,
+            &design,
+            &_error);
+    if (result == FALSE)
+    {
+        PROPAGATE_ERROR(error, _error);
+        return FALSE;
+    }
+
+    if (design == 0)
+    {
+        g_set_error(error, BATTERY_ERROR, BATTERY_NO_HEALTH, "Battery \"%s\" reports no design capacity", battery->name);
+        return FALSE;
+    }
+    *health = (gdouble)full / design;
+    return TRUE;
+}
+
+static void _supply_free(Supply* supply)
+{
+    if (supply->battery != NULL)
+        battery_unref(supply->battery);
+    g_free(supply);
+}
+
+/* NULL when the supply cannot be read, so the next scan tries again */
+static Supply* _supply_new(const gchar* name, ino_t inode)
+{
+    gboolean peripheral = FALSE;
+    GError* _error = NULL;
+    Supply* supply = g_new0(Supply, 1);
+
+    supply->inode = inode;
+    if (_is_supply_selected(name, &peripheral) == FALSE)
+        return supply;
+
+    supply->battery = battery_new(name, &_error);
+    if (supply->battery == NULL)
+    {
+        /* The supply may have gone away since the directory was read */
+        g_warning("Skip power supply \"%s\": %s", name, _error->message);
+        g_error_free(_error);
+        g_free(supply);
+        return NULL;
+    }
+    supply->battery->peripheral = peripheral;
+    return supply;
+}
+
+/* The cached entry moves to the fresh table unless it has to be read again */
+static Supply* _supply_update(GHashTable* fresh, const gchar* name)
+{
+    Supply* supply = NULL;
+    gpointer key = NULL;
+    struct stat st;
+    gchar* sys_path = g_build_filename(battery_get_sysfs_path(), name, NULL);
+    gboolean exists = lstat(sys_path, &st) == 0;
+
+    g_free(sys_path);
+    if (exists == FALSE)
+        return NULL;
+
+    if (g_hash_table_lookup_extended(supplies, name, &key, (gpointer*)&supply) == TRUE &&
+        supply->inode == st.st_ino && supply->stale == FALSE && ++supply->scans < SYSFS_SUPPLY_REFRESH)
+    {
+        g_hash_table_steal(supplies, name);
+    }
+    else
+    {
+        key = g_strdup(name);
+        supply = _supply_new(name, st.st_ino);
+    }
+
+    if (supply == NULL)
+    {
+        g_free(key);
+        return NULL;
+    }
+    g_hash_table_insert(fresh, key, supply);
+    return supply;
+}
+
+static gboolean _sysfs_get_batteries_supply(GSList** list, GError** error)
 {
     Battery* battery;
+    Supply* supply;
+    GHashTable* identities;
+    GHashTable* fresh;
     const gchar* dir_name;
-    GDir* dir = g_dir_open(SYSFS_BASE_PATH, 0, error); 
+    GDir* dir = g_dir_open(battery_get_sysfs_path(), 0, error); 
     if (dir == NULL)
         return FALSE;
+
+    /* Started on the first scan, so uevents arrive on the context of the scans */
+    if (uevent.identities == NULL)
+    {
+        _uevent_init();
+        _notify_init();
+    }
+    if (supplies == NULL)
+        supplies = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)_supply_free);
+    identities = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_ref_string_release);
+    fresh = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)_supply_free);
     
     dir_name = g_dir_read_name(dir);
     while(dir_name != NULL)
     {
-        if (g_str_has_prefix(dir_name, SYSFS_BATTERY_PREFIX))
+        supply = _supply_update(fresh, dir_name);
+        if (supply != NULL && supply->battery != NULL)
         {
-            battery = g_new(Battery, 1);
-            if (battery_init(battery, g_strdup(dir_name), error) == FALSE)
-            {
-                return FALSE;
-            }
+            battery = battery_ref(supply->battery);
+            _uevent_track(identities, battery);
+            if (alarm_level.handler != NULL && battery->peripheral == FALSE)
+                _alarm_update(battery, alarm_level.handler(battery, alarm_level.user_data));
             (*list) = g_slist_prepend((*list), battery);
         }
 
@@ -338,5 +1284,152 @@ gboolean get_batteries_supply(GSList** list, GError** error)
     }
     
     g_dir_close(dir);
+    g_hash_table_destroy(supplies);
+    supplies = fresh;
+    g_hash_table_foreach_remove(notify.attributes, (GHRFunc)_notify_is_stale, identities);
+    if (estimates != NULL)
+        g_hash_table_foreach_remove(estimates, (GHRFunc)_estimate_is_stale, identities);
+    if (alarms != NULL)
+        g_hash_table_foreach_remove(alarms, (GHRFunc)_alarm_is_stale, identities);
+    g_hash_table_destroy(uevent.identities);
+    uevent.identities = identities;
+    return TRUE;
+}
+
+static const BatteryBackend sysfs_backend = {
+    "sysfs",
+    NULL,
+    _sysfs_uninit,
+    _sysfs_get_batteries_supply,
+    _sysfs_get_battery_status,
+    _sysfs_get_battery_capacity,
+    _sysfs_get_battery_time,
+    _sysfs_get_battery_energy,
+    _sysfs_get_battery_health,
+    NULL,
+};
+
+static const BatteryBackend* backends[] = { &sysfs_backend, &upower_backend, &simulation_backend, NULL };
+
+static const BatteryBackend* backend = &sysfs_backend;
+
+gboolean battery_set_backend(const gchar* name, GError** error)
+{
+    const BatteryBackend** iter;
+
+    for (iter = backends; *iter != NULL; iter++)
+    {
+        if (g_strcmp0((*iter)->name, name) == 0)
+            break;
+    }
+    if (*iter == NULL)
+    {
+        g_set_error(error, BATTERY_ERROR, BATTERY_UNKNOWN_BACKEND, "Unknown backend: \"%s\"", name);
+        return FALSE;
+    }
+
+    if ((*iter)->init != NULL && (*iter)->init(error) == FALSE)
+        return FALSE;
+
+    battery_unset_backend();
+    backend = *iter;
     return TRUE;
 }
+
+void battery_unset_backend(void)
+{
+    if (backend->uninit != NULL)
+        backend->uninit();
+    backend = &sysfs_backend;
+}
+
+/*
+ * Backends that are told about changes call the handler from the context
+ * get_batteries_supply runs on, with the identity of the changed battery.
+ */
+void battery_set_changed_handler(BatteryChanged handler, gpointer user_data)
+{
+    changed.handler = handler;
+    changed.user_data = user_data;
+}
+
+void battery_changed(const gchar* identity)
+{
+    if (changed.handler != NULL)
+        changed.handler(identity, changed.user_data);
+}
+
+/*
+ * Once subscribed, the backend calls the supply handler whenever a battery
+ * shows up or goes away, from the context battery_subscribe ran on. It
+ * fails for backends that can only be polled.
+ */
+gboolean battery_subscribe(GError** error)
+{
+    if (backend->subscribe == NULL)
+    {
+        g_set_error(error, BATTERY_ERROR, BATTERY_NO_SUBSCRIPTION, "The %s backend can only be polled", backend->name);
+        return FALSE;
+    }
+    return backend->subscribe(error);
+}
+
+void battery_set_supply_handler(BatterySupplyChanged handler, gpointer user_data)
+{
+    supply_changed.handler = handler;
+    supply_changed.user_data = user_data;
+}
+
+void battery_supply_changed(void)
+{
+    if (supply_changed.handler != NULL)
+        supply_changed.handler(supply_changed.user_data);
+}
+
+/*
+ * The sysfs backend arms the firmware alarm of every battery at the level
+ * the handler returns, in percent of full, and asks again on each scan from
+ * the context get_batteries_supply runs on. Without a handler, alarms are
+ * left alone.
+ */
+void battery_set_alarm_handler(BatteryAlarmLevel handler, gpointer user_data)
+{
+    alarm_level.handler = handler;
+    alarm_level.user_data = user_data;
+}
+
+gboolean get_batteries_supply(GSList** list, GError** error)
+{
+    return backend->get_supply(list, error);
+}
+
+gboolean get_battery_status(const Battery* battery, BATTERY_STATUS* status, GError** error)
+{
+    return backend->get_status(battery, status, error);
+}
+
+gboolean get_battery_capacity(const Battery* battery, guint64* capacity, GError** error)
+{
+    return backend->get_capacity(battery, capacity, error);
+}
+
+gboolean get_battery_time(const Battery* battery, BATTERY_STATUS status, guint64* seconds, GError** error)
+{
+    return backend->get_time(battery, status, seconds, error);
+}
+
+gboolean get_battery_energy(const Battery* battery, guint64* now, guint64* full, guint64* rate, GError** error)
+{
+    return backend->get_energy(battery, now, full, rate, error);
+}
+
+/* Ratio of full to design capacity */
+gboolean get_battery_health(const Battery* battery, gdouble* health, GError** error)
+{
+    if (backend->get_health == NULL)
+    {
+        g_set_error(error, BATTERY_ERROR, BATTERY_NO_HEALTH, "The %s backend reports no health", backend->name);
+        return FALSE;
+    }
+    return backend->get_health(battery, health, error);
+}
@@ -4,29 +4,46 @@
 #define SYSFS_BATTERY_PREFIX "BAT"
 #define SYSFS_BASE_PATH "/sys/class/power_supply/"
 
+#define BATTERY_DEFAULT_BACKEND "sysfs"
+
 #define BATTERY_MANUFACTUR_FILENAME "manufacturer"
 #define BATTERY_MODEL_NAME_FILENAME "model_name"
 #define BATTERY_TECHNOLOGY_FILENAME "technology"
 #define BATTERY_SERIAL_NUMBER_FILENAME "serial_number"
 #define BATTERY_STATUS_FILENAME "status"
 #define BATTERY_CAPACITY_FILENAME "capacity"
+#define BATTERY_TYPE_FILENAME "type"
+#define BATTERY_SCOPE_FILENAME "scope"
+#define BATTERY_ALARM_FILENAME "alarm"
+
+#define SYSFS_TYPE_BATTERY "Battery"
+#define SYSFS_SCOPE_DEVICE "Device"
 
 #define BATTERY_ENERGY_NOW_FILENAME "energy_now"
 #define BATTERY_ENERGY_FULL_FILENAME "energy_full"
+#define BATTERY_ENERGY_FULL_DESIGN_FILENAME "energy_full_design"
 #define BATTERY_POWER_NOW_FILENAME "power_now"
 
 #define BATTERY_CHARGE_NOW_FILENAME "charge_now"
 #define BATTERY_CHARGE_FULL_FILENAME "charge_full"
+#define BATTERY_CHARGE_FULL_DESIGN_FILENAME "charge_full_design"
 #define BATTERY_CURRENT_NOW_FILENAME "current_now"
+#define BATTERY_VOLTAGE_NOW_FILENAME "voltage_now"
 
 #define BATTERY_ERROR battery_error_quark()
-GQuark       g_io_error_quark      (void);
+GQuark battery_error_quark(void);
 
 #define BATTERY_CHARGE_NOW_ERROR 1000
 #define BATTERY_CHARGE_FULL_ERROR 1001
 #define BATTERY_CURRENT_NOW_ERROR 1002
 #define BATTERY_INVALID_STATUS 1003
 #define BATTERY_BATTERIES_SUPPLIES 1004
+#define BATTERY_UNKNOWN_BACKEND 1005
+#define BATTERY_NO_DEVICE 1006
+#define BATTERY_INVALID_SIMULATION 1007
+#define BATTERY_NO_ALARM 1008
+#define BATTERY_NO_HEALTH 1009
+#define BATTERY_NO_SUBSCRIPTION 1010
 
 typedef enum 
 {
@@ -37,25 +54,80 @@ typedef enum
     CHARGED_STATUS,
 } BATTERY_STATUS;
 
+/*
+ * Immutable once shared and reference counted; the strings are packed
+ * behind the struct in the same allocation.
+ */
 struct _Battery {
-    gchar* name;
-    gchar* sys_path;
-    gchar* model_name;
-    gchar* manufacture;
-    gchar* technology;
-    gchar* serial_number;
+    volatile gint ref_count;
+    const gchar* name;
+    const gchar* sys_path;
+    const gchar* model_name;
+    const gchar* manufacture;
+    const gchar* technology;
+    const gchar* serial_number;
+    const gchar* identity;
     gboolean use_charge;
+    gboolean peripheral;
+    gchar strings[];
 };
 typedef struct _Battery Battery;
 
-gboolean battery_init(Battery* battery, gchar* name, GError** error);
-Battery* battery_copy(const Battery* battery);
-void battery_free(Battery* battery);
+/*
+ * A backend provides the battery operations below. sysfs reads the kernel
+ * attributes on every call, upower answers from the properties upowerd
+ * pushes over D-Bus, simulation makes up batteries in memory. A backend
+ * with subscribe reports added and removed batteries on its own.
+ */
+typedef struct _BatteryBackend {
+    const gchar* name;
+    gboolean (*init)(GError** error);
+    void (*uninit)(void);
+    gboolean (*get_supply)(GSList** list, GError** error);
+    gboolean (*get_status)(const Battery* battery, BATTERY_STATUS* status, GError** error);
+    gboolean (*get_capacity)(const Battery* battery, guint64* capacity, GError** error);
+    gboolean (*get_time)(const Battery* battery, BATTERY_STATUS status, guint64* time, GError** error);
+    gboolean (*get_energy)(const Battery* battery, guint64* now, guint64* full, guint64* rate, GError** error);
+    gboolean (*get_health)(const Battery* battery, gdouble* health, GError** error);
+    gboolean (*subscribe)(GError** error);
+} BatteryBackend;
+
+typedef void (*BatteryChanged)(const gchar* identity, gpointer user_data);
+typedef void (*BatterySupplyChanged)(gpointer user_data);
+typedef guint (*BatteryAlarmLevel)(const Battery* battery, gpointer user_data);
+
+gboolean battery_set_backend(const gchar* name, GError** error);
+void battery_unset_backend(void);
+void battery_set_changed_handler(BatteryChanged handler, gpointer user_data);
+void battery_changed(const gchar* identity);
+gboolean battery_subscribe(GError** error);
+void battery_set_supply_handler(BatterySupplyChanged handler, gpointer user_data);
+void battery_supply_changed(void);
+void battery_set_alarm_handler(BatteryAlarmLevel handler, gpointer user_data);
+
+void battery_set_sysfs_path(const gchar* path);
+const gchar* battery_get_sysfs_path(void);
+void battery_set_selection(gboolean peripherals, gchar** include, gchar** exclude);
+gboolean battery_is_selected(const gchar* name, gboolean peripheral);
+
+Battery* battery_new(const gchar* name, GError** error);
+Battery* battery_new_full(
+    const gchar* name,
+    const gchar* sys_path,
+    const gchar* model_name,
+    const gchar* manufacture,
+    const gchar* technology,
+    const gchar* serial_number);
+Battery* battery_new_virtual(const gchar* name, const gchar* technology);
+Battery* battery_ref(Battery* battery);
+void battery_unref(Battery* battery);
 gboolean get_batteries_supply(GSList** list, GError** error);
 
 gboolean get_battery_status(const Battery* battery, BATTERY_STATUS* status, GError** error);
 gboolean get_battery_capacity(const Battery* battery, guint64* capacity, GError** error);
 gboolean get_battery_time(const Battery* battery, BATTERY_STATUS status, guint64* time, GError** error);
+gboolean get_battery_energy(const Battery* battery, guint64* now, guint64* full, guint64* rate, GError** error);
+gboolean get_battery_health(const Battery* battery, gdouble* health, GError** error);
 
 
 #endif // BATTERY_H
@@ -0,0 +1,82 @@
+#include <glib.h>
+
+#include "estimator.h"
+
+#define ESTIMATOR_USEC_PER_HOUR (3600.0 * G_USEC_PER_SEC)
+
+void estimator_reset(Estimator* estimator)
+{
+    estimator->timestamp = 0;
+    estimator->anchor_time = 0;
+    estimator->anchor_level = 0;
+    estimator->rate = 0;
+    estimator->rejected = 0;
+}
+
+/* Level units per hour from the last move of the level, 0 while it stands still */
+static gdouble _derive_rate(Estimator* estimator, gint64 timestamp, guint64 level)
+{
+    gdouble rate = 0;
+    guint64 delta;
+
+    if (estimator->anchor_time != 0 && level == estimator->anchor_level)
+        return 0;
+
+    if (estimator->anchor_time != 0 && timestamp > estimator->anchor_time)
+    {
+        delta = level > estimator->anchor_level ? level - estimator->anchor_level
+                                                : estimator->anchor_level - level;
+        rate = delta * ESTIMATOR_USEC_PER_HOUR / (timestamp - estimator->anchor_time);
+    }
+    estimator->anchor_time = timestamp;
+    estimator->anchor_level = level;
+    return rate;
+}
+
+static gboolean _is_outlier(const Estimator* estimator, gdouble rate)
+{
+    if (estimator->rate <= 0 || estimator->rejected >= ESTIMATOR_OUTLIER_LIMIT)
+        return FALSE;
+    return rate > estimator->rate * ESTIMATOR_OUTLIER_FACTOR ||
+           rate < estimator->rate / ESTIMATOR_OUTLIER_FACTOR;
+}
+
+/* rate is the reading of the rate attribute in level units per hour, 0 if there is none */
+void estimator_update(Estimator* estimator, gint64 timestamp, guint64 level, guint64 rate)
+{
+    gdouble sample, alpha, elapsed;
+    gdouble derived = _derive_rate(estimator, timestamp, level);
+
+    sample = rate > 0 ? (gdouble)rate : derived;
+    if (sample <= 0)
+        return;
+
+    if (_is_outlier(estimator, sample) == TRUE)
+    {
+        estimator->rejected++;
+        return;
+    }
+
+    /* A change that outlasted the outlier limit is the new rate */
+    if (estimator->rate <= 0 || estimator->rejected >= ESTIMATOR_OUTLIER_LIMIT)
+    {
+        estimator->rate = sample;
+    }
+    else
+    {
+        elapsed = (gdouble)(timestamp - estimator->timestamp) / G_USEC_PER_SEC;
+        alpha = elapsed / (elapsed + ESTIMATOR_TAU);
+        estimator->rate += alpha * (sample - estimator->rate);
+    }
+    estimator->rejected = 0;
+    estimator->timestamp = timestamp;
+}
+
+gboolean estimator_get_time(const Estimator* estimator, guint64 remaining, guint64* seconds)
+{
+    if (estimator->rate <= 0)
+        return FALSE;
+
+    *seconds = (guint64)(3600.0 * remaining / estimator->rate);
+    return TRUE;
+}
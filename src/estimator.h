@@ -0,0 +1,32 @@
+#ifndef ESTIMATOR_H
+#define ESTIMATOR_H
+
+#include <glib.h>
+
+/*
+ * Constant memory estimate of the charge or discharge rate of one battery.
+ * Rates are smoothed with an EWMA whose weight grows with the time since
+ * the previous sample. When the firmware has no rate attribute, or it reads
+ * 0, the rate is derived from the change of the level between the last two
+ * samples that saw it move. A sample far off the smoothed rate is dropped
+ * unless it persists, so a load change still gets through.
+ */
+
+#define ESTIMATOR_TAU 120.0
+#define ESTIMATOR_OUTLIER_FACTOR 4.0
+#define ESTIMATOR_OUTLIER_LIMIT 3
+
+typedef struct _Estimator
+{
+    gint64 timestamp;
+    gint64 anchor_time;
+    guint64 anchor_level;
+    gdouble rate;
+    guint rejected;
+} Estimator;
+
+void estimator_reset(Estimator* estimator);
+void estimator_update(Estimator* estimator, gint64 timestamp, guint64 level, guint64 rate);
+gboolean estimator_get_time(const Estimator* estimator, guint64 remaining, guint64* seconds);
+
+#endif // ESTIMATOR_H
@@ -0,0 +1,280 @@
+#include <glib.h>
+
+#include "exporter.h"
+#include "stats.h"
+
+/* identity holds a reference on the interned identity of the battery */
+typedef struct _Entry
+{
+    const gchar* identity;
+    gchar* labels;
+    ExporterSample sample;
+} Entry;
+
+struct _Exporter
+{
+    gchar* path;
+    GArray* entries;
+    gboolean dirty;
+};
+
+static const gchar* const status_labels[] = {
+    NULL, "unknown", "discharging", "not-charging", "charging", "charged",
+};
+
+static void
+append_label(GString* labels, const gchar* name, const gchar* value)
+{
+    const gchar* c;
+
+    g_string_append_printf(labels, "%s%s=\"", labels->len > 0 ? "," : "", name);
+    for (c = value != NULL ? value : ""; *c != '\0'; c++) {
+        if (*c == '\\' || *c == '"')
+            g_string_append_c(labels, '\\');
+        if (*c == '\n')
+            g_string_append(labels, "\\n");
+        else
+            g_string_append_c(labels, *c);
+    }
+    g_string_append_c(labels, '"');
+}
+
+static void
+append_gauge(GString* text,
+             const gchar* name,
+             const gchar* help,
+             guint flag,
+             glong offset,
+             gdouble scale,
+             GArray* entries)
+{
+    guint i;
+    Entry* entry;
+    gchar value[32];
+    gboolean typed = FALSE;
+
+    for (i = 0; i < entries->len; i++) {
+        entry = &g_array_index(entries, Entry, i);
+        if ((entry->sample.flags & flag) == 0)
+            continue;
+        if (typed == FALSE) {
+            g_string_append_printf(text, "# HELP %s %s\n# TYPE %s gauge\n", name, help, name);
+            typed = TRUE;
+        }
+        g_ascii_formatd(value,
+                        sizeof(value),
+                        "%g",
+                        *(const guint64*)((const guchar*)&entry->sample + offset) / scale);
+        g_string_append_printf(text, "%s{%s} %s\n", name, entry->labels, value);
+    }
+}
+
+static void
+append_health(GString* text, GArray* entries)
+{
+    guint i;
+    Entry* entry;
+    gchar value[32];
+    gboolean typed = FALSE;
+
+    for (i = 0; i < entries->len; i++) {
+        entry = &g_array_index(entries, Entry, i);
+        if ((entry->sample.flags & EXPORTER_HAS_HEALTH) == 0)
+            continue;
+        if (typed == FALSE) {
+            g_string_append(text,
+                            "# HELP batify_battery_health_ratio Full capacity over design capacity\n"
+                            "# TYPE batify_battery_health_ratio gauge\n");
+            typed = TRUE;
+        }
+        g_ascii_formatd(value, sizeof(value), "%.4f", entry->sample.health);
+        g_string_append_printf(text, "batify_battery_health_ratio{%s} %s\n", entry->labels, value);
+    }
+}
+
+/* One series per status, 1 for the current one, like node_exporter does */
+static void
+append_status(GString* text, GArray* entries)
+{
+    guint i, status;
+    Entry* entry;
+
+    gboolean typed = FALSE;
+
+    for (i = 0; i < entries->len; i++) {
+        entry = &g_array_index(entries, Entry, i);
+        if ((entry->sample.flags & EXPORTER_HAS_STATUS) == 0)
+            continue;
+        if (typed == FALSE) {
+            g_string_append(text,
+                            "# HELP batify_battery_status Battery status\n"
+                            "# TYPE batify_battery_status gauge\n");
+            typed = TRUE;
+        }
+        for (status = UNKNOWN_STATUS; status < G_N_ELEMENTS(status_labels); status++)
+            g_string_append_printf(text,
+                                   "batify_battery_status{%s,status=\"%s\"} %d\n",
+                                   entry->labels,
+                                   status_labels[status],
+                                   entry->sample.status == status);
+    }
+}
+
+static void
+entry_clear(Entry* entry)
+{
+    g_ref_string_release((gchar*)entry->identity);
+    g_free(entry->labels);
+}
+
+static gint
+find_entry(const Exporter* exporter, const Battery* battery)
+{
+    guint i;
+
+    for (i = 0; i < exporter->entries->len; i++) {
+        if (g_array_index(exporter->entries, Entry, i).identity == battery->identity)
+            return (gint)i;
+    }
+    return -1;
+}
+
+/* Copies the fields flagged in from, TRUE when one of them changed */
+static gboolean
+sample_merge(ExporterSample* into, const ExporterSample* from)
+{
+    gboolean changed = (into->flags | from->flags) != into->flags;
+
+    if (from->flags & EXPORTER_HAS_STATUS) {
+        changed |= into->status != from->status;
+        into->status = from->status;
+    }
+    if (from->flags & EXPORTER_HAS_CAPACITY) {
+        changed |= into->capacity != from->capacity;
+        into->capacity = from->capacity;
+    }
+    if (from->flags & EXPORTER_HAS_ENERGY) {
+        changed |= into->energy != from->energy || into->energy_full != from->energy_full ||
+                   into->rate != from->rate;
+        into->energy = from->energy;
+        into->energy_full = from->energy_full;
+        into->rate = from->rate;
+    }
+    if (from->flags & EXPORTER_HAS_HEALTH) {
+        changed |= into->health != from->health;
+        into->health = from->health;
+    }
+    into->flags |= from->flags;
+    return changed;
+}
+
+Exporter*
+exporter_new(const gchar* path)
+{
+    Exporter* exporter = g_new0(Exporter, 1);
+
+    exporter->path = g_strdup(path);
+    exporter->entries = g_array_new(FALSE, FALSE, sizeof(Entry));
+    g_array_set_clear_func(exporter->entries, (GDestroyNotify)entry_clear);
+    exporter->dirty = TRUE;
+    return exporter;
+}
+
+void
+exporter_free(Exporter* exporter)
+{
+    g_array_free(exporter->entries, TRUE);
+    g_free(exporter->path);
+    g_free(exporter);
+}
+
+void
+exporter_update(Exporter* exporter, const Battery* battery, const ExporterSample* sample)
+{
+    Entry entry = { 0 };
+    GString* labels;
+    gint index = find_entry(exporter, battery);
+
+    if (index >= 0) {
+        if (sample_merge(&g_array_index(exporter->entries, Entry, index).sample, sample) == TRUE)
+            exporter->dirty = TRUE;
+        return;
+    }
+
+    labels = g_string_new(NULL);
+    append_label(labels, "battery", battery->name);
+    append_label(labels, "model", battery->model_name);
+    append_label(labels, "serial", battery->serial_number);
+    entry.identity = g_ref_string_acquire((gchar*)battery->identity);
+    entry.labels = g_string_free(labels, FALSE);
+    sample_merge(&entry.sample, sample);
+    g_array_append_val(exporter->entries, entry);
+    exporter->dirty = TRUE;
+}
+
+void
+exporter_remove(Exporter* exporter, const Battery* battery)
+{
+    gint index = find_entry(exporter, battery);
+
+    if (index < 0)
+        return;
+    g_array_remove_index(exporter->entries, (guint)index);
+    exporter->dirty = TRUE;
+}
+
+/*
+ * The daemon metrics change on every tick, gating on them would write the
+ * file every time, so they are refreshed along with the battery gauges.
+ */
+gboolean
+exporter_write(Exporter* exporter, GError** error)
+{
+    gboolean result;
+    GString* metrics;
+
+    if (exporter->dirty == FALSE)
+        return TRUE;
+
+    metrics = g_string_new(NULL);
+
+    append_gauge(metrics,
+                 "batify_battery_capacity_percent",
+                 "Remaining capacity in percent",
+                 EXPORTER_HAS_CAPACITY,
+                 G_STRUCT_OFFSET(ExporterSample, capacity),
+                 1,
+                 exporter->entries);
+    append_gauge(metrics,
+                 "batify_battery_energy_wh",
+                 "Remaining energy in watt hours",
+                 EXPORTER_HAS_ENERGY,
+                 G_STRUCT_OFFSET(ExporterSample, energy),
+                 1000000,
+                 exporter->entries);
+    append_gauge(metrics,
+                 "batify_battery_energy_full_wh",
+                 "Energy when full in watt hours",
+                 EXPORTER_HAS_ENERGY,
+                 G_STRUCT_OFFSET(ExporterSample, energy_full),
+                 1000000,
+                 exporter->entries);
+    append_gauge(metrics,
+                 "batify_battery_rate_watts",
+                 "Charge or discharge rate in watts",
+                 EXPORTER_HAS_ENERGY,
+                 G_STRUCT_OFFSET(ExporterSample, rate),
+                 1000000,
+                 exporter->entries);
+    append_health(metrics, exporter->entries);
+    append_status(metrics, exporter->entries);
+    stats_append_openmetrics(metrics);
+    g_string_append(metrics, "# EOF\n");
+
+    /* g_file_set_contents() writes a temporary file and renames it over */
+    result = g_file_set_contents(exporter->path, metrics->str, metrics->len, error);
+    g_string_free(metrics, TRUE);
+    if (result == TRUE)
+        exporter->dirty = FALSE;
+    return result;
+}
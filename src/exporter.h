@@ -0,0 +1,48 @@
+#ifndef EXPORTER_H
+#define EXPORTER_H
+
+#include <glib.h>
+
+#include "battery.h"
+
+/*
+ * Metrics file for the node_exporter textfile collector. The exporter keeps
+ * the last values the samplers read for each battery, it never reads the
+ * backend itself: an update carries the fields it flags, the others keep
+ * their previous value. exporter_write() renders them together with the
+ * daemon statistics in the Prometheus text format, terminated by the
+ * OpenMetrics # EOF marker, and replaces the file atomically when a battery
+ * value changed since the last write.
+ */
+
+#define EXPORTER_HAS_CAPACITY (1 << 0)
+#define EXPORTER_HAS_ENERGY (1 << 1)
+#define EXPORTER_HAS_HEALTH (1 << 2)
+#define EXPORTER_HAS_STATUS (1 << 3)
+
+typedef struct _Exporter Exporter;
+
+typedef struct _ExporterSample
+{
+    BATTERY_STATUS status;
+    guint flags;
+    guint64 capacity;
+    guint64 energy;
+    guint64 energy_full;
+    guint64 rate;
+    gdouble health;
+} ExporterSample;
+
+Exporter*
+exporter_new(const gchar* path);
+void
+exporter_free(Exporter* exporter);
+
+void
+exporter_update(Exporter* exporter, const Battery* battery, const ExporterSample* sample);
+void
+exporter_remove(Exporter* exporter, const Battery* battery);
+gboolean
+exporter_write(Exporter* exporter, GError** error);
+
+#endif // EXPORTER_H
@@ -0,0 +1,428 @@
+#define _DEFAULT_SOURCE
+
+#include <glib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "history.h"
+
+G_DEFINE_QUARK(history-error-quark, history_error)
+
+#define HISTORY_FILE_SIZE (HISTORY_HEADER_SIZE + HISTORY_BLOCKS * HISTORY_BLOCK_SIZE)
+#define HISTORY_RECORD_MAX_SIZE 32
+
+/* Header offsets */
+#define HISTORY_VERSION_OFFSET 8
+#define HISTORY_BLOCK_SIZE_OFFSET 12
+#define HISTORY_BLOCKS_OFFSET 16
+#define HISTORY_HEAD_OFFSET 20
+#define HISTORY_INFO_OFFSET 24
+
+/* Block header offsets */
+#define HISTORY_USED_OFFSET 0
+#define HISTORY_BASE_OFFSET 8
+
+struct _History
+{
+    guchar* map;
+    guint head;
+    HistorySample last;
+};
+
+static guint32
+get_le32(const guchar* data)
+{
+    return (guint32)data[0] | (guint32)data[1] << 8 | (guint32)data[2] << 16 |
+           (guint32)data[3] << 24;
+}
+
+static void
+put_le32(guchar* data, guint32 value)
+{
+    data[0] = value & 0xff;
+    data[1] = (value >> 8) & 0xff;
+    data[2] = (value >> 16) & 0xff;
+    data[3] = (value >> 24) & 0xff;
+}
+
+static gint64
+get_le64(const guchar* data)
+{
+    return (gint64)((guint64)get_le32(data) | (guint64)get_le32(data + 4) << 32);
+}
+
+static void
+put_le64(guchar* data, gint64 value)
+{
+    put_le32(data, (guint32)((guint64)value & 0xffffffff));
+    put_le32(data + 4, (guint32)((guint64)value >> 32));
+}
+
+static gsize
+put_varint(guchar* data, guint64 value)
+{
+    gsize length = 0;
+
+    while (value >= 0x80) {
+        data[length++] = (guchar)(value | 0x80);
+        value >>= 7;
+    }
+    data[length++] = (guchar)value;
+    return length;
+}
+
+static gboolean
+get_varint(const guchar** cursor, const guchar* end, guint64* value)
+{
+    guint shift;
+
+    *value = 0;
+    for (shift = 0; shift < 64 && *cursor < end; shift += 7) {
+        *value |= (guint64)(**cursor & 0x7f) << shift;
+        if ((*(*cursor)++ & 0x80) == 0)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+/* Zigzag keeps small negative deltas small */
+static guint64
+zigzag(gint64 value)
+{
+    return ((guint64)value << 1) ^ (guint64)(value >> 63);
+}
+
+static gint64
+unzigzag(guint64 value)
+{
+    return (gint64)(value >> 1) ^ -(gint64)(value & 1);
+}
+
+static guchar*
+get_block(const guchar* map, guint index)
+{
+    return (guchar*)map + HISTORY_HEADER_SIZE + (gsize)index * HISTORY_BLOCK_SIZE;
+}
+
+/*
+ * Calls func for every record of a block, last holds the final sample
+ * afterwards. A record cut short by a crash ends the block.
+ */
+static guint
+decode_block(const guchar* block, HistorySample* last, HistoryFunc func, gpointer user_data)
+{
+    guint count = 0;
+    guint64 delta, capacity, seconds;
+    guint used = MIN(block[HISTORY_USED_OFFSET] | block[HISTORY_USED_OFFSET + 1] << 8,
+                     HISTORY_BLOCK_SIZE - HISTORY_BLOCK_HEADER_SIZE);
+    const guchar* cursor = block + HISTORY_BLOCK_HEADER_SIZE;
+    const guchar* end = cursor + used;
+
+    last->timestamp = get_le64(block + HISTORY_BASE_OFFSET);
+    last->status = 0;
+    last->capacity = 0;
+    last->seconds = 0;
+
+    while (cursor < end) {
+        if (get_varint(&cursor, end, &delta) == FALSE || cursor >= end)
+            break;
+        last->status = (BATTERY_STATUS) * cursor++;
+        if (get_varint(&cursor, end, &capacity) == FALSE ||
+            get_varint(&cursor, end, &seconds) == FALSE)
+            break;
+
+        last->timestamp += delta;
+        last->capacity += unzigzag(capacity);
+        last->seconds += unzigzag(seconds);
+        if (func != NULL)
+            func(last, user_data);
+        count++;
+    }
+    return count;
+}
+
+static void
+reset_block(guchar* block, gint64 timestamp)
+{
+    block[HISTORY_USED_OFFSET] = 0;
+    block[HISTORY_USED_OFFSET + 1] = 0;
+    put_le64(block + HISTORY_BASE_OFFSET, timestamp);
+}
+
+static void
+init_header(guchar* map, const Battery* battery)
+{
+    gsize offset = HISTORY_INFO_OFFSET;
+    const gchar* strings[] = { battery->name, battery->model_name, battery->serial_number };
+    guint i;
+
+    memset(map, 0, HISTORY_FILE_SIZE);
+    memcpy(map, HISTORY_MAGIC, sizeof(HISTORY_MAGIC) - 1);
+    map[HISTORY_VERSION_OFFSET] = HISTORY_VERSION;
+    put_le32(map + HISTORY_BLOCK_SIZE_OFFSET, HISTORY_BLOCK_SIZE);
+    put_le32(map + HISTORY_BLOCKS_OFFSET, HISTORY_BLOCKS);
+    put_le32(map + HISTORY_HEAD_OFFSET, 0);
+
+    /* NUL separated, cut to fit the header */
+    for (i = 0; i < G_N_ELEMENTS(strings); i++) {
+        gsize length = MIN(strlen(strings[i]), HISTORY_HEADER_SIZE - offset - 1);
+        memcpy(map + offset, strings[i], length);
+        offset += length + 1;
+        if (offset >= HISTORY_HEADER_SIZE)
+            break;
+    }
+}
+
+static gboolean
+check_header(const guchar* map, gsize size)
+{
+    return size == HISTORY_FILE_SIZE && memcmp(map, HISTORY_MAGIC, sizeof(HISTORY_MAGIC) - 1) == 0 &&
+           map[HISTORY_VERSION_OFFSET] == HISTORY_VERSION &&
+           get_le32(map + HISTORY_BLOCK_SIZE_OFFSET) == HISTORY_BLOCK_SIZE &&
+           get_le32(map + HISTORY_BLOCKS_OFFSET) == HISTORY_BLOCKS &&
+           get_le32(map + HISTORY_HEAD_OFFSET) < HISTORY_BLOCKS;
+}
+
+static gchar*
+history_filename(const gchar* dirname, const Battery* battery)
+{
+    gchar *basename, *path;
+
+    if (battery->serial_number[0] != '\0')
+        basename = g_strconcat(battery->name, "-", battery->serial_number, HISTORY_SUFFIX, NULL);
+    else
+        basename = g_strconcat(battery->name, HISTORY_SUFFIX, NULL);
+    g_strdelimit(basename, "/", '_');
+
+    path = g_build_filename(dirname, basename, NULL);
+    g_free(basename);
+    return path;
+}
+
+/* A file of another format or size is started over */
+History*
+history_open(const gchar* dirname, const Battery* battery, GError** error)
+{
+    gint fd;
+    struct stat st;
+    guchar* map;
+    History* history;
+    gchar* path = history_filename(dirname, battery);
+
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0 || fstat(fd, &st) < 0 ||
+        (st.st_size != HISTORY_FILE_SIZE && ftruncate(fd, HISTORY_FILE_SIZE) < 0)) {
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    g_file_error_from_errno(errno),
+                    "Cannot open %s: %s",
+                    path,
+                    g_strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        g_free(path);
+        return NULL;
+    }
+
+    map = mmap(NULL, HISTORY_FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    g_file_error_from_errno(errno),
+                    "Cannot map %s: %s",
+                    path,
+                    g_strerror(errno));
+        g_free(path);
+        return NULL;
+    }
+
+    if (check_header(map, st.st_size == HISTORY_FILE_SIZE ? HISTORY_FILE_SIZE : 0) == FALSE) {
+        g_debug("Start history %s", path);
+        init_header(map, battery);
+    }
+    g_free(path);
+
+    history = g_new0(History, 1);
+    history->map = map;
+    history->head = get_le32(map + HISTORY_HEAD_OFFSET);
+    decode_block(get_block(map, history->head), &history->last, NULL, NULL);
+    return history;
+}
+
+/* O(1): samples that change nothing are skipped, a full block moves the head */
+void
+history_append(History* history, const HistorySample* sample)
+{
+    gsize length;
+    guint used;
+    guchar record[HISTORY_RECORD_MAX_SIZE];
+    guchar* block = get_block(history->map, history->head);
+    HistorySample* last = &history->last;
+
+    used = block[HISTORY_USED_OFFSET] | block[HISTORY_USED_OFFSET + 1] << 8;
+    if (used > 0 && sample->status == last->status && sample->capacity == last->capacity &&
+        sample->timestamp >= last->timestamp && sample->timestamp - last->timestamp < HISTORY_MAX_GAP)
+        return;
+
+    /* The wall clock went back, deltas are unsigned */
+    if (used == 0 || sample->timestamp < last->timestamp) {
+        if (used > 0) {
+            history->head = (history->head + 1) % HISTORY_BLOCKS;
+            block = get_block(history->map, history->head);
+        }
+        reset_block(block, sample->timestamp);
+        put_le32(history->map + HISTORY_HEAD_OFFSET, history->head);
+        last->timestamp = sample->timestamp;
+        last->capacity = 0;
+        last->seconds = 0;
+        used = 0;
+    }
+
+    length = put_varint(record, sample->timestamp - last->timestamp);
+    record[length++] = (guchar)sample->status;
+    length += put_varint(record + length, zigzag((gint64)(sample->capacity - last->capacity)));
+    length += put_varint(record + length, zigzag((gint64)(sample->seconds - last->seconds)));
+
+    if (used + length > HISTORY_BLOCK_SIZE - HISTORY_BLOCK_HEADER_SIZE) {
+        history->head = (history->head + 1) % HISTORY_BLOCKS;
+        reset_block(get_block(history->map, history->head), sample->timestamp);
+        put_le32(history->map + HISTORY_HEAD_OFFSET, history->head);
+        last->timestamp = sample->timestamp;
+        last->capacity = 0;
+        last->seconds = 0;
+        history_append(history, sample);
+        return;
+    }
+
+    /* The record first, then the length that makes it visible */
+    memcpy(block + HISTORY_BLOCK_HEADER_SIZE + used, record, length);
+    used += length;
+    block[HISTORY_USED_OFFSET] = used & 0xff;
+    block[HISTORY_USED_OFFSET + 1] = used >> 8;
+    *last = *sample;
+}
+
+void
+history_close(History* history)
+{
+    munmap(history->map, HISTORY_FILE_SIZE);
+    g_free(history);
+}
+
+static void
+read_info(const guchar* map, HistoryInfo* info)
+{
+    const gchar* cursor = (const gchar*)map + HISTORY_INFO_OFFSET;
+    const gchar* end = (const gchar*)map + HISTORY_HEADER_SIZE;
+    gchar** fields[] = { &info->name, &info->model, &info->serial };
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS(fields); i++) {
+        *fields[i] = g_strndup(cursor, end - cursor);
+        cursor = MIN(cursor + strlen(*fields[i]) + 1, end);
+    }
+}
+
+/* Oldest block first, the head block last */
+gboolean
+history_read(const gchar* path,
+             HistoryInfo* info,
+             HistoryFunc func,
+             gpointer user_data,
+             GError** error)
+{
+    guint i, head;
+    HistorySample last;
+    const guchar* map;
+    GMappedFile* mapped_file = g_mapped_file_new(path, FALSE, error);
+
+    if (mapped_file == NULL)
+        return FALSE;
+
+    map = (const guchar*)g_mapped_file_get_contents(mapped_file);
+    if (map == NULL || check_header(map, g_mapped_file_get_length(mapped_file)) == FALSE) {
+        g_set_error(error, HISTORY_ERROR, HISTORY_INVALID_FORMAT, "%s is not a history file", path);
+        g_mapped_file_unref(mapped_file);
+        return FALSE;
+    }
+
+    if (info != NULL)
+        read_info(map, info);
+    head = get_le32(map + HISTORY_HEAD_OFFSET);
+    for (i = 1; i <= HISTORY_BLOCKS; i++)
+        decode_block(get_block(map, (head + i) % HISTORY_BLOCKS), &last, func, user_data);
+
+    g_mapped_file_unref(mapped_file);
+    return TRUE;
+}
+
+void
+history_info_clear(HistoryInfo* info)
+{
+    g_free(info->name);
+    g_free(info->model);
+    g_free(info->serial);
+}
+
+typedef struct _SummaryState
+{
+    HistorySummary* summary;
+    HistorySample prev;
+    gint64 since;
+    gint64 discharge_start;
+} SummaryState;
+
+/*
+ * Two discharging samples further apart than twice the maximum gap were
+ * not seen by a running batify, the time in between is not counted.
+ */
+static void
+summarize_sample(const HistorySample* sample, SummaryState* state)
+{
+    HistorySummary* summary = state->summary;
+    const HistorySample* prev = &state->prev;
+    gboolean continued;
+
+    if (sample->timestamp < state->since || sample->status == 0)
+        return;
+
+    if (summary->samples++ == 0)
+        summary->first = sample->timestamp;
+    summary->last = sample->timestamp;
+
+    continued = prev->status == DISCHARGING_STATUS && sample->timestamp >= prev->timestamp &&
+                sample->timestamp - prev->timestamp <= 2 * HISTORY_MAX_GAP;
+    if (continued == TRUE) {
+        summary->on_battery += sample->timestamp - prev->timestamp;
+        if (sample->capacity < prev->capacity)
+            summary->drained += prev->capacity - sample->capacity;
+    }
+
+    if (sample->status == DISCHARGING_STATUS) {
+        if (continued == FALSE) {
+            summary->discharges++;
+            state->discharge_start = sample->timestamp;
+        }
+        summary->longest = MAX(summary->longest, sample->timestamp - state->discharge_start);
+    }
+    state->prev = *sample;
+}
+
+/* since is a wall clock time in seconds, 0 for the whole history */
+gboolean
+history_summarize(const gchar* path,
+                  gint64 since,
+                  HistoryInfo* info,
+                  HistorySummary* summary,
+                  GError** error)
+{
+    SummaryState state = { summary, { 0 }, since, 0 };
+
+    memset(summary, 0, sizeof(*summary));
+    return history_read(path, info, (HistoryFunc)summarize_sample, &state, error);
+}
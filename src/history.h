@@ -0,0 +1,88 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <glib.h>
+
+#include "battery.h"
+
+/*
+ * Sample history of one battery in a fixed size file that is mapped and
+ * written in place. After a HISTORY_HEADER_SIZE header with the battery
+ * name, model and serial, the file is a ring of HISTORY_BLOCKS blocks.
+ * Every block starts with its used length and an absolute wall clock time
+ * in seconds, then holds records of varint time delta, status byte and
+ * zigzag varint deltas of capacity and remaining seconds, about four bytes
+ * each. A full block moves the head to the next one, which drops the
+ * oldest block; all integers are little endian.
+ */
+
+#define HISTORY_ERROR history_error_quark()
+GQuark
+history_error_quark(void);
+
+#define HISTORY_INVALID_FORMAT 7000
+
+#define HISTORY_MAGIC "BATIFYHI"
+#define HISTORY_VERSION 1
+#define HISTORY_SUFFIX ".hist"
+#define HISTORY_HEADER_SIZE 256
+#define HISTORY_BLOCK_HEADER_SIZE 16
+#define HISTORY_BLOCK_SIZE 4096
+#define HISTORY_BLOCKS 64
+
+/* A sample with the same status and capacity is written at most this often */
+#define HISTORY_MAX_GAP 300
+
+typedef struct _HistorySample
+{
+    gint64 timestamp;
+    BATTERY_STATUS status;
+    guint64 capacity;
+    guint64 seconds;
+} HistorySample;
+
+typedef struct _HistoryInfo
+{
+    gchar* name;
+    gchar* model;
+    gchar* serial;
+} HistoryInfo;
+
+typedef struct _HistorySummary
+{
+    gint64 first;
+    gint64 last;
+    guint samples;
+    guint discharges;
+    gint64 on_battery;
+    gint64 longest;
+    guint64 drained;
+} HistorySummary;
+
+typedef void (*HistoryFunc)(const HistorySample* sample, gpointer user_data);
+
+typedef struct _History History;
+
+History*
+history_open(const gchar* dirname, const Battery* battery, GError** error);
+void
+history_append(History* history, const HistorySample* sample);
+void
+history_close(History* history);
+
+gboolean
+history_read(const gchar* path,
+             HistoryInfo* info,
+             HistoryFunc func,
+             gpointer user_data,
+             GError** error);
+void
+history_info_clear(HistoryInfo* info);
+gboolean
+history_summarize(const gchar* path,
+                  gint64 since,
+                  HistoryInfo* info,
+                  HistorySummary* summary,
+                  GError** error);
+
+#endif // HISTORY_H
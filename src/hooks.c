@@ -0,0 +1,282 @@
+#define _DEFAULT_SOURCE
+
+#include <glib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "hooks.h"
+#include "stats.h"
+
+G_DEFINE_QUARK(hooks-error-quark, hooks_error)
+
+typedef struct _Hook
+{
+    gchar* event;
+    gchar* command;
+    gchar** argv;
+} Hook;
+
+/* A spawned or queued hook, envp is the complete child environment */
+typedef struct _HookRun
+{
+    Hooks* hooks;
+    const Hook* hook;
+    gchar** envp;
+    pid_t pid;
+    GSource* watch;
+    GSource* timer;
+} HookRun;
+
+struct _Hooks
+{
+    GMainContext* context;
+    GPtrArray* hooks;
+    GQueue pending;
+    GHashTable* running;
+    guint max_running;
+    guint timeout;
+};
+
+static void
+hook_free(Hook* hook)
+{
+    g_free(hook->event);
+    g_free(hook->command);
+    g_strfreev(hook->argv);
+    g_free(hook);
+}
+
+static void
+hook_run_free(HookRun* run)
+{
+    if (run->watch != NULL) {
+        g_source_destroy(run->watch);
+        g_source_unref(run->watch);
+    }
+    if (run->timer != NULL) {
+        g_source_destroy(run->timer);
+        g_source_unref(run->timer);
+    }
+    g_strfreev(run->envp);
+    g_free(run);
+}
+
+Hooks*
+hooks_new(GMainContext* context, guint max_running, guint timeout)
+{
+    Hooks* hooks = g_new0(Hooks, 1);
+
+    hooks->context = g_main_context_ref(context);
+    hooks->hooks = g_ptr_array_new_with_free_func((GDestroyNotify)hook_free);
+    g_queue_init(&hooks->pending);
+    hooks->running = g_hash_table_new_full(NULL, NULL, NULL, (GDestroyNotify)hook_run_free);
+    hooks->max_running = MAX(max_running, 1);
+    hooks->timeout = timeout;
+    return hooks;
+}
+
+/* Running hooks are left alone, an action such as a suspend must not be cut short */
+void
+hooks_free(Hooks* hooks)
+{
+    g_queue_clear_full(&hooks->pending, (GDestroyNotify)hook_run_free);
+    g_hash_table_destroy(hooks->running);
+    g_ptr_array_free(hooks->hooks, TRUE);
+    g_main_context_unref(hooks->context);
+    g_free(hooks);
+}
+
+gboolean
+hooks_add(Hooks* hooks, const gchar* event, const gchar* command, GError** error)
+{
+    Hook* hook;
+    gchar** argv;
+    GError* _error = NULL;
+
+    if (g_shell_parse_argv(command, NULL, &argv, &_error) == FALSE) {
+        g_set_error(error,
+                    HOOKS_ERROR,
+                    HOOKS_INVALID_COMMAND,
+                    "Invalid %s hook \"%s\": %s",
+                    event,
+                    command,
+                    _error->message);
+        g_error_free(_error);
+        return FALSE;
+    }
+
+    hook = g_new0(Hook, 1);
+    hook->event = g_strdup(event);
+    hook->command = g_strdup(command);
+    hook->argv = argv;
+    g_ptr_array_add(hooks->hooks, hook);
+    return TRUE;
+}
+
+gboolean
+hooks_has(const Hooks* hooks, const gchar* event)
+{
+    guint i;
+
+    for (i = 0; i < hooks->hooks->len; i++) {
+        if (g_strcmp0(((const Hook*)g_ptr_array_index(hooks->hooks, i))->event, event) == 0)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+static void
+hooks_start_pending(Hooks* hooks);
+
+static gboolean
+hook_run_kill(HookRun* run)
+{
+    g_warning("Hook \"%s\" ignored SIGTERM, kill it", run->hook->command);
+    kill(-run->pid, SIGKILL);
+    return G_SOURCE_REMOVE;
+}
+
+/* The hook is its own process group, so its children go with it */
+static gboolean
+hook_run_timeout(HookRun* run)
+{
+    stats_counter_inc(STAT_HOOK_TIMEOUTS);
+
+    g_warning("Hook \"%s\" timed out, terminate it", run->hook->command);
+    kill(-run->pid, SIGTERM);
+
+    /* A one-shot grace timer replaces this one, so SIGKILL is sent once */
+    g_source_destroy(run->timer);
+    g_source_unref(run->timer);
+    run->timer = g_timeout_source_new_seconds(HOOKS_KILL_GRACE);
+    g_source_set_callback(run->timer, (GSourceFunc)hook_run_kill, run, NULL);
+    g_source_attach(run->timer, run->hooks->context);
+    return G_SOURCE_REMOVE;
+}
+
+static void
+hook_run_exited(GPid pid, gint status, HookRun* run)
+{
+    Hooks* hooks = run->hooks;
+
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        g_debug("Hook \"%s\" finished", run->hook->command);
+    } else {
+        stats_counter_inc(STAT_HOOK_FAILURES);
+        if (WIFSIGNALED(status))
+            g_warning("Hook \"%s\" killed by signal %d", run->hook->command, WTERMSIG(status));
+        else
+            g_warning("Hook \"%s\" exited with %d", run->hook->command, WEXITSTATUS(status));
+    }
+
+    g_spawn_close_pid(pid);
+    g_hash_table_remove(hooks->running, GINT_TO_POINTER(pid));
+    hooks_start_pending(hooks);
+}
+
+static gboolean
+hook_run_spawn(HookRun* run)
+{
+    gint result;
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t actions;
+    sigset_t mask;
+    Hooks* hooks = run->hooks;
+
+    /* Own process group, default signals and nothing on stdin */
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr,
+                             POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+    posix_spawnattr_setpgroup(&attr, 0);
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    sigfillset(&mask);
+    posix_spawnattr_setsigdefault(&attr, &mask);
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+
+    result =
+      posix_spawnp(&run->pid, run->hook->argv[0], &actions, &attr, run->hook->argv, run->envp);
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+
+    stats_counter_inc(STAT_HOOKS);
+    if (result != 0) {
+        stats_counter_inc(STAT_HOOK_FAILURES);
+        g_warning("Cannot run hook \"%s\": %s", run->hook->command, g_strerror(result));
+        return FALSE;
+    }
+    g_debug("Hook \"%s\" started as %d", run->hook->command, run->pid);
+
+    run->watch = g_child_watch_source_new(run->pid);
+    g_source_set_callback(run->watch, (GSourceFunc)hook_run_exited, run, NULL);
+    g_source_attach(run->watch, hooks->context);
+
+    if (hooks->timeout > 0) {
+        run->timer = g_timeout_source_new_seconds(hooks->timeout);
+        g_source_set_callback(run->timer, (GSourceFunc)hook_run_timeout, run, NULL);
+        g_source_attach(run->timer, hooks->context);
+    }
+
+    g_hash_table_insert(hooks->running, GINT_TO_POINTER(run->pid), run);
+    return TRUE;
+}
+
+static void
+hooks_start_pending(Hooks* hooks)
+{
+    HookRun* run;
+
+    while (g_hash_table_size(hooks->running) < hooks->max_running) {
+        run = g_queue_pop_head(&hooks->pending);
+        if (run == NULL)
+            break;
+        if (hook_run_spawn(run) == FALSE)
+            hook_run_free(run);
+    }
+}
+
+/* environment holds the extra KEY=VALUE pairs of the event */
+void
+hooks_run(Hooks* hooks, const gchar* event, gchar** environment)
+{
+    guint i;
+    gchar** iter;
+    gchar** envp;
+    gchar* separator;
+    HookRun* run;
+    const Hook* hook;
+
+    for (i = 0; i < hooks->hooks->len; i++) {
+        hook = g_ptr_array_index(hooks->hooks, i);
+        if (g_strcmp0(hook->event, event) != 0)
+            continue;
+
+        if (g_queue_get_length(&hooks->pending) >= HOOKS_QUEUE_LIMIT) {
+            stats_counter_inc(STAT_HOOK_FAILURES);
+            g_warning("Too many hooks waiting, drop \"%s\"", hook->command);
+            continue;
+        }
+
+        envp = g_get_environ();
+        for (iter = environment; *iter != NULL; iter++) {
+            separator = strchr(*iter, '=');
+            *separator = '\0';
+            envp = g_environ_setenv(envp, *iter, separator + 1, TRUE);
+            *separator = '=';
+        }
+
+        run = g_new0(HookRun, 1);
+        run->hooks = hooks;
+        run->hook = hook;
+        run->envp = envp;
+        g_queue_push_tail(&hooks->pending, run);
+    }
+    hooks_start_pending(hooks);
+}
@@ -0,0 +1,37 @@
+#ifndef HOOKS_H
+#define HOOKS_H
+
+#include <glib.h>
+
+/*
+ * Commands run on battery events. A hook is spawned without waiting for
+ * it, reaped by a child watch on the context the hooks are attached to and
+ * killed when it outlives the timeout. At most max_running hooks run at
+ * once, the rest wait in a bounded queue.
+ */
+
+#define HOOKS_ERROR hooks_error_quark()
+GQuark
+hooks_error_quark(void);
+
+#define HOOKS_INVALID_COMMAND 5000
+#define HOOKS_INVALID_EVENT 5001
+
+#define HOOKS_QUEUE_LIMIT 32
+#define HOOKS_KILL_GRACE 5
+
+typedef struct _Hooks Hooks;
+
+Hooks*
+hooks_new(GMainContext* context, guint max_running, guint timeout);
+void
+hooks_free(Hooks* hooks);
+
+gboolean
+hooks_add(Hooks* hooks, const gchar* event, const gchar* command, GError** error);
+gboolean
+hooks_has(const Hooks* hooks, const gchar* event);
+void
+hooks_run(Hooks* hooks, const gchar* event, gchar** environment);
+
+#endif // HOOKS_H
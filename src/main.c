@@ -1,11 +1,35 @@
+#define _DEFAULT_SOURCE
+
+#include <glib-unix.h>
 #include <glib.h>
-#include <glib/gprintf.h>
 #include <libintl.h>
 #include <libnotify/notify.h>
+#include <errno.h>
+#include <limits.h>
 #include <locale.h>
+#include <signal.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
 
 #include "battery.h"
+#include "exporter.h"
+#include "history.h"
+#include "hooks.h"
+#include "pipeline.h"
+#include "policy.h"
+#include "pool.h"
+#include "priority.h"
+#include "probes.h"
+#include "profile.h"
+#include "reserve.h"
+#include "scheduler.h"
+#include "simulation.h"
+#include "stats.h"
+#include "table.h"
+#include "template.h"
+#include "trace.h"
 
 #define PROGRAM_NAME "batify"
 #define DEFAULT_INTERVAL 5
@@ -13,6 +37,36 @@
 #define DEFAULT_CRITICAL_LEVEL 10
 #define DEFAULT_FULL_CAPACITY 98
 #define DEFAULT_DEBUG FALSE
+#define DEFAULT_THREADS FALSE
+#define DEFAULT_STATS_INTERVAL 60
+#define DEFAULT_AGGREGATE FALSE
+#define DEFAULT_PERIPHERALS FALSE
+#define DEFAULT_PERIPHERAL_INTERVAL 60
+#define DEFAULT_REPLAY_SPEED 1.0
+#define DEFAULT_STATUS_SUMMARY "{name} ({technology}) is {status}"
+#define DEFAULT_LEVEL_SUMMARY "{name} ({technology}) level is {level}"
+#define DEFAULT_BODY "{remaining} remaining"
+#define DEFAULT_HOOK_TIMEOUT 60
+#define DEFAULT_MAX_HOOKS 4
+#define DEFAULT_ALARM FALSE
+#define DEFAULT_HISTORY FALSE
+#define DEFAULT_METRICS_INTERVAL 30
+#define DEFAULT_LOW_INTERFERENCE FALSE
+#define DEFAULT_LOCK_MEMORY FALSE
+#define DEFAULT_POLL FALSE
+#define NOTIFICATION_TEXT_SIZE 256
+#define CONTEXT_POOL_CHUNK 16
+
+#define CONFIG_DIRNAME PROGRAM_NAME
+#define CONFIG_FILENAME "batify.conf"
+
+#define AGGREGATE_NAME "Batteries"
+#define AGGREGATE_TECHNOLOGY "combined"
+
+#define REPLAY_BATCH_SIZE 32
+#define REPLAY_RETRY_DELAY (G_USEC_PER_SEC / 1000)
+
+#define PROFILE_SAVE_INTERVAL 600
 
 #define LOG_WARNING_AND_RETURN(val, error, prefix, ...)                                            \
     {                                                                                              \
@@ -25,6 +79,7 @@
     }
 
 GMainLoop* loop;
+Pool* context_pool;
 
 typedef enum
 {
@@ -40,30 +95,205 @@ static struct config
     gint full_capacity;
     gint timeout;
     gboolean debug;
+    gboolean threads;
+    gint queue_depth;
+    gchar* sysfs_path;
+    gchar* stats_file;
+    gint stats_interval;
+    gboolean aggregate;
+    gboolean peripherals;
+    gint peripheral_interval;
+    gchar** include;
+    gchar** exclude;
+    gchar* config_file;
+    gchar* backend;
+    gchar* record_file;
+    gchar* replay_file;
+    gdouble replay_speed;
+    gchar* simulation;
+    gchar* status_summary;
+    gchar* level_summary;
+    gchar* body;
+    gchar** hooks;
+    gint hook_timeout;
+    gint max_hooks;
+    gboolean alarm;
+    gchar* profile_file;
+    gchar* history_dir;
+    gboolean history;
+    gchar* since;
+    gint64 since_seconds;
+    gchar* metrics_file;
+    gint metrics_interval;
+    gboolean low_interference;
+    gchar* housekeeping_cpus;
+    gboolean lock_memory;
+    gboolean poll;
 } config = {
     DEFAULT_INTERVAL,      DEFAULT_LOW_LEVEL,      DEFAULT_CRITICAL_LEVEL,
     DEFAULT_FULL_CAPACITY, NOTIFY_EXPIRES_DEFAULT, DEFAULT_DEBUG,
+    DEFAULT_THREADS,       DEFAULT_STAGE_DEPTH,    NULL,
+    NULL,                  DEFAULT_STATS_INTERVAL, DEFAULT_AGGREGATE,
+    DEFAULT_PERIPHERALS,   DEFAULT_PERIPHERAL_INTERVAL, NULL,
+    NULL,                  NULL,                   NULL,
+    NULL,                  NULL,                   DEFAULT_REPLAY_SPEED,
+    NULL,                  NULL,                   NULL,
+    NULL,                  NULL,                   DEFAULT_HOOK_TIMEOUT,
+    DEFAULT_MAX_HOOKS,     DEFAULT_ALARM,          NULL,
+    NULL,                  DEFAULT_HISTORY,        NULL,
+    0,                     NULL,                   DEFAULT_METRICS_INTERVAL,
+    DEFAULT_LOW_INTERFERENCE, NULL,                DEFAULT_LOCK_MEMORY,
+    DEFAULT_POLL,
 };
 
+static struct pipeline
+{
+    Stage* acquisition;
+    Stage* policy;
+    Stage* delivery;
+    Scheduler* scheduler;
+} pipeline;
+
+/*
+ * Owned by the policy stage, the set is replaced from its context on reload.
+ * The lock covers the swap against lookups from the acquisition stage. The
+ * inotify watch of the configuration lives on the main context.
+ */
+static struct policies
+{
+    GMutex lock;
+    PolicySet* set;
+    guint generation;
+    BatteryTable table;
+    gint watch_fd;
+    guint watch_source;
+    gchar* watch_basename;
+} policies;
+
+/*
+ * Identity to Context, owned by the acquisition stage. Subscribed to the
+ * backend, watchers are sampled on its reports instead of the scheduler.
+ */
+static struct watchers
+{
+    GHashTable* table;
+    guint generation;
+    GSList* retired;
+    gboolean subscribed;
+} watchers;
+
+static struct aggregate
+{
+    GSList* batteries;
+    struct _Context* context;
+} aggregate;
+
+/* Compiled once at startup, rendered by the delivery stage */
+static struct templates
+{
+    Template* status_summary;
+    Template* level_summary;
+    Template* body;
+} templates;
+
+/* The writer belongs to the policy stage, the reader to acquisition */
+static struct trace
+{
+    TraceWriter* writer;
+    TraceReader* reader;
+    GHashTable* contexts;
+    GSource* source;
+    TraceRecord record;
+    gboolean pending;
+    gint64 origin;
+    gint64 start;
+} trace;
+
+/* Spawned and reaped on the delivery context */
+static Hooks* hooks;
+
+/* Learned and saved on the acquisition context */
+static ProfileStore* profiles;
+
+/* Filled and written on the acquisition context */
+static Exporter* exporter;
+
+/*
+ * Context is shared by the three stages, each of them touches only its own
+ * fields: tag, generation, sampled_status, interval, due_time and the
+ * profile belong to acquisition; the table row, the trace id, the history
+ * and the policy belong to policy; notification belongs to delivery. Every
+ * queued record holds a reference, so a removed battery lives until its
+ * last record is consumed.
+ */
 struct _Context
 {
+    volatile gint ref_count;
     Battery* battery;
-    BATTERY_STATUS prev_status;
-    gboolean low_level_notified;
-    gboolean critical_level_notified;
+    guint tag;
+    guint generation;
+    BATTERY_STATUS sampled_status;
+    gint interval;
+    gint64 due_time;
+    Profile* profile;
+    gint row;
+    guint trace_id;
+    History* history;
+    Policy* policy;
+    guint policy_generation;
     NotifyNotification* notification;
 };
 
 typedef struct _Context Context;
 
+#define SAMPLE_HAS_CAPACITY (1 << 0)
+#define SAMPLE_HAS_TIME (1 << 1)
+#define SAMPLE_RETIRED (1 << 2)
+
+typedef struct _Sample
+{
+    Context* context;
+    gint64 timestamp;
+    BATTERY_STATUS status;
+    guint flags;
+    guint64 capacity;
+    guint64 seconds;
+} Sample;
+
+typedef enum
+{
+    STATUS_EVENT,
+    LEVEL_EVENT,
+} EVENT_KIND;
+
+typedef struct _Event
+{
+    Context* context;
+    gint64 timestamp;
+    EVENT_KIND kind;
+    gint value;
+    gint timeout;
+    guint64 percent;
+    guint64 seconds;
+} Event;
+
 Context*
 context_init(Battery* battery)
 {
-    Context* context = g_new(Context, 1);
+    Context* context = pool_alloc0(context_pool);
+    context->ref_count = 1;
     context->battery = battery;
-    context->prev_status = 0;
-    context->low_level_notified = FALSE;
-    context->critical_level_notified = FALSE;
+    context->tag = 0;
+    context->generation = 0;
+    context->sampled_status = 0;
+    context->interval = battery->peripheral ? config.peripheral_interval : config.interval;
+    context->due_time = g_get_monotonic_time() + (gint64)context->interval * G_USEC_PER_SEC;
+    context->profile = NULL;
+    context->row = -1;
+    context->trace_id = 0;
+    context->history = NULL;
+    context->policy = NULL;
+    context->policy_generation = 0;
     context->notification = notify_notification_new(NULL, NULL, NULL);
     return context;
 }
@@ -71,13 +301,65 @@ context_init(Battery* battery)
 void
 context_free(Context* context)
 {
-    battery_free(context->battery);
-    g_free(context);
+    battery_unref(context->battery);
+    if (context->policy != NULL)
+        policy_unref(context->policy);
+    g_object_unref(context->notification);
+    pool_release(context_pool, context);
+}
+
+Context*
+context_ref(Context* context)
+{
+    g_atomic_int_inc(&context->ref_count);
+    return context;
+}
+
+void
+context_unref(Context* context)
+{
+    if (g_atomic_int_dec_and_test(&context->ref_count))
+        context_free(context);
 }
 
 static GOptionEntry option_entries[] = {
+    { "aggregate",
+      'a',
+      0,
+      G_OPTION_ARG_NONE,
+      &config.aggregate,
+      "Watch all batteries as one combined battery",
+      NULL },
     { "debug", 'd', 0, G_OPTION_ARG_NONE, &config.debug, "Enable/disable debug information", NULL },
     { "interval", 'i', 0, G_OPTION_ARG_INT, &config.interval, "Update interval in seconds", NULL },
+    { "peripherals",
+      'p',
+      0,
+      G_OPTION_ARG_NONE,
+      &config.peripherals,
+      "Also watch peripheral batteries (mice, keyboards, controllers, USB packs)",
+      NULL },
+    { "peripheral-interval",
+      0,
+      0,
+      G_OPTION_ARG_INT,
+      &config.peripheral_interval,
+      "Update interval for peripheral batteries in seconds",
+      NULL },
+    { "include",
+      0,
+      0,
+      G_OPTION_ARG_STRING_ARRAY,
+      &config.include,
+      "Only watch power supplies whose name matches the glob (repeatable)",
+      "GLOB" },
+    { "exclude",
+      0,
+      0,
+      G_OPTION_ARG_STRING_ARRAY,
+      &config.exclude,
+      "Do not watch power supplies whose name matches the glob (repeatable)",
+      "GLOB" },
     { "low-level",
       'l',
       0,
@@ -92,7 +374,42 @@ static GOptionEntry option_entries[] = {
       &config.critical_level,
       "Critical battery level in percent",
       NULL },
-    { "full-capacity", 'f', 0, G_OPTION_ARG_INT, &config, "Full capacity for battery", NULL },
+    { "full-capacity",
+      'f',
+      0,
+      G_OPTION_ARG_INT,
+      &config.full_capacity,
+      "Full capacity for battery",
+      NULL },
+    { "config",
+      'C',
+      0,
+      G_OPTION_ARG_FILENAME,
+      &config.config_file,
+      "Per-battery policy file (default: $XDG_CONFIG_HOME/" CONFIG_DIRNAME "/" CONFIG_FILENAME ")",
+      "PATH" },
+    { "status-summary",
+      0,
+      0,
+      G_OPTION_ARG_STRING,
+      &config.status_summary,
+      "Status notification summary (default: \"" DEFAULT_STATUS_SUMMARY "\")",
+      "TEMPLATE" },
+    { "level-summary",
+      0,
+      0,
+      G_OPTION_ARG_STRING,
+      &config.level_summary,
+      "Level notification summary (default: \"" DEFAULT_LEVEL_SUMMARY "\")",
+      "TEMPLATE" },
+    { "body",
+      0,
+      0,
+      G_OPTION_ARG_STRING,
+      &config.body,
+      "Notification body, empty while no time estimate is known when it uses {remaining} "
+      "(default: \"" DEFAULT_BODY "\")",
+      "TEMPLATE" },
     { "timeout",
       't',
       0,
@@ -101,6 +418,174 @@ static GOptionEntry option_entries[] = {
       "Notification timeout in seconds (-1 - default notification timeout, 0 - notification never "
       "expires)",
       NULL },
+    { "alarm",
+      0,
+      0,
+      G_OPTION_ARG_NONE,
+      &config.alarm,
+      "Program the battery firmware alarm to the critical level of its policy",
+      NULL },
+    { "threads",
+      0,
+      0,
+      G_OPTION_ARG_NONE,
+      &config.threads,
+      "Run acquisition, policy and delivery stages on separate threads",
+      NULL },
+    { "low-interference",
+      0,
+      0,
+      G_OPTION_ARG_NONE,
+      &config.low_interference,
+      "Sample at idle CPU and I/O priority with a large timer slack, implies --threads",
+      NULL },
+    { "housekeeping-cpus",
+      0,
+      0,
+      G_OPTION_ARG_STRING,
+      &config.housekeeping_cpus,
+      "Pin sampling to these CPUs in low interference mode, e.g. 0,2-3",
+      "LIST" },
+    { "lock-memory",
+      0,
+      0,
+      G_OPTION_ARG_NONE,
+      &config.lock_memory,
+      "Lock memory and prefault reserves so alerts do not wait on paging, lower the OOM score",
+      NULL },
+    { "queue-depth",
+      0,
+      0,
+      G_OPTION_ARG_INT,
+      &config.queue_depth,
+      "Capacity of the sample and event queues between stages",
+      NULL },
+    { "backend",
+      0,
+      0,
+      G_OPTION_ARG_STRING,
+      &config.backend,
+      "Battery data source: sysfs, upower or simulation (default: " BATTERY_DEFAULT_BACKEND ")",
+      "NAME" },
+    { "poll",
+      0,
+      0,
+      G_OPTION_ARG_NONE,
+      &config.poll,
+      "Rescan and sample on the interval even when the backend reports changes",
+      NULL },
+    { "simulate",
+      0,
+      0,
+      G_OPTION_ARG_STRING,
+      &config.simulation,
+      "Watch simulated batteries instead of real ones, e.g. count=1000,discharge=10,flap=0.5",
+      "SPEC" },
+    { "record",
+      0,
+      0,
+      G_OPTION_ARG_FILENAME,
+      &config.record_file,
+      "Record every sample seen by the policy stage to a binary trace",
+      "PATH" },
+    { "history-dir",
+      0,
+      0,
+      G_OPTION_ARG_FILENAME,
+      &config.history_dir,
+      "Keep a bounded sample history of every battery in this directory",
+      "PATH" },
+    { "history",
+      0,
+      0,
+      G_OPTION_ARG_NONE,
+      &config.history,
+      "Summarise the histories in --history-dir and exit",
+      NULL },
+    { "since",
+      0,
+      0,
+      G_OPTION_ARG_STRING,
+      &config.since,
+      "Summarise only the last DURATION of history, e.g. 90m, 12h or 7d",
+      "DURATION" },
+    { "replay",
+      0,
+      0,
+      G_OPTION_ARG_FILENAME,
+      &config.replay_file,
+      "Drive the policy stage from a recorded trace and print its decisions",
+      "PATH" },
+    { "speed",
+      0,
+      0,
+      G_OPTION_ARG_DOUBLE,
+      &config.replay_speed,
+      "Replay speed factor of the virtual clock",
+      "N" },
+    { "sysfs-path",
+      0,
+      0,
+      G_OPTION_ARG_FILENAME,
+      &config.sysfs_path,
+      "Power supply class directory (default: " SYSFS_BASE_PATH ")",
+      "PATH" },
+    { "profile-file",
+      0,
+      0,
+      G_OPTION_ARG_FILENAME,
+      &config.profile_file,
+      "Learn discharge profiles per battery pack and keep them in this file",
+      "PATH" },
+    { "stats-file",
+      0,
+      0,
+      G_OPTION_ARG_FILENAME,
+      &config.stats_file,
+      "Periodically rewrite runtime statistics as JSON to this file",
+      "PATH" },
+    { "metrics-file",
+      0,
+      0,
+      G_OPTION_ARG_FILENAME,
+      &config.metrics_file,
+      "Write battery and daemon metrics for the node_exporter textfile collector to this file",
+      "PATH" },
+    { "metrics-interval",
+      0,
+      0,
+      G_OPTION_ARG_INT,
+      &config.metrics_interval,
+      "Metrics file update interval in seconds (default: 30)",
+      NULL },
+    { "hook",
+      0,
+      0,
+      G_OPTION_ARG_STRING_ARRAY,
+      &config.hooks,
+      "Run a command on an event: a status name or low, critical (repeatable)",
+      "EVENT=COMMAND" },
+    { "hook-timeout",
+      0,
+      0,
+      G_OPTION_ARG_INT,
+      &config.hook_timeout,
+      "Terminate hooks running longer than this many seconds, 0 never (default: 60)",
+      NULL },
+    { "max-hooks",
+      0,
+      0,
+      G_OPTION_ARG_INT,
+      &config.max_hooks,
+      "Maximum number of hooks running at once (default: 4)",
+      NULL },
+    { "stats-interval",
+      0,
+      0,
+      G_OPTION_ARG_INT,
+      &config.stats_interval,
+      "Statistics file rewrite interval in seconds",
+      NULL },
     { NULL }
 };
 
@@ -122,72 +607,35 @@ notify_message(NotifyNotification* notification,
         notify_notification_set_hint(notification, "value", NULL);
     }
 
-    notify_notification_show(notification, NULL);
-}
+    gint64 start_time = g_get_monotonic_time();
+    gboolean result = notify_notification_show(notification, NULL);
+    stats_histogram_add(STAT_NOTIFY_RTT, g_get_monotonic_time() - start_time);
 
-static gchar*
-get_battery_status_summery_string(const Battery* battery, const BATTERY_STATUS status)
-{
-    static gchar string[255];
-    switch (status) {
-        case UNKNOWN_STATUS:
-            g_sprintf(string, "%s (%s) is unknown", battery->name, battery->technology);
-            break;
-        case CHARGING_STATUS:
-            g_sprintf(string, "%s (%s) is charging", battery->name, battery->technology);
-            break;
-        case DISCHARGING_STATUS:
-            g_sprintf(string, "%s (%s) is discharging", battery->name, battery->technology);
-            break;
-        case NOT_CHARGING_STATUS:
-            g_sprintf(string, "%s (%s) is not charging", battery->name, battery->technology);
-            break;
-        case CHARGED_STATUS:
-            g_sprintf(string, "%s (%s) is charged", battery->name, battery->technology);
-            break;
-        default:
-            string[0] = '\0';
-            break;
-    }
-    return string;
+    stats_counter_inc(STAT_NOTIFICATIONS);
+    if (result == FALSE)
+        stats_counter_inc(STAT_NOTIFICATION_ERRORS);
 }
 
-static gchar*
-get_battery_level_summery_string(const Battery* battery, const BATTERY_LEVEL level)
-{
-    static gchar string[255];
-    switch (level) {
-        case LOW_LEVEL:
-            g_sprintf(string, "%s (%s) level is low", battery->name, battery->technology);
-            break;
-        case CRITICAL_LEVEL:
-            g_sprintf(string, "%s (%s) level is critical", battery->name, battery->technology);
-            break;
-        default:
-            string[0] = '\0';
-            break;
-    }
-    return string;
-}
+static const gchar* status_texts[] = {
+    NULL, "unknown", "discharging", "not charging", "charging", "charged",
+};
 
-static gchar*
-get_battery_body_string(const guint64 seconds)
-{
-    if (seconds == 0) {
-        return "";
-    }
+static const gchar* status_names[] = {
+    NULL, "unknown", "discharging", "not-charging", "charging", "charged",
+};
 
-    static gchar body_string[255];
-    guint hours, minutes;
-    minutes = seconds / 60;
-    hours = minutes / 60;
-    minutes = minutes - hours * 60;
-    if (hours > 0) {
-        g_sprintf(body_string, "%02d:%02d remaining", hours, minutes);
-    } else {
-        g_sprintf(body_string, "00:%02d remaining", minutes);
-    }
-    return body_string;
+static const gchar* level_names[] = {
+    "low",
+    "critical",
+};
+
+static void
+render_body(const TemplateValues* values, gchar* body)
+{
+    if (values->seconds == 0 && template_has_field(templates.body, TEMPLATE_REMAINING))
+        body[0] = '\0';
+    else
+        template_render(templates.body, values, body, NOTIFICATION_TEXT_SIZE);
 }
 
 static void
@@ -195,15 +643,21 @@ battery_status_notification(const Battery* battery,
                             const BATTERY_STATUS status,
                             const guint64 percent,
                             const guint64 seconds,
+                            const gint timeout,
                             NotifyNotification* notification)
 
 {
+    gchar summary[NOTIFICATION_TEXT_SIZE], body[NOTIFICATION_TEXT_SIZE];
+    const TemplateValues values = { battery, status_texts[status], NULL, percent, seconds };
+
+    template_render(templates.status_summary, &values, summary, sizeof(summary));
+    render_body(&values, body);
     notify_message(notification,
-                   get_battery_status_summery_string(battery, status),
-                   get_battery_body_string(seconds),
+                   summary,
+                   body,
                    NOTIFY_URGENCY_NORMAL,
                    percent,
-                   config.timeout);
+                   timeout);
 }
 
 static void
@@ -214,6 +668,9 @@ battery_level_notification(const Battery* battery,
                            NotifyNotification* notification)
 {
     NotifyUrgency urgency;
+    gchar summary[NOTIFICATION_TEXT_SIZE], body[NOTIFICATION_TEXT_SIZE];
+    const TemplateValues values = { battery, NULL, level_names[level], percent, seconds };
+
     switch (level) {
         case LOW_LEVEL:
             urgency = NOTIFY_URGENCY_NORMAL;
@@ -223,185 +680,1359 @@ battery_level_notification(const Battery* battery,
             break;
     }
 
+    template_render(templates.level_summary, &values, summary, sizeof(summary));
+    render_body(&values, body);
     notify_message(notification,
-                   get_battery_level_summery_string(battery, level),
-                   get_battery_body_string(seconds),
+                   summary,
+                   body,
                    urgency,
                    percent,
                    NOTIFY_EXPIRES_DEFAULT);
 }
 
+/* A dropped event is counted by the ring, FALSE lets the caller retry it */
 static gboolean
-battery_handler(Context* context)
+push_event(Context* context,
+           gint64 timestamp,
+           EVENT_KIND kind,
+           gint value,
+           guint64 percent,
+           guint64 seconds)
 {
-    guint64 capacity;
-    guint64 seconds;
-    BATTERY_STATUS status;
-    GError* error = NULL;
-    const Battery* battery = context->battery;
+    Event event = {
+        context_ref(context), timestamp, kind, value, context->policy->timeout, percent, seconds,
+    };
 
-    g_debug("Get battery(%s) status", battery->name);
-    if (get_battery_status(battery, &status, &error) == FALSE)
-        LOG_WARNING_AND_RETURN(
-          G_SOURCE_CONTINUE, error, "Cannot get battery(%s) status", battery->name);
+    if (stage_push(pipeline.delivery, &event) == FALSE) {
+        g_warning("Delivery queue is full, drop event for battery(%s)", context->battery->name);
+        context_unref(context);
+        return FALSE;
+    }
+    return TRUE;
+}
 
+static gboolean
+sample_needs_capacity(BATTERY_STATUS status, BATTERY_STATUS prev_status)
+{
     switch (status) {
         case UNKNOWN_STATUS:
-            g_debug("Got UNKNOWN_STATUS");
-            context->low_level_notified = FALSE;
-            context->critical_level_notified = FALSE;
-
-            if (context->prev_status == status)
-                break;
-
-            g_debug("Get battery capacity");
-            if (get_battery_capacity(battery, &capacity, &error) == FALSE)
-                LOG_WARNING_AND_RETURN(
-                  G_SOURCE_CONTINUE, error, "Cannot get battery(%s) capacty", battery->name);
+        case CHARGING_STATUS:
+            return status != prev_status;
+        case DISCHARGING_STATUS:
+        case NOT_CHARGING_STATUS:
+            return TRUE;
+        default:
+            return FALSE;
+    }
+}
 
-            if (capacity >= config.full_capacity) {
-                g_debug("Battery(%s) capacity is greater then full capacity: %d",
-                        battery->name,
-                        config.full_capacity);
-                battery_status_notification(
-                  battery, CHARGED_STATUS, capacity, 0, context->notification);
-            }
-            break;
-        case CHARGED_STATUS:
-            g_debug("Battery(%s) got CHARGED_STATUS", battery->name);
-            context->low_level_notified = FALSE;
-            context->critical_level_notified = FALSE;
-            if (context->prev_status != status)
-                battery_status_notification(battery, status, 100, 0, context->notification);
-            break;
+static gboolean
+sample_needs_time(BATTERY_STATUS status, BATTERY_STATUS prev_status)
+{
+    switch (status) {
         case CHARGING_STATUS:
-            g_debug("Battery(%s) got CHARGING_STATUS", battery->name);
-            context->low_level_notified = FALSE;
-            context->critical_level_notified = FALSE;
-            if (context->prev_status == status)
-                break;
+            return status != prev_status;
+        case DISCHARGING_STATUS:
+        case NOT_CHARGING_STATUS:
+            return TRUE;
+        default:
+            return FALSE;
+    }
+}
 
-            g_debug("Get battery(%s) capacity", battery->name);
-            if (get_battery_capacity(battery, &capacity, &error) == FALSE)
-                LOG_WARNING_AND_RETURN(
-                  G_SOURCE_CONTINUE, error, "Cannot get battery(%s) capacty", battery->name);
+static void
+begin_sample(Context* context, Sample* sample)
+{
+    sample->timestamp = g_get_monotonic_time();
+    stats_counter_inc(STAT_WAKEUPS);
+    /* Samples triggered by the backend run ahead of the schedule, or without one */
+    if (context->tag != 0 && sample->timestamp >= context->due_time)
+        stats_histogram_add(STAT_TIMER_LATENESS, sample->timestamp - context->due_time);
+    context->due_time = sample->timestamp + (gint64)context->interval * G_USEC_PER_SEC;
+}
 
-            g_debug("Get battery(%s) time", battery->name);
-            if (get_battery_time(battery, status, &seconds, &error) == FALSE) {
-                g_warning("Cannot get battery(%s) time", battery->name);
-                seconds = 0;
-            }
-            battery_status_notification(battery, status, capacity, seconds, context->notification);
+static void
+submit_sample(Context* context, Sample* sample)
+{
+    stats_histogram_add(STAT_TICK_DURATION, g_get_monotonic_time() - sample->timestamp);
+    BATIFY_PROBE4(
+      sample, context->battery->name, sample->status, sample->capacity, sample->seconds);
+    sample->context = context_ref(context);
+    if (stage_push(pipeline.policy, sample) == FALSE) {
+        /* Keep sampled_status so the next tick reads the levels again */
+        g_warning("Policy queue is full, drop sample for battery(%s)", context->battery->name);
+        context_unref(context);
+        return;
+    }
+    context->sampled_status = sample->status;
+}
 
-            break;
-        case DISCHARGING_STATUS:
-        case NOT_CHARGING_STATUS:
-            g_debug("Battery(%s) got NOT_CHARGING_STATUS or DISCHARGING_STATUS", battery->name);
+/* Critical level of the battery policy, for the stages that do not own the set */
+static guint
+lookup_critical_level(const Battery* battery)
+{
+    gint level;
 
-            g_debug("Get battery(%s) capacity", battery->name);
-            if (get_battery_capacity(battery, &capacity, &error) == FALSE)
-                LOG_WARNING_AND_RETURN(
-                  G_SOURCE_CONTINUE, error, "Cannot get battery(%s) capacity", battery->name);
+    g_mutex_lock(&policies.lock);
+    level = policy_set_lookup(policies.set, battery)->critical_level;
+    g_mutex_unlock(&policies.lock);
+    return (guint)MAX(level, 0);
+}
 
-            g_debug("Get battery time");
-            if (get_battery_time(battery, status, &seconds, &error) == FALSE) {
-                g_warning("Cannot get battery(%s) time", battery->name);
-                seconds = 0;
-            }
+/*
+ * The learned curve of the pack replaces the linear estimate once it covers
+ * the way down to the critical level; the percents below it, which a pack
+ * rarely reaches, fall back to the linear rate until they are learned.
+ */
+static void
+sample_profile(Context* context, Sample* sample)
+{
+    guint64 seconds;
+    gboolean discharging =
+      sample->status == DISCHARGING_STATUS && (sample->flags & SAMPLE_HAS_CAPACITY) != 0;
 
-            if (context->prev_status != status) {
-                battery_status_notification(
-                  battery, status, capacity, seconds, context->notification);
-            }
-            if ((context->critical_level_notified == FALSE) &&
-                (capacity <= config.critical_level)) {
-                context->low_level_notified = FALSE;
-                context->critical_level_notified = TRUE;
-                battery_level_notification(
-                  battery, CRITICAL_LEVEL, capacity, seconds, context->notification);
-            }
-            if ((context->low_level_notified == FALSE) && (capacity > config.critical_level) &&
-                (capacity <= config.low_level)) {
-                context->low_level_notified = TRUE;
-                context->critical_level_notified = FALSE;
-                battery_level_notification(
-                  battery, LOW_LEVEL, capacity, seconds, context->notification);
-            }
-            break;
+    profile_update(context->profile, sample->timestamp, discharging, sample->capacity);
+    if (discharging == FALSE || (sample->flags & SAMPLE_HAS_TIME) == 0 || sample->capacity == 0)
+        return;
+
+    if (profile_predict(context->profile,
+                        sample->capacity,
+                        lookup_critical_level(context->battery),
+                        sample->seconds / sample->capacity,
+                        &seconds) == TRUE) {
+        g_debug("Battery(%s) profile predicts %" G_GUINT64_FORMAT " s, linear %" G_GUINT64_FORMAT " s",
+                context->battery->name,
+                seconds,
+                sample->seconds);
+        sample->seconds = seconds;
     }
-    context->prev_status = status;
-    return G_SOURCE_CONTINUE;
 }
 
-static gint
-battery_compare_by_serial_number(const Battery* battery, const gchar* serial_number)
+/*
+ * The exporter publishes what the samplers read and never polls on its own.
+ * Energy is read on the ticks that read the capacity, values the backend
+ * cannot provide are left out.
+ */
+static void
+export_sample(const Battery* battery, const Sample* sample)
 {
-    return g_strcmp0(battery->serial_number, serial_number);
+    ExporterSample exported = { sample->status, EXPORTER_HAS_STATUS };
+
+    if (sample->flags & SAMPLE_HAS_CAPACITY) {
+        exported.capacity = sample->capacity;
+        exported.flags |= EXPORTER_HAS_CAPACITY;
+        if (get_battery_energy(
+              battery, &exported.energy, &exported.energy_full, &exported.rate, NULL) == TRUE)
+            exported.flags |= EXPORTER_HAS_ENERGY;
+    }
+    exporter_update(exporter, battery, &exported);
 }
 
-static guint
-add_watcher(Battery* battery)
+/* Health moves over months, it is read once when the battery shows up */
+static void
+export_health(const Battery* battery)
 {
-    Context* context = context_init(battery);
-    guint tag = g_timeout_add_seconds_full(G_PRIORITY_DEFAULT,
-                                           config.interval,
-                                           (GSourceFunc)battery_handler,
-                                           (gpointer)context,
-                                           (GDestroyNotify)context_free);
-    g_info("Add new battery handler for: %s", battery->name);
-    return tag;
+    ExporterSample exported = { 0 };
+
+    if (get_battery_health(battery, &exported.health, NULL) == TRUE)
+        exported.flags |= EXPORTER_HAS_HEALTH;
+    exporter_update(exporter, battery, &exported);
 }
 
 static gboolean
-batteries_supply_handler(GHashTable* watchers)
+battery_sampler(Context* context)
 {
-    guint* ptag;
-    gchar* key;
-    gboolean result;
-    Battery* battery;
-    GHashTableIter w_iter;
+    Sample sample = { 0 };
     GError* error = NULL;
-    GSList *batteries = NULL, *b_iter;
+    const Battery* battery = context->battery;
 
-    g_info("Get batteries supply");
-    result = get_batteries_supply(&batteries, &error);
-    if (result == FALSE) {
-        g_main_loop_quit(loop);
+    begin_sample(context, &sample);
+
+    g_debug("Get battery(%s) status", battery->name);
+    if (get_battery_status(battery, &sample.status, &error) == FALSE)
+        LOG_WARNING_AND_RETURN(
+          G_SOURCE_CONTINUE, error, "Cannot get battery(%s) status", battery->name);
+
+    if (sample_needs_capacity(sample.status, context->sampled_status)) {
+        g_debug("Get battery(%s) capacity", battery->name);
+        if (get_battery_capacity(battery, &sample.capacity, &error) == FALSE)
+            LOG_WARNING_AND_RETURN(
+              G_SOURCE_CONTINUE, error, "Cannot get battery(%s) capacity", battery->name);
+        sample.flags |= SAMPLE_HAS_CAPACITY;
+    }
+
+    if (sample_needs_time(sample.status, context->sampled_status)) {
+        g_debug("Get battery(%s) time", battery->name);
+        if (get_battery_time(battery, sample.status, &sample.seconds, &error) == FALSE) {
+            g_warning("Cannot get battery(%s) time", battery->name);
+            g_clear_error(&error);
+            sample.seconds = 0;
+        }
+        sample.flags |= SAMPLE_HAS_TIME;
+    }
+
+    if (context->profile != NULL)
+        sample_profile(context, &sample);
+    if (exporter != NULL)
+        export_sample(battery, &sample);
+
+    submit_sample(context, &sample);
+    return G_SOURCE_CONTINUE;
+}
+
+static BATTERY_STATUS
+aggregate_status(guint statuses)
+{
+    if (statuses & (1 << DISCHARGING_STATUS))
+        return DISCHARGING_STATUS;
+    if (statuses & (1 << CHARGING_STATUS))
+        return CHARGING_STATUS;
+    if (statuses == (1 << CHARGED_STATUS))
+        return CHARGED_STATUS;
+    if (statuses & (1 << NOT_CHARGING_STATUS))
+        return NOT_CHARGING_STATUS;
+    return UNKNOWN_STATUS;
+}
+
+/*
+ * Samples every battery as one: the packs are summed by energy, so the
+ * capacity is weighted by their size and the remaining time comes from the
+ * total rate, whichever pack the firmware is draining right now.
+ */
+static gboolean
+aggregate_sampler(Context* context)
+{
+    GSList* iter;
+    Battery* battery;
+    BATTERY_STATUS status;
+    guint statuses = 0;
+    guint64 now, full, rate;
+    guint64 sum_now = 0, sum_full = 0, sum_rate = 0;
+    Sample sample = { 0 };
+    ExporterSample exported = { 0 };
+    GError* error = NULL;
+
+    begin_sample(context, &sample);
+    if (aggregate.batteries == NULL)
+        return G_SOURCE_CONTINUE;
+
+    for (iter = aggregate.batteries; iter != NULL; iter = g_slist_next(iter)) {
+        battery = (Battery*)iter->data;
+        if (get_battery_status(battery, &status, &error) == FALSE)
+            LOG_WARNING_AND_RETURN(
+              G_SOURCE_CONTINUE, error, "Cannot get battery(%s) status", battery->name);
+        statuses |= 1 << status;
+        if (exporter != NULL) {
+            exported.status = status;
+            exported.flags = EXPORTER_HAS_STATUS;
+            exporter_update(exporter, battery, &exported);
+        }
+    }
+    sample.status = aggregate_status(statuses);
+
+    if (sample_needs_capacity(sample.status, context->sampled_status)) {
+        for (iter = aggregate.batteries; iter != NULL; iter = g_slist_next(iter)) {
+            battery = (Battery*)iter->data;
+            if (get_battery_energy(battery, &now, &full, &rate, &error) == FALSE)
+                LOG_WARNING_AND_RETURN(
+                  G_SOURCE_CONTINUE, error, "Cannot get battery(%s) energy", battery->name);
+            sum_now += now;
+            sum_full += full;
+            sum_rate += rate;
+            /* Aggregated batteries are exported one by one, not as their sum */
+            if (exporter != NULL && full > 0) {
+                exported.capacity = MIN(now * 100 / full, 100);
+                exported.energy = now;
+                exported.energy_full = full;
+                exported.rate = rate;
+                exported.flags = EXPORTER_HAS_CAPACITY | EXPORTER_HAS_ENERGY;
+                exporter_update(exporter, battery, &exported);
+            }
+        }
+        if (sum_full == 0) {
+            g_warning("Batteries report zero full energy");
+            return G_SOURCE_CONTINUE;
+        }
+        sample.capacity = MIN(sum_now * 100 / sum_full, 100);
+        sample.flags |= SAMPLE_HAS_CAPACITY;
+    }
+
+    if (sample_needs_time(sample.status, context->sampled_status) && sum_rate > 0) {
+        if (sample.status == CHARGING_STATUS)
+            sample.seconds = (guint64)(3600.0 * (sum_full - MIN(sum_now, sum_full)) / sum_rate);
+        else
+            sample.seconds = (guint64)(3600.0 * sum_now / sum_rate);
+        sample.flags |= SAMPLE_HAS_TIME;
+    }
+
+    submit_sample(context, &sample);
+    return G_SOURCE_CONTINUE;
+}
+
+/* Picks up a reloaded policy set between two samples of the battery */
+static const Policy*
+context_update_policy(Context* context)
+{
+    if (context->policy != NULL && context->policy_generation == policies.generation)
+        return context->policy;
+
+    if (context->policy != NULL)
+        policy_unref(context->policy);
+    context->policy = policy_ref(policy_set_lookup(policies.set, context->battery));
+    context->policy_generation = policies.generation;
+    g_debug("Battery(%s) uses policy [%s]", context->battery->name, context->policy->name);
+    return context->policy;
+}
+
+/* Drops the battery row, the last row moves into its place */
+static void
+context_retire(Context* context)
+{
+    Context* moved;
+
+    if (context->row < 0)
+        return;
+
+    moved = table_remove(&policies.table, (guint)context->row);
+    if (moved != NULL)
+        moved->row = context->row;
+    context->row = -1;
+    if (context->history != NULL) {
+        history_close(context->history);
+        context->history = NULL;
+    }
+    context_unref(context);
+}
+
+/* Runs the state machine of one row against its threshold pass output */
+static void
+battery_transition(BatteryTable* table, guint row)
+{
+    Context* context = table->owners[row];
+    const Battery* battery = context->battery;
+    const BATTERY_STATUS status = table->status[row];
+    const BATTERY_STATUS prev_status = table->prev_status[row];
+    const guint64 capacity = (guint64)table->capacity[row];
+    const guint64 seconds = table->seconds[row];
+    const gint64 timestamp = table->timestamp[row];
+    const guint8 crossing = table->crossing[row];
+    guint8 flags = table->flags[row] & ~TABLE_DIRTY;
+
+    if (prev_status != status)
+        BATIFY_PROBE3(transition, battery->name, prev_status, status);
+
+    switch (status) {
+        case UNKNOWN_STATUS:
+            g_debug("Got UNKNOWN_STATUS");
+            flags &= ~(TABLE_LOW_NOTIFIED | TABLE_CRITICAL_NOTIFIED);
+
+            if (prev_status == status || !(flags & TABLE_HAS_CAPACITY))
+                break;
+
+            if (crossing & TABLE_ABOVE_FULL) {
+                g_debug("Battery(%s) capacity is greater then full capacity: %d",
+                        battery->name,
+                        table->full_capacity[row]);
+                push_event(context, timestamp, STATUS_EVENT, CHARGED_STATUS, capacity, 0);
+            }
+            break;
+        case CHARGED_STATUS:
+            g_debug("Battery(%s) got CHARGED_STATUS", battery->name);
+            flags &= ~(TABLE_LOW_NOTIFIED | TABLE_CRITICAL_NOTIFIED);
+            if (prev_status != status)
+                push_event(context, timestamp, STATUS_EVENT, status, 100, 0);
+            break;
+        case CHARGING_STATUS:
+            g_debug("Battery(%s) got CHARGING_STATUS", battery->name);
+            flags &= ~(TABLE_LOW_NOTIFIED | TABLE_CRITICAL_NOTIFIED);
+            if (prev_status == status || !(flags & TABLE_HAS_CAPACITY))
+                break;
+
+            push_event(context, timestamp, STATUS_EVENT, status, capacity, seconds);
+            break;
+        case DISCHARGING_STATUS:
+        case NOT_CHARGING_STATUS:
+            g_debug("Battery(%s) got NOT_CHARGING_STATUS or DISCHARGING_STATUS", battery->name);
+
+            if (prev_status != status)
+                push_event(context, timestamp, STATUS_EVENT, status, capacity, seconds);
+            /* A level is marked notified only once its event is queued, the next sample retries */
+            if (!(flags & TABLE_CRITICAL_NOTIFIED) && (crossing & TABLE_BELOW_CRITICAL)) {
+                BATIFY_PROBE3(threshold, battery->name, CRITICAL_LEVEL, capacity);
+                if (push_event(context, timestamp, LEVEL_EVENT, CRITICAL_LEVEL, capacity, seconds) == TRUE)
+                    flags = (flags & ~TABLE_LOW_NOTIFIED) | TABLE_CRITICAL_NOTIFIED;
+            }
+            if (!(flags & TABLE_LOW_NOTIFIED) && (crossing & TABLE_BELOW_LOW)) {
+                BATIFY_PROBE3(threshold, battery->name, LOW_LEVEL, capacity);
+                if (push_event(context, timestamp, LEVEL_EVENT, LOW_LEVEL, capacity, seconds) == TRUE)
+                    flags = (flags & ~TABLE_CRITICAL_NOTIFIED) | TABLE_LOW_NOTIFIED;
+            }
+            break;
+    }
+    table->flags[row] = flags;
+    table->prev_status[row] = (guint8)status;
+}
+
+static void
+record_sample(Context* context, const Sample* sample)
+{
+    if (context->trace_id == 0) {
+        if (sample->flags & SAMPLE_RETIRED)
+            return;
+        context->trace_id =
+          trace_writer_add_battery(trace.writer, sample->timestamp, context->battery);
+    }
+
+    if (sample->flags & SAMPLE_RETIRED)
+        trace_writer_retire(trace.writer, context->trace_id, sample->timestamp);
+    else
+        trace_writer_sample(trace.writer,
+                            context->trace_id,
+                            sample->timestamp,
+                            sample->status,
+                            sample->flags,
+                            sample->capacity,
+                            sample->seconds);
+}
+
+/* Wall clock seconds, so the history survives restarts and reboots */
+static void
+record_history(Context* context, guint row)
+{
+    const BatteryTable* table = &policies.table;
+    HistorySample sample = {
+        (table->timestamp[row] + g_get_real_time() - g_get_monotonic_time()) / G_USEC_PER_SEC,
+        (BATTERY_STATUS)table->status[row],
+        (guint64)table->capacity[row],
+        table->seconds[row],
+    };
+
+    history_append(context->history, &sample);
+}
+
+/*
+ * Stores the sample in the battery row, the thresholds are checked for all
+ * rows at once when the batch is flushed.
+ */
+static void
+battery_handler(Sample* sample, gpointer user_data)
+{
+    guint row;
+    GError* error = NULL;
+    const Policy* policy;
+    BatteryTable* table = &policies.table;
+    Context* context = sample->context;
+
+    if (trace.writer != NULL)
+        record_sample(context, sample);
+
+    if (sample->flags & SAMPLE_RETIRED) {
+        context_retire(context);
+        context_unref(context);
+        return;
+    }
+
+    if (context->row < 0) {
+        context->row = (gint)table_insert(table, context_ref(context));
+        if (config.history_dir != NULL) {
+            context->history = history_open(config.history_dir, context->battery, &error);
+            if (context->history == NULL) {
+                g_warning("No history for battery(%s): %s", context->battery->name, error->message);
+                g_clear_error(&error);
+            }
+        }
+    } else if (table->flags[context->row] & TABLE_DIRTY) {
+        /* Settle the previous sample of this batch before it is overwritten */
+        table_evaluate(table, (guint)context->row, (guint)context->row + 1);
+        battery_transition(table, (guint)context->row);
+    }
+
+    row = (guint)context->row;
+    policy = context_update_policy(context);
+    table->low_level[row] = policy->low_level;
+    table->critical_level[row] = policy->critical_level;
+    table->full_capacity[row] = policy->full_capacity;
+
+    table->status[row] = (guint8)sample->status;
+    table->timestamp[row] = sample->timestamp;
+    table->seconds[row] = sample->seconds;
+    table->flags[row] |= TABLE_DIRTY;
+    if (sample->flags & SAMPLE_HAS_CAPACITY) {
+        table->capacity[row] = (gint32)MIN(sample->capacity, G_MAXINT32);
+        table->flags[row] |= TABLE_HAS_CAPACITY;
+    } else {
+        table->flags[row] &= ~TABLE_HAS_CAPACITY;
+    }
+    if (context->history != NULL)
+        record_history(context, row);
+    context_unref(context);
+}
+
+/* One threshold pass over the whole table, then transitions of the fresh rows */
+static void
+battery_flush(gpointer user_data)
+{
+    guint row;
+    GError* error = NULL;
+    BatteryTable* table = &policies.table;
+
+    table_evaluate(table, 0, table->length);
+    for (row = 0; row < table->length; row++) {
+        if (table->flags[row] & TABLE_DIRTY)
+            battery_transition(table, row);
+    }
+
+    if (trace.writer != NULL && trace_writer_flush(trace.writer, &error) == FALSE) {
+        g_warning("Stop recording: %s", error->message);
+        g_error_free(error);
+        trace_writer_free(trace.writer);
+        trace.writer = NULL;
+    }
+}
+
+/* Hooks see the event through BATIFY_* variables added to the environment */
+static void
+run_hooks(const Context* context, const Event* event)
+{
+    guint i;
+    const gchar* name;
+    gchar* environment[6];
+
+    name = event->kind == STATUS_EVENT ? status_names[event->value] : level_names[event->value];
+    if (hooks == NULL || hooks_has(hooks, name) == FALSE)
+        return;
+
+    environment[0] = g_strconcat("BATIFY_EVENT=", name, NULL);
+    environment[1] = g_strconcat("BATIFY_BATTERY=", context->battery->name, NULL);
+    environment[2] = g_strdup_printf("BATIFY_PERCENT=%" G_GUINT64_FORMAT, event->percent);
+    environment[3] = g_strdup_printf("BATIFY_SECONDS=%" G_GUINT64_FORMAT, event->seconds);
+    environment[4] = g_strconcat(
+      "BATIFY_SERIAL=",
+      context->battery->serial_number != NULL ? context->battery->serial_number : "",
+      NULL);
+    environment[5] = NULL;
+
+    hooks_run(hooks, name, environment);
+
+    for (i = 0; environment[i] != NULL; i++)
+        g_free(environment[i]);
+}
+
+static void
+battery_notifier(Event* event, gpointer user_data)
+{
+    gint64 latency;
+    Context* context = event->context;
+
+    switch (event->kind) {
+        case STATUS_EVENT:
+            battery_status_notification(context->battery,
+                                        (BATTERY_STATUS)event->value,
+                                        event->percent,
+                                        event->seconds,
+                                        event->timeout,
+                                        context->notification);
+            break;
+        case LEVEL_EVENT:
+            battery_level_notification(context->battery,
+                                       (BATTERY_LEVEL)event->value,
+                                       event->percent,
+                                       event->seconds,
+                                       context->notification);
+            break;
+    }
+    run_hooks(context, event);
+    latency = g_get_monotonic_time() - event->timestamp;
+    BATIFY_PROBE4(notify, context->battery->name, event->kind, event->value, latency);
+    g_debug("Battery(%s) event delivered %" G_GINT64_FORMAT " us after sampling",
+            context->battery->name,
+            latency);
+    context_unref(context);
+}
+
+/* Delivery stage of a replay: decisions go to stdout stamped with trace time */
+static void
+replay_notifier(Event* event, gpointer user_data)
+{
+    Context* context = event->context;
+
+    printf("%.3f %s %s %" G_GUINT64_FORMAT "%% %" G_GUINT64_FORMAT "s\n",
+           (gdouble)(event->timestamp - trace.origin) / G_USEC_PER_SEC,
+           context->battery->name,
+           event->kind == STATUS_EVENT ? status_names[event->value] : level_names[event->value],
+           event->percent,
+           event->seconds);
+    context_unref(context);
+}
+
+/* FALSE when the policy queue is full and the record has to wait */
+static gboolean
+replay_record(TraceRecord* record)
+{
+    Context* context;
+    Sample sample = { 0 };
+
+    if (record->type == TRACE_BATTERY) {
+        g_info("Replay battery: %s", record->battery->name);
+        g_hash_table_replace(
+          trace.contexts, GUINT_TO_POINTER(record->id), context_init(record->battery));
+        record->battery = NULL;
+        return TRUE;
+    }
+
+    context = g_hash_table_lookup(trace.contexts, GUINT_TO_POINTER(record->id));
+    if (context == NULL) {
+        g_warning("Trace refers to unknown battery %u", record->id);
+        return TRUE;
+    }
+
+    sample.context = context_ref(context);
+    sample.timestamp = record->timestamp;
+    sample.status = record->status;
+    sample.flags = record->flags & (SAMPLE_HAS_CAPACITY | SAMPLE_HAS_TIME);
+    sample.capacity = record->capacity;
+    sample.seconds = record->seconds;
+    if (record->type == TRACE_RETIRE)
+        sample.flags = SAMPLE_RETIRED;
+
+    if (stage_push(pipeline.policy, &sample) == FALSE) {
+        context_unref(context);
+        return FALSE;
+    }
+    if (record->type == TRACE_RETIRE)
+        g_hash_table_remove(trace.contexts, GUINT_TO_POINTER(record->id));
+    return TRUE;
+}
+
+static gboolean
+replay_finish(gpointer user_data)
+{
+    g_info("Replay finished");
+    g_main_loop_quit(loop);
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * Feeds the trace to the policy stage on a virtual clock that runs speed
+ * times faster than the recording. The source wakes up when the clock
+ * reaches the next record.
+ */
+static gboolean
+replay_handler(gpointer user_data)
+{
+    guint count;
+    gint64 now, due;
+    GError* error = NULL;
+
+    for (count = 0; count < REPLAY_BATCH_SIZE; count++) {
+        if (trace.pending == FALSE) {
+            if (trace_reader_next(trace.reader, &trace.record, &error) == FALSE) {
+                if (error != NULL) {
+                    g_warning("Cannot read trace %s: %s", config.replay_file, error->message);
+                    g_error_free(error);
+                }
+                /* Lowest priority, so the queued samples and events go out first */
+                g_idle_add_full(G_PRIORITY_LOW, (GSourceFunc)replay_finish, NULL, NULL);
+                return G_SOURCE_REMOVE;
+            }
+            trace.pending = TRUE;
+        }
+
+        now = g_get_monotonic_time();
+        if (trace.start == 0) {
+            trace.start = now;
+            trace.origin = trace.record.timestamp;
+        }
+        due = trace.start + (gint64)((trace.record.timestamp - trace.origin) / config.replay_speed);
+        if (due > now) {
+            g_source_set_ready_time(trace.source, due);
+            return G_SOURCE_CONTINUE;
+        }
+
+        if (replay_record(&trace.record) == FALSE) {
+            g_source_set_ready_time(trace.source, now + REPLAY_RETRY_DELAY);
+            return G_SOURCE_CONTINUE;
+        }
+        trace.pending = FALSE;
+    }
+    g_source_set_ready_time(trace.source, 0);
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+replay_dispatch(GSource* source, GSourceFunc callback, gpointer user_data)
+{
+    return callback(user_data);
+}
+
+static GSourceFuncs replay_source_funcs = {
+    NULL,
+    NULL,
+    replay_dispatch,
+    NULL,
+};
+
+static Context*
+add_watcher(Battery* battery, GSourceFunc sampler)
+{
+    Context* context = context_init(battery);
+
+    if (watchers.subscribed == TRUE) {
+        g_info("Add new battery handler for: %s (on changes)", battery->name);
+        return context;
+    }
+
+    context->tag = scheduler_add(pipeline.scheduler,
+                                 context->interval,
+                                 sampler,
+                                 (gpointer)context_ref(context),
+                                 (GDestroyNotify)context_unref);
+
+    g_info("Add new battery handler for: %s (every %d s)", battery->name, context->interval);
+    return context;
+}
+
+/* Takes over a reference, kept until the policy stage accepts the record */
+static void
+retire_watcher(Context* context)
+{
+    Sample sample = { context, g_get_monotonic_time(), 0, SAMPLE_RETIRED, 0, 0 };
+
+    if (stage_push(pipeline.policy, &sample) == FALSE) {
+        g_debug("Policy queue is full, retire battery(%s) later", context->battery->name);
+        watchers.retired = g_slist_prepend(watchers.retired, context);
+    }
+}
+
+static void
+retire_pending_watchers(void)
+{
+    GSList *iter, *retired = watchers.retired;
+
+    watchers.retired = NULL;
+    for (iter = retired; iter != NULL; iter = g_slist_next(iter))
+        retire_watcher((Context*)iter->data);
+    g_slist_free(retired);
+}
+
+/* Runs on the acquisition context when the backend reports fresh values */
+static void
+battery_changed_handler(const gchar* identity, gpointer user_data)
+{
+    Context* context = g_hash_table_lookup(watchers.table, identity);
+
+    g_debug("Battery %s changed", identity);
+    if (context != NULL)
+        battery_sampler(context);
+    else if (aggregate.context != NULL)
+        aggregate_sampler(aggregate.context);
+}
+
+static void
+remove_watcher(Context* context)
+{
+    scheduler_remove(pipeline.scheduler, context->tag);
+    if (exporter != NULL)
+        exporter_remove(exporter, context->battery);
+    retire_watcher(context_ref(context));
+}
+
+static void
+log_stage_stats(const Stage* stage)
+{
+    RingStats stats;
+
+    if (stage_get_stats(stage, &stats) == FALSE)
+        return;
+
+    g_debug("Stage %s queue: depth %u/%u, high water %u, pushed %u, dropped %u",
+            stage_get_name(stage),
+            stats.depth,
+            stats.capacity,
+            stats.high_water,
+            stats.pushed,
+            stats.dropped);
+}
+
+static gboolean
+has_identity(GSList* batteries, const gchar* identity)
+{
+    GSList* iter;
+
+    for (iter = batteries; iter != NULL; iter = g_slist_next(iter)) {
+        if (((Battery*)iter->data)->identity == identity)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+static gboolean
+has_identities(GSList* batteries, GSList* subset)
+{
+    GSList* iter;
+
+    for (iter = subset; iter != NULL; iter = g_slist_next(iter)) {
+        if (has_identity(batteries, ((Battery*)iter->data)->identity) == FALSE)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/* Packs that joined the aggregate get their health read, packs that left are dropped */
+static void
+export_aggregate(GSList* batteries)
+{
+    GSList* iter;
+
+    for (iter = aggregate.batteries; iter != NULL; iter = g_slist_next(iter)) {
+        if (has_identity(batteries, ((Battery*)iter->data)->identity) == FALSE)
+            exporter_remove(exporter, iter->data);
+    }
+    for (iter = batteries; iter != NULL; iter = g_slist_next(iter)) {
+        if (has_identity(aggregate.batteries, ((Battery*)iter->data)->identity) == FALSE)
+            export_health(iter->data);
+    }
+}
+
+/* Takes the system batteries out of the list, peripherals stay on their own */
+static GSList*
+aggregate_update(GSList* batteries)
+{
+    GSList *iter, *next, *system = NULL;
+    gboolean changed;
+
+    for (iter = batteries; iter != NULL; iter = next) {
+        next = g_slist_next(iter);
+        if (((Battery*)iter->data)->peripheral == FALSE) {
+            system = g_slist_prepend(system, iter->data);
+            batteries = g_slist_delete_link(batteries, iter);
+        }
+    }
+
+    changed = has_identities(system, aggregate.batteries) == FALSE ||
+              has_identities(aggregate.batteries, system) == FALSE;
+    if (exporter != NULL)
+        export_aggregate(system);
+    g_slist_free_full(aggregate.batteries, (GDestroyNotify)battery_unref);
+    aggregate.batteries = system;
+    g_debug("Aggregate %u batteries", g_slist_length(system));
+
+    if (aggregate.context == NULL)
+        aggregate.context =
+          add_watcher(battery_new_virtual(AGGREGATE_NAME, AGGREGATE_TECHNOLOGY),
+                      (GSourceFunc)aggregate_sampler);
+    /* A pack that joined is sampled now, not an interval from now */
+    if (changed == TRUE)
+        aggregate_sampler(aggregate.context);
+    return batteries;
+}
+
+static gboolean
+remove_stale_watcher(const gchar* identity, Context* context, guint* removed)
+{
+    if (context->generation == watchers.generation)
+        return FALSE;
+
+    g_debug("Remove battery: %s", identity);
+    remove_watcher(context);
+    (*removed)++;
+    return TRUE;
+}
+
+/*
+ * One pass over the fresh list marks every live watcher with the current
+ * generation, one pass over the table drops the ones left unmarked.
+ */
+static gboolean
+batteries_supply_handler(gpointer user_data)
+{
+    gboolean result;
+    Battery* battery;
+    Context* context;
+    GError* error = NULL;
+    GSList *batteries = NULL, *b_iter;
+    guint added = 0, removed = 0;
+
+    stats_counter_inc(STAT_WAKEUPS);
+    stats_counter_inc(STAT_RESCANS);
+
+    g_info("Get batteries supply");
+    result = get_batteries_supply(&batteries, &error);
+    if (result == FALSE) {
+        g_slist_free_full(batteries, (GDestroyNotify)battery_unref);
+        g_main_loop_quit(loop);
         LOG_WARNING_AND_RETURN(G_SOURCE_REMOVE, error, "Cannot get batteries supply");
     }
 
+    if (config.aggregate == TRUE)
+        batteries = aggregate_update(batteries);
+
+    retire_pending_watchers();
+    watchers.generation++;
+
     g_info("Create watchers");
-    b_iter = batteries;
-    while (b_iter != NULL) {
-        battery = battery_copy((Battery*)b_iter->data);
-        ptag = (guint*)g_hash_table_lookup(watchers, battery->serial_number);
-        if (ptag == NULL) {
-            ptag = g_new(guint, 1);
-            *ptag = add_watcher(battery);
-            key = g_strdup(battery->serial_number);
-            g_hash_table_insert(watchers, (gpointer)key, (gpointer)ptag);
+    for (b_iter = batteries; b_iter != NULL; b_iter = g_slist_next(b_iter)) {
+        battery = (Battery*)b_iter->data;
+        context = g_hash_table_lookup(watchers.table, battery->identity);
+        if (context == NULL) {
+            context = add_watcher(battery_ref(battery), (GSourceFunc)battery_sampler);
+            if (profiles != NULL)
+                context->profile = profile_store_lookup(profiles, battery);
+            if (exporter != NULL)
+                export_health(battery);
+            g_hash_table_insert(watchers.table, (gpointer)battery->identity, context);
+            /* The scheduler would first sample it an interval from now */
+            battery_sampler(context);
+            added++;
         }
-        b_iter = g_slist_next(b_iter);
+        context->generation = watchers.generation;
     }
 
     g_info("Remove old watchers");
-    g_hash_table_iter_init(&w_iter, watchers);
-    while (g_hash_table_iter_next(&w_iter, (gpointer)&key, (gpointer)&ptag)) {
-        g_debug("Check battery with serial-number: %s", key);
-        b_iter = g_slist_find_custom(
-          batteries, (gconstpointer)key, (GCompareFunc)battery_compare_by_serial_number);
-
-        if (b_iter == NULL) {
-            g_debug("Remove battery with serial-number: %s", key);
-            g_hash_table_iter_remove(&w_iter);
-            g_source_remove(*ptag);
+    g_hash_table_foreach_remove(watchers.table, (GHRFunc)remove_stale_watcher, &removed);
+    BATIFY_PROBE3(rescan, g_hash_table_size(watchers.table), added, removed);
+
+    g_slist_free_full(batteries, (GDestroyNotify)battery_unref);
+
+    log_stage_stats(pipeline.policy);
+    log_stage_stats(pipeline.delivery);
+    return G_SOURCE_CONTINUE;
+}
+
+/* Runs on the acquisition context when the backend reports a battery added or removed */
+static void
+supply_changed_handler(gpointer user_data)
+{
+    g_debug("Batteries supply changed");
+    batteries_supply_handler(NULL);
+}
+
+/*
+ * Replaces the rescan timer by the reports of the backend when it can
+ * subscribe to them; otherwise, or with --poll, the timer keeps running.
+ */
+static gboolean
+subscribe_handler(GSource* rescan)
+{
+    GError* error = NULL;
+
+    if (battery_subscribe(&error) == FALSE) {
+        g_info("%s, rescan every %d s", error->message, DEFAULT_INTERVAL);
+        g_error_free(error);
+        return G_SOURCE_REMOVE;
+    }
+
+    g_info("Subscribed to the batteries of the backend");
+    g_source_destroy(rescan);
+    watchers.subscribed = TRUE;
+    batteries_supply_handler(NULL);
+    return G_SOURCE_REMOVE;
+}
+
+static void
+append_stage_json(GString* json, const Stage* stage)
+{
+    RingStats stats;
+
+    if (stage_get_stats(stage, &stats) == FALSE)
+        return;
+
+    g_string_append_printf(json,
+                           "\"%s\": {\"capacity\": %u, \"depth\": %u, \"high_water\": %u, "
+                           "\"pushed\": %u, \"dropped\": %u}",
+                           stage_get_name(stage),
+                           stats.capacity,
+                           stats.depth,
+                           stats.high_water,
+                           stats.pushed,
+                           stats.dropped);
+}
+
+static gchar*
+get_stats_json(void)
+{
+    GString* json = g_string_new("{");
+
+    stats_append_json(json);
+    g_string_append(json, ", \"queues\": {");
+    append_stage_json(json, pipeline.policy);
+    g_string_append(json, ", ");
+    append_stage_json(json, pipeline.delivery);
+    g_string_append(json, "}}\n");
+    return g_string_free(json, FALSE);
+}
+
+static gboolean
+stats_file_handler(gpointer user_data)
+{
+    GError* error = NULL;
+    gchar* json = get_stats_json();
+
+    /* g_file_set_contents() writes a temporary file and renames it over */
+    if (g_file_set_contents(config.stats_file, json, -1, &error) == FALSE) {
+        g_free(json);
+        LOG_WARNING_AND_RETURN(
+          G_SOURCE_CONTINUE, error, "Cannot write stats file: %s", config.stats_file);
+    }
+    g_free(json);
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+profiles_save_handler(gpointer user_data)
+{
+    GError* error = NULL;
+
+    if (profile_store_save(profiles, &error) == FALSE)
+        LOG_WARNING_AND_RETURN(
+          G_SOURCE_CONTINUE, error, "Cannot save profiles to %s", config.profile_file);
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+metrics_handler(gpointer user_data)
+{
+    GError* error = NULL;
+
+    if (exporter_write(exporter, &error) == FALSE)
+        LOG_WARNING_AND_RETURN(
+          G_SOURCE_CONTINUE, error, "Cannot write metrics file: %s", config.metrics_file);
+    return G_SOURCE_CONTINUE;
+}
+
+/* Runs once on the acquisition thread, policy and delivery keep their priority */
+static gboolean
+low_interference_handler(gpointer user_data)
+{
+    GError* error = NULL;
+
+    if (priority_lower(&error) == FALSE)
+        LOG_WARNING_AND_RETURN(G_SOURCE_REMOVE, error, "Cannot lower sampling priority");
+    g_info("Sampling runs in low interference mode");
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean
+prefault_handler(gpointer user_data)
+{
+    reserve_prefault();
+    return G_SOURCE_REMOVE;
+}
+
+/* Best effort, an alert that may wait on paging is still better than none */
+static gboolean
+lock_memory(void)
+{
+    GError* error = NULL;
+
+    if (reserve_set_oom_score_adj(RESERVE_OOM_SCORE_ADJ, &error) == FALSE) {
+        g_warning("%s", error->message);
+        g_clear_error(&error);
+    }
+    if (reserve_lock(&error) == FALSE) {
+        g_warning("%s, raise the memlock limit or grant CAP_IPC_LOCK", error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+
+    reserve_prefault();
+    g_info("Memory has been locked");
+    return TRUE;
+}
+
+static void
+prefault_stages(void)
+{
+    g_main_context_invoke(stage_get_context(pipeline.acquisition), prefault_handler, NULL);
+    g_main_context_invoke(stage_get_context(pipeline.policy), prefault_handler, NULL);
+    g_main_context_invoke(stage_get_context(pipeline.delivery), prefault_handler, NULL);
+}
+
+/* Leaves through the cleanup, so the backend restores what it changed */
+static gboolean
+quit_signal_handler(gpointer user_data)
+{
+    g_info("Quit on signal");
+    g_main_loop_quit(loop);
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+stats_signal_handler(gpointer user_data)
+{
+    gchar* json = get_stats_json();
+
+    g_print("%s", json);
+    fflush(stdout);
+    g_free(json);
+
+    if (config.stats_file != NULL)
+        stats_file_handler(NULL);
+    return G_SOURCE_CONTINUE;
+}
+
+static PolicySet*
+policies_load(GError** error)
+{
+    PolicySet* set;
+    Policy* base = policy_new("command line",
+                              config.low_level,
+                              config.critical_level,
+                              config.full_capacity,
+                              config.timeout);
+
+    if (g_file_test(config.config_file, G_FILE_TEST_EXISTS) == FALSE) {
+        g_info("No config file %s, use command line thresholds", config.config_file);
+        return policy_set_new(base);
+    }
+
+    set = policy_set_load(config.config_file, base, error);
+    policy_unref(base);
+    return set;
+}
+
+static gboolean
+policies_swap(PolicySet* set)
+{
+    g_mutex_lock(&policies.lock);
+    policy_set_free(policies.set);
+    policies.set = set;
+    g_mutex_unlock(&policies.lock);
+    policies.generation++;
+    g_info("Policies have been reloaded");
+    return G_SOURCE_REMOVE;
+}
+
+/* Asked by the backend on every scan, from the acquisition context */
+static guint
+alarm_level_handler(const Battery* battery, gpointer user_data)
+{
+    return lookup_critical_level(battery);
+}
+
+static gboolean
+config_reload_handler(gpointer user_data)
+{
+    GError* error = NULL;
+    PolicySet* set = policies_load(&error);
+
+    if (set == NULL)
+        LOG_WARNING_AND_RETURN(
+          G_SOURCE_CONTINUE, error, "Cannot reload %s, keep the old policies", config.config_file);
+
+    /* Runs between two samples on whichever thread owns the policy stage */
+    g_main_context_invoke(stage_get_context(pipeline.policy), (GSourceFunc)policies_swap, set);
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+config_watch_handler(gint fd, GIOCondition condition, gchar* basename)
+{
+    gssize length, offset;
+    gboolean changed = FALSE;
+    const struct inotify_event* event;
+    union
+    {
+        struct inotify_event event;
+        gchar data[4096];
+    } buffer;
+
+    while ((length = read(fd, &buffer, sizeof(buffer))) > 0) {
+        for (offset = 0; offset < length; offset += sizeof(*event) + event->len) {
+            event = (const struct inotify_event*)(buffer.data + offset);
+            if (event->len > 0 && g_strcmp0(event->name, basename) == 0)
+                changed = TRUE;
         }
     }
 
-    g_slist_free_full(batteries, (GDestroyNotify)battery_free);
+    if (changed == TRUE)
+        config_reload_handler(NULL);
     return G_SOURCE_CONTINUE;
 }
 
+static void
+config_watch_uninit(void)
+{
+    if (policies.watch_source == 0)
+        return;
+
+    g_source_remove(policies.watch_source);
+    close(policies.watch_fd);
+    g_free(policies.watch_basename);
+    policies.watch_source = 0;
+    policies.watch_fd = -1;
+    policies.watch_basename = NULL;
+}
+
+/* Editors replace files by rename, so the directory is watched, not the file */
+static void
+config_watch_init(void)
+{
+    gint fd;
+    gchar* dirname = g_path_get_dirname(config.config_file);
+
+    config_watch_uninit();
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0 || inotify_add_watch(fd, dirname, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        g_debug("Cannot watch %s: %s, reload with SIGHUP", dirname, g_strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        g_free(dirname);
+        return;
+    }
+
+    policies.watch_fd = fd;
+    policies.watch_basename = g_path_get_basename(config.config_file);
+    policies.watch_source = g_unix_fd_add(
+      fd, G_IO_IN, (GUnixFDSourceFunc)config_watch_handler, policies.watch_basename);
+    g_free(dirname);
+}
+
+static gboolean
+hook_event_valid(const gchar* event)
+{
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS(status_names); i++) {
+        if (g_strcmp0(status_names[i], event) == 0)
+            return TRUE;
+    }
+    for (i = 0; i < G_N_ELEMENTS(level_names); i++) {
+        if (g_strcmp0(level_names[i], event) == 0)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+static Hooks*
+hooks_load(GMainContext* context, GError** error)
+{
+    gchar** spec;
+    gchar* event;
+    const gchar* separator;
+    Hooks* result = hooks_new(context, config.max_hooks, config.hook_timeout);
+
+    for (spec = config.hooks; *spec != NULL; spec++) {
+        separator = strchr(*spec, '=');
+        if (separator == NULL) {
+            g_set_error(
+              error, HOOKS_ERROR, HOOKS_INVALID_EVENT, "Hook \"%s\" has no EVENT=", *spec);
+            hooks_free(result);
+            return NULL;
+        }
+
+        event = g_strndup(*spec, separator - *spec);
+        if (hook_event_valid(event) == FALSE) {
+            g_set_error(error, HOOKS_ERROR, HOOKS_INVALID_EVENT, "Unknown hook event %s", event);
+            g_free(event);
+            hooks_free(result);
+            return NULL;
+        }
+        if (hooks_add(result, event, separator + 1, error) == FALSE) {
+            g_free(event);
+            hooks_free(result);
+            return NULL;
+        }
+        g_free(event);
+    }
+    return result;
+}
+
+static gboolean
+parse_duration(const gchar* text, gint64* seconds)
+{
+    gchar* end;
+    guint64 value = g_ascii_strtoull(text, &end, 10);
+
+    if (end == text)
+        return FALSE;
+    switch (*end) {
+        case '\0':
+        case 's':
+            break;
+        case 'm':
+            value *= 60;
+            break;
+        case 'h':
+            value *= 3600;
+            break;
+        case 'd':
+            value *= 86400;
+            break;
+        default:
+            return FALSE;
+    }
+    if (*end != '\0' && end[1] != '\0')
+        return FALSE;
+    *seconds = (gint64)value;
+    return TRUE;
+}
+
+static void
+print_duration(const gchar* label, gint64 seconds)
+{
+    printf(", %s %" G_GINT64_FORMAT "h %02" G_GINT64_FORMAT "m",
+           label,
+           seconds / 3600,
+           seconds / 60 % 60);
+}
+
+/* One line per history file, the drain rate only counts time seen on battery */
+static gint
+print_history(void)
+{
+    GDir* dir;
+    gchar* path;
+    gint result = 0;
+    gdouble rate;
+    const gchar* name;
+    HistoryInfo info;
+    HistorySummary summary;
+    GError* error = NULL;
+    gint64 since = 0;
+
+    if (config.since != NULL)
+        since = g_get_real_time() / G_USEC_PER_SEC - config.since_seconds;
+
+    dir = g_dir_open(config.history_dir, 0, &error);
+    if (dir == NULL)
+        LOG_WARNING_AND_RETURN(1, error, "Cannot open history %s", config.history_dir);
+
+    while ((name = g_dir_read_name(dir)) != NULL) {
+        if (g_str_has_suffix(name, HISTORY_SUFFIX) == FALSE)
+            continue;
+
+        path = g_build_filename(config.history_dir, name, NULL);
+        if (history_summarize(path, since, &info, &summary, &error) == FALSE) {
+            g_warning("Skip %s: %s", path, error->message);
+            g_clear_error(&error);
+            g_free(path);
+            result = 1;
+            continue;
+        }
+
+        printf("%s (%s %s): %u samples, %u discharges",
+               info.name,
+               info.model,
+               info.serial,
+               summary.samples,
+               summary.discharges);
+        print_duration("on battery", summary.on_battery);
+        print_duration("longest", summary.longest);
+        if (summary.on_battery > 0 && summary.drained > 0) {
+            rate = summary.drained * 3600.0 / summary.on_battery;
+            printf(", %.1f %%/h", rate);
+            print_duration("full runtime", (gint64)(100 * 3600 / rate));
+        }
+        printf("\n");
+
+        history_info_clear(&info);
+        g_free(path);
+    }
+    g_dir_close(dir);
+    return result;
+}
+
 static gboolean
 options_init(int argc, char* argv[])
 {
@@ -444,40 +2075,291 @@ options_init(int argc, char* argv[])
         return FALSE;
     }
 
+    if (config.queue_depth <= 0) {
+        g_warning("Invalid queue depth! Queue depth should be greater then 0");
+        return FALSE;
+    }
+
+    if (config.peripheral_interval <= 0) {
+        g_warning("Invalid peripheral interval! Peripheral interval should be greater then 0");
+        return FALSE;
+    }
+
+    if (config.replay_speed <= 0) {
+        g_warning("Invalid replay speed! Replay speed should be greater then 0");
+        return FALSE;
+    }
+
+    if (config.housekeeping_cpus != NULL && config.low_interference == FALSE) {
+        g_warning("--housekeeping-cpus needs --low-interference");
+        return FALSE;
+    }
+    if (config.housekeeping_cpus != NULL &&
+        priority_set_cpus(config.housekeeping_cpus, &error) == FALSE)
+        LOG_WARNING_AND_RETURN(FALSE, error, "Cannot use housekeeping CPUs");
+    /* Only acquisition is lowered, so it needs a thread of its own */
+    if (config.low_interference == TRUE && config.replay_file != NULL) {
+        g_info("Replay ignores --low-interference");
+        config.low_interference = FALSE;
+    }
+    if (config.low_interference == TRUE)
+        config.threads = TRUE;
+
+    /* The end of a replay is detected on the default context */
+    if (config.replay_file != NULL && config.threads == TRUE) {
+        g_info("Replay runs all stages inline");
+        config.threads = FALSE;
+    }
+
+    if (config.hook_timeout < 0) {
+        g_warning("Invalid hook timeout! Hook timeout should not be negative");
+        return FALSE;
+    }
+    if (config.max_hooks <= 0) {
+        g_warning("Invalid max hooks! Max hooks should be greater then 0");
+        return FALSE;
+    }
+
+    if (config.history == TRUE && config.history_dir == NULL) {
+        g_warning("--history needs --history-dir");
+        return FALSE;
+    }
+    if (config.since != NULL && parse_duration(config.since, &config.since_seconds) == FALSE) {
+        g_warning("Invalid duration \"%s\"! Use a number with an optional s, m, h or d",
+                  config.since);
+        return FALSE;
+    }
+    /* Replayed samples carry trace time, not wall clock time */
+    if (config.replay_file != NULL && config.history == FALSE) {
+        g_free(config.history_dir);
+        config.history_dir = NULL;
+    }
+    if (config.history_dir != NULL && config.history == FALSE &&
+        g_mkdir_with_parents(config.history_dir, 0755) != 0) {
+        g_warning("Cannot create history directory %s: %s", config.history_dir, g_strerror(errno));
+        return FALSE;
+    }
+
+    if (config.stats_interval <= 0) {
+        g_warning("Invalid stats interval! Stats interval should be greater then 0");
+        return FALSE;
+    }
+    if (config.metrics_interval <= 0) {
+        g_warning("Invalid metrics interval! Metrics interval should be greater then 0");
+        return FALSE;
+    }
+
+    if (config.config_file == NULL)
+        config.config_file =
+          g_build_filename(g_get_user_config_dir(), CONFIG_DIRNAME, CONFIG_FILENAME, NULL);
+
+    if (config.simulation != NULL) {
+        if (simulation_configure(config.simulation, &error) == FALSE)
+            LOG_WARNING_AND_RETURN(FALSE, error, "Cannot parse simulation spec");
+        g_free(config.backend);
+        config.backend = g_strdup(SIMULATION_BACKEND_NAME);
+    }
+    if (config.backend == NULL)
+        config.backend = g_strdup(BATTERY_DEFAULT_BACKEND);
+    if (config.sysfs_path != NULL)
+        battery_set_sysfs_path(config.sysfs_path);
+    battery_set_selection(config.peripherals, config.include, config.exclude);
+
     if (config.timeout > 0) {
         config.timeout *= 1000;
     }
 
+    templates.status_summary = template_new(
+      config.status_summary != NULL ? config.status_summary : DEFAULT_STATUS_SUMMARY, &error);
+    if (templates.status_summary == NULL)
+        LOG_WARNING_AND_RETURN(FALSE, error, "Invalid status summary");
+    templates.level_summary = template_new(
+      config.level_summary != NULL ? config.level_summary : DEFAULT_LEVEL_SUMMARY, &error);
+    if (templates.level_summary == NULL)
+        LOG_WARNING_AND_RETURN(FALSE, error, "Invalid level summary");
+    templates.body = template_new(config.body != NULL ? config.body : DEFAULT_BODY, &error);
+    if (templates.body == NULL)
+        LOG_WARNING_AND_RETURN(FALSE, error, "Invalid body");
+
     return TRUE;
 }
 
 int
 main(int argc, char* argv[])
 {
-    GHashTable* watchers;
+    GSource *source, *profiles_source = NULL, *metrics_source = NULL;
+    GError* error = NULL;
+    gboolean locked = FALSE;
 
     setlocale(LC_ALL, "");
+    stats_init();
     g_return_val_if_fail(options_init(argc, argv), 1);
     g_info("Options have been initialized");
 
+    if (config.history == TRUE)
+        return print_history();
+
+    /* Before the backend, D-Bus and the stages start threads with large stacks */
+    if (config.lock_memory == TRUE)
+        locked = lock_memory();
+
+    policies.set = policies_load(&error);
+    if (policies.set == NULL)
+        LOG_WARNING_AND_RETURN(1, error, "Cannot load config file %s", config.config_file);
+    policies.generation = 1;
+    g_info("Policies have been initialized");
+
+    if (config.replay_file != NULL) {
+        trace.reader = trace_reader_new(config.replay_file, &error);
+        if (trace.reader == NULL)
+            LOG_WARNING_AND_RETURN(1, error, "Cannot replay %s", config.replay_file);
+        g_info("Replay %s at %gx", config.replay_file, config.replay_speed);
+    } else {
+        if (battery_set_backend(config.backend, &error) == FALSE)
+            LOG_WARNING_AND_RETURN(1, error, "Cannot initialize %s backend", config.backend);
+        battery_set_changed_handler(battery_changed_handler, NULL);
+        battery_set_supply_handler(supply_changed_handler, NULL);
+        if (config.alarm == TRUE)
+            battery_set_alarm_handler(alarm_level_handler, NULL);
+        g_info("Backend %s has been initialized", config.backend);
+    }
+
+    if (config.profile_file != NULL && config.replay_file == NULL) {
+        profiles = profile_store_load(config.profile_file, &error);
+        if (profiles == NULL)
+            LOG_WARNING_AND_RETURN(1, error, "Cannot load profiles");
+        g_info("Profiles have been loaded from %s", config.profile_file);
+    }
+
+    if (config.record_file != NULL) {
+        trace.writer = trace_writer_new(config.record_file, &error);
+        if (trace.writer == NULL)
+            LOG_WARNING_AND_RETURN(1, error, "Cannot record to %s", config.record_file);
+        g_info("Record samples to %s", config.record_file);
+    }
+
     g_return_val_if_fail(notify_init(PROGRAM_NAME), 1);
     g_info("Notify has been initialized");
 
-    watchers = g_hash_table_new_full((GHashFunc)g_str_hash,
-                                     (GEqualFunc)g_str_equal,
-                                     (GDestroyNotify)g_free,
-                                     (GDestroyNotify)g_free);
+    context_pool = pool_new(sizeof(Context), CONTEXT_POOL_CHUNK);
+    table_init(&policies.table);
+    watchers.table =
+      g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)context_unref);
+
+    pipeline.delivery = stage_new("delivery",
+                                  config.threads,
+                                  sizeof(Event),
+                                  config.queue_depth,
+                                  config.replay_file != NULL ? (StageHandler)replay_notifier
+                                                             : (StageHandler)battery_notifier,
+                                  NULL);
+    pipeline.policy = stage_new("policy",
+                                config.threads,
+                                sizeof(Sample),
+                                config.queue_depth,
+                                (StageHandler)battery_handler,
+                                NULL);
+    stage_set_flush(pipeline.policy, battery_flush);
+    if (config.hooks != NULL && config.replay_file == NULL) {
+        hooks = hooks_load(stage_get_context(pipeline.delivery), &error);
+        if (hooks == NULL)
+            LOG_WARNING_AND_RETURN(1, error, "Cannot load hooks");
+    }
+    pipeline.acquisition = stage_new("acquisition", config.threads, 0, 0, NULL, NULL);
+    pipeline.scheduler = scheduler_new(stage_get_context(pipeline.acquisition));
+    if (config.low_interference == TRUE)
+        g_main_context_invoke(
+          stage_get_context(pipeline.acquisition), low_interference_handler, NULL);
+    g_info("Pipeline has been initialized");
+
+    if (locked == TRUE && config.threads == TRUE)
+        prefault_stages();
 
     loop = g_main_loop_new(NULL, FALSE);
-    g_timeout_add_seconds(
-      DEFAULT_INTERVAL, (GSourceFunc)batteries_supply_handler, (gpointer)watchers);
+    g_unix_signal_add(SIGUSR1, (GSourceFunc)stats_signal_handler, NULL);
+    g_unix_signal_add(SIGHUP, (GSourceFunc)config_reload_handler, NULL);
+    g_unix_signal_add(SIGTERM, (GSourceFunc)quit_signal_handler, NULL);
+    g_unix_signal_add(SIGINT, (GSourceFunc)quit_signal_handler, NULL);
+    config_watch_init();
+    if (config.stats_file != NULL)
+        g_timeout_add_seconds(config.stats_interval, (GSourceFunc)stats_file_handler, NULL);
+
+    if (config.replay_file != NULL) {
+        trace.contexts = g_hash_table_new_full(
+          g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)context_unref);
+        source = g_source_new(&replay_source_funcs, sizeof(GSource));
+        g_source_set_callback(source, (GSourceFunc)replay_handler, NULL, NULL);
+        g_source_set_ready_time(source, 0);
+        trace.source = source;
+    } else {
+        source = g_timeout_source_new_seconds(DEFAULT_INTERVAL);
+        g_source_set_callback(source, (GSourceFunc)batteries_supply_handler, NULL, NULL);
+    }
+    g_source_attach(source, stage_get_context(pipeline.acquisition));
+    if (profiles != NULL) {
+        profiles_source = g_timeout_source_new_seconds(PROFILE_SAVE_INTERVAL);
+        g_source_set_callback(profiles_source, (GSourceFunc)profiles_save_handler, NULL, NULL);
+        g_source_attach(profiles_source, stage_get_context(pipeline.acquisition));
+    }
+    /* Replayed batteries have no backend to read the rest from */
+    if (config.metrics_file != NULL && config.replay_file == NULL) {
+        exporter = exporter_new(config.metrics_file);
+        metrics_source = g_timeout_source_new_seconds(config.metrics_interval);
+        g_source_set_callback(metrics_source, (GSourceFunc)metrics_handler, NULL, NULL);
+        g_source_attach(metrics_source, stage_get_context(pipeline.acquisition));
+    }
+    if (config.poll == FALSE && config.replay_file == NULL)
+        g_main_context_invoke(
+          stage_get_context(pipeline.acquisition), (GSourceFunc)subscribe_handler, source);
 
     g_info("Run loop");
     g_main_loop_run(loop);
 
+    g_source_destroy(source);
+    g_source_unref(source);
+    config_watch_uninit();
     g_main_loop_unref(loop);
+
+    stage_free(pipeline.acquisition);
+    if (exporter != NULL) {
+        g_source_destroy(metrics_source);
+        g_source_unref(metrics_source);
+        exporter_free(exporter);
+    }
+    if (profiles != NULL) {
+        g_source_destroy(profiles_source);
+        g_source_unref(profiles_source);
+        profiles_save_handler(NULL);
+        profile_store_free(profiles);
+    }
+    scheduler_free(pipeline.scheduler);
+    g_hash_table_destroy(watchers.table);
+    g_slist_free_full(watchers.retired, (GDestroyNotify)context_unref);
+    if (trace.contexts != NULL)
+        g_hash_table_destroy(trace.contexts);
+    if (trace.pending == TRUE && trace.record.battery != NULL)
+        battery_unref(trace.record.battery);
+    if (aggregate.context != NULL)
+        context_unref(aggregate.context);
+    g_slist_free_full(aggregate.batteries, (GDestroyNotify)battery_unref);
+    battery_unset_backend();
+    stage_free(pipeline.policy);
+    while (policies.table.length > 0)
+        context_retire(policies.table.owners[policies.table.length - 1]);
+    table_clear(&policies.table);
+    if (trace.writer != NULL)
+        trace_writer_free(trace.writer);
+    if (trace.reader != NULL)
+        trace_reader_free(trace.reader);
+    stage_free(pipeline.delivery);
+    if (hooks != NULL)
+        hooks_free(hooks);
+    pool_free(context_pool);
+    policy_set_free(policies.set);
+    template_free(templates.status_summary);
+    template_free(templates.level_summary);
+    template_free(templates.body);
     notify_uninit();
-    g_hash_table_destroy(watchers);
 
     return 0;
 }
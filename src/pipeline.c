@@ -0,0 +1,178 @@
+#include <glib.h>
+
+#include "pipeline.h"
+
+#define STAGE_BATCH_SIZE 32
+
+typedef struct _RingSource
+{
+    GSource source;
+    Stage* stage;
+} RingSource;
+
+struct _Stage
+{
+    gchar* name;
+    gboolean threaded;
+    GMainContext* context;
+    GMainLoop* loop;
+    GThread* thread;
+
+    Ring* ring;
+    gsize record_size;
+    gpointer record;
+    StageHandler handler;
+    StageFlush flush;
+    gpointer user_data;
+    GSource* source;
+};
+
+static gboolean
+ring_source_prepare(GSource* source, gint* timeout)
+{
+    *timeout = -1;
+    return ring_is_empty(((RingSource*)source)->stage->ring) == FALSE;
+}
+
+static gboolean
+ring_source_check(GSource* source)
+{
+    return ring_is_empty(((RingSource*)source)->stage->ring) == FALSE;
+}
+
+static gboolean
+ring_source_dispatch(GSource* source, GSourceFunc callback, gpointer user_data)
+{
+    guint count;
+    Stage* stage = ((RingSource*)source)->stage;
+
+    /* Bounded batch so one busy ring cannot starve the other sources */
+    for (count = 0; count < STAGE_BATCH_SIZE; count++) {
+        if (ring_pop(stage->ring, stage->record) == FALSE)
+            break;
+        stage->handler(stage->record, stage->user_data);
+    }
+    if (count > 0 && stage->flush != NULL)
+        stage->flush(stage->user_data);
+    return G_SOURCE_CONTINUE;
+}
+
+static GSourceFuncs ring_source_funcs = {
+    ring_source_prepare,
+    ring_source_check,
+    ring_source_dispatch,
+    NULL,
+};
+
+static gpointer
+stage_thread(Stage* stage)
+{
+    g_main_context_push_thread_default(stage->context);
+    g_main_loop_run(stage->loop);
+    g_main_context_pop_thread_default(stage->context);
+    return NULL;
+}
+
+Stage*
+stage_new(const gchar* name,
+          gboolean threaded,
+          gsize record_size,
+          guint depth,
+          StageHandler handler,
+          gpointer user_data)
+{
+    Stage* stage = g_new0(Stage, 1);
+    stage->name = g_strdup(name);
+    stage->threaded = threaded;
+
+    if (threaded == TRUE)
+        stage->context = g_main_context_new();
+    else
+        stage->context = g_main_context_ref(g_main_context_default());
+
+    if (handler != NULL) {
+        stage->ring = ring_new(record_size, depth);
+        stage->record_size = record_size;
+        stage->record = g_malloc0(record_size);
+        stage->handler = handler;
+        stage->user_data = user_data;
+
+        stage->source = g_source_new(&ring_source_funcs, sizeof(RingSource));
+        ((RingSource*)stage->source)->stage = stage;
+        g_source_set_name(stage->source, name);
+        g_source_attach(stage->source, stage->context);
+    }
+
+    if (threaded == TRUE) {
+        stage->loop = g_main_loop_new(stage->context, FALSE);
+        stage->thread = g_thread_new(name, (GThreadFunc)stage_thread, stage);
+    }
+    g_info("Stage %s runs %s", name, threaded ? "on its own thread" : "inline");
+    return stage;
+}
+
+void
+stage_free(Stage* stage)
+{
+    if (stage->thread != NULL) {
+        g_main_loop_quit(stage->loop);
+        g_main_context_wakeup(stage->context);
+        g_thread_join(stage->thread);
+        g_main_loop_unref(stage->loop);
+    }
+    if (stage->source != NULL) {
+        g_source_destroy(stage->source);
+        g_source_unref(stage->source);
+    }
+    if (stage->ring != NULL) {
+        ring_free(stage->ring);
+        g_free(stage->record);
+    }
+    g_main_context_unref(stage->context);
+    g_free(stage->name);
+    g_free(stage);
+}
+
+/* Called from the stage context once per batch, after its last record */
+void
+stage_set_flush(Stage* stage, StageFlush flush)
+{
+    stage->flush = flush;
+}
+
+const gchar*
+stage_get_name(const Stage* stage)
+{
+    return stage->name;
+}
+
+GMainContext*
+stage_get_context(const Stage* stage)
+{
+    return stage->context;
+}
+
+gboolean
+stage_push(Stage* stage, gconstpointer record)
+{
+    if (ring_push(stage->ring, record) == FALSE)
+        return FALSE;
+
+    /*
+     * A producer dispatched from the consumer context is followed by its
+     * prepare anyway; any other producer, inline or not, has to wake it.
+     */
+    if (g_main_context_is_owner(stage->context) == FALSE)
+        g_main_context_wakeup(stage->context);
+    return TRUE;
+}
+
+gboolean
+stage_get_stats(const Stage* stage, RingStats* stats)
+{
+    if (stage->ring == NULL)
+        return FALSE;
+
+    ring_get_stats(stage->ring, stats);
+    return TRUE;
+}
@@ -0,0 +1,43 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <glib.h>
+
+#include "ring.h"
+
+/*
+ * A stage owns a GMainContext and, optionally, an input ring. Records pushed
+ * into the ring are handed to the stage handler from that context. A threaded
+ * stage runs its context on a dedicated thread, an inline stage shares the
+ * default main context.
+ */
+
+#define DEFAULT_STAGE_DEPTH 64
+
+typedef void (*StageHandler)(gpointer record, gpointer user_data);
+typedef void (*StageFlush)(gpointer user_data);
+
+typedef struct _Stage Stage;
+
+Stage*
+stage_new(const gchar* name,
+          gboolean threaded,
+          gsize record_size,
+          guint depth,
+          StageHandler handler,
+          gpointer user_data);
+void
+stage_free(Stage* stage);
+void
+stage_set_flush(Stage* stage, StageFlush flush);
+
+const gchar*
+stage_get_name(const Stage* stage);
+GMainContext*
+stage_get_context(const Stage* stage);
+gboolean
+stage_push(Stage* stage, gconstpointer record);
+gboolean
+stage_get_stats(const Stage* stage, RingStats* stats);
+
+#endif // PIPELINE_H
@@ -0,0 +1,258 @@
+#include <glib.h>
+
+#include "policy.h"
+
+G_DEFINE_QUARK(policy-error-quark, policy_error)
+
+typedef struct _Rule
+{
+    gchar* name;
+    gchar* model;
+    gchar* manufacturer;
+    gchar* serial;
+    Policy* policy;
+} Rule;
+
+struct _PolicySet
+{
+    GPtrArray* rules;
+    Policy* defaults;
+};
+
+static void
+rule_free(Rule* rule)
+{
+    g_free(rule->name);
+    g_free(rule->model);
+    g_free(rule->manufacturer);
+    g_free(rule->serial);
+    policy_unref(rule->policy);
+    g_free(rule);
+}
+
+static gboolean
+rule_match_field(const gchar* pattern, const gchar* value)
+{
+    return pattern == NULL || g_pattern_match_simple(pattern, value != NULL ? value : "");
+}
+
+static gboolean
+rule_match(const Rule* rule, const Battery* battery)
+{
+    return rule_match_field(rule->name, battery->name) &&
+           rule_match_field(rule->model, battery->model_name) &&
+           rule_match_field(rule->manufacturer, battery->manufacture) &&
+           rule_match_field(rule->serial, battery->serial_number);
+}
+
+static gint
+key_file_get_integer(GKeyFile* key_file, const gchar* group, const gchar* key, gint value)
+{
+    GError* error = NULL;
+    gint result;
+
+    if (g_key_file_has_key(key_file, group, key, NULL) == FALSE)
+        return value;
+
+    result = g_key_file_get_integer(key_file, group, key, &error);
+    if (error != NULL) {
+        g_warning("Ignore [%s] %s: %s", group, key, error->message);
+        g_error_free(error);
+        return value;
+    }
+    return result;
+}
+
+static Policy*
+policy_load(GKeyFile* key_file, const gchar* group, const Policy* base, GError** error)
+{
+    gint timeout = base->timeout;
+    Policy* policy;
+
+    /* Timeouts are seconds in the file and milliseconds once loaded */
+    if (g_key_file_has_key(key_file, group, POLICY_TIMEOUT_KEY, NULL) == TRUE) {
+        timeout = key_file_get_integer(key_file, group, POLICY_TIMEOUT_KEY, -1);
+        if (timeout > 0)
+            timeout *= 1000;
+    }
+
+    policy = policy_new(
+      group,
+      key_file_get_integer(key_file, group, POLICY_LOW_LEVEL_KEY, base->low_level),
+      key_file_get_integer(key_file, group, POLICY_CRITICAL_LEVEL_KEY, base->critical_level),
+      key_file_get_integer(key_file, group, POLICY_FULL_CAPACITY_KEY, base->full_capacity),
+      timeout);
+
+    if (policy_validate(policy, error) == FALSE) {
+        g_prefix_error(error, "[%s] ", group);
+        policy_unref(policy);
+        return NULL;
+    }
+    return policy;
+}
+
+Policy*
+policy_new(const gchar* name, gint low_level, gint critical_level, gint full_capacity, gint timeout)
+{
+    Policy* policy = g_new(Policy, 1);
+    policy->ref_count = 1;
+    policy->name = g_strdup(name);
+    policy->low_level = low_level;
+    policy->critical_level = critical_level;
+    policy->full_capacity = full_capacity;
+    policy->timeout = timeout;
+    return policy;
+}
+
+Policy*
+policy_ref(Policy* policy)
+{
+    g_atomic_int_inc(&policy->ref_count);
+    return policy;
+}
+
+void
+policy_unref(Policy* policy)
+{
+    if (g_atomic_int_dec_and_test(&policy->ref_count)) {
+        g_free(policy->name);
+        g_free(policy);
+    }
+}
+
+gboolean
+policy_validate(const Policy* policy, GError** error)
+{
+    if (policy->low_level < 0 || policy->low_level > 100) {
+        g_set_error(error,
+                    POLICY_ERROR,
+                    POLICY_INVALID_LEVEL,
+                    "Low level should be greater then 0, less then 100");
+        return FALSE;
+    }
+    if (policy->critical_level < 0 || policy->critical_level > 100) {
+        g_set_error(error,
+                    POLICY_ERROR,
+                    POLICY_INVALID_LEVEL,
+                    "Critical level should be greater then 0, less then 100");
+        return FALSE;
+    }
+    if (policy->full_capacity < 0 || policy->full_capacity > 100) {
+        g_set_error(error,
+                    POLICY_ERROR,
+                    POLICY_INVALID_LEVEL,
+                    "Full capacity should be greater then 0, less then 100");
+        return FALSE;
+    }
+    if (policy->low_level < policy->critical_level) {
+        g_set_error(error,
+                    POLICY_ERROR,
+                    POLICY_INVALID_LEVEL,
+                    "Low level should be greater then critical level");
+        return FALSE;
+    }
+    if (policy->full_capacity < policy->critical_level) {
+        g_set_error(error,
+                    POLICY_ERROR,
+                    POLICY_INVALID_LEVEL,
+                    "Full capacity should be greater then critical level");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+PolicySet*
+policy_set_new(Policy* defaults)
+{
+    PolicySet* set = g_new(PolicySet, 1);
+    set->rules = g_ptr_array_new_with_free_func((GDestroyNotify)rule_free);
+    set->defaults = defaults;
+    return set;
+}
+
+/*
+ * [default] overrides the command line thresholds, every other group is a
+ * rule. Rules are tried in file order and the first one whose match keys
+ * (shell globs, a missing key matches anything) all match wins.
+ */
+PolicySet*
+policy_set_load(const gchar* path, const Policy* base, GError** error)
+{
+    gsize i, length;
+    gchar** groups;
+    Rule* rule;
+    Policy* defaults;
+    PolicySet* set;
+    GKeyFile* key_file = g_key_file_new();
+
+    if (g_key_file_load_from_file(key_file, path, G_KEY_FILE_NONE, error) == FALSE) {
+        g_key_file_free(key_file);
+        return NULL;
+    }
+
+    if (g_key_file_has_group(key_file, POLICY_DEFAULT_GROUP) == TRUE)
+        defaults = policy_load(key_file, POLICY_DEFAULT_GROUP, base, error);
+    else
+        defaults = policy_new(POLICY_DEFAULT_GROUP,
+                              base->low_level,
+                              base->critical_level,
+                              base->full_capacity,
+                              base->timeout);
+    if (defaults == NULL) {
+        g_key_file_free(key_file);
+        return NULL;
+    }
+
+    set = policy_set_new(defaults);
+    groups = g_key_file_get_groups(key_file, &length);
+    for (i = 0; i < length; i++) {
+        if (g_strcmp0(groups[i], POLICY_DEFAULT_GROUP) == 0)
+            continue;
+
+        rule = g_new0(Rule, 1);
+        rule->name = g_key_file_get_string(key_file, groups[i], POLICY_NAME_KEY, NULL);
+        rule->model = g_key_file_get_string(key_file, groups[i], POLICY_MODEL_KEY, NULL);
+        rule->manufacturer =
+          g_key_file_get_string(key_file, groups[i], POLICY_MANUFACTURER_KEY, NULL);
+        rule->serial = g_key_file_get_string(key_file, groups[i], POLICY_SERIAL_KEY, NULL);
+        rule->policy = policy_load(key_file, groups[i], defaults, error);
+        if (rule->policy == NULL) {
+            g_free(rule->name);
+            g_free(rule->model);
+            g_free(rule->manufacturer);
+            g_free(rule->serial);
+            g_free(rule);
+            g_strfreev(groups);
+            g_key_file_free(key_file);
+            policy_set_free(set);
+            return NULL;
+        }
+        g_ptr_array_add(set->rules, rule);
+    }
+
+    g_strfreev(groups);
+    g_key_file_free(key_file);
+    return set;
+}
+
+void
+policy_set_free(PolicySet* set)
+{
+    g_ptr_array_free(set->rules, TRUE);
+    policy_unref(set->defaults);
+    g_free(set);
+}
+
+Policy*
+policy_set_lookup(const PolicySet* set, const Battery* battery)
+{
+    guint i;
+    Rule* rule;
+
+    for (i = 0; i < set->rules->len; i++) {
+        rule = g_ptr_array_index(set->rules, i);
+        if (rule_match(rule, battery) == TRUE)
+            return rule->policy;
+    }
+    return set->defaults;
+}
@@ -0,0 +1,61 @@
+#ifndef POLICY_H
+#define POLICY_H
+
+#include <glib.h>
+
+#include "battery.h"
+
+#define POLICY_ERROR policy_error_quark()
+GQuark policy_error_quark(void);
+
+#define POLICY_INVALID_LEVEL 2000
+#define POLICY_INVALID_RULE 2001
+
+#define POLICY_DEFAULT_GROUP "default"
+
+#define POLICY_NAME_KEY "name"
+#define POLICY_MODEL_KEY "model"
+#define POLICY_MANUFACTURER_KEY "manufacturer"
+#define POLICY_SERIAL_KEY "serial"
+
+#define POLICY_LOW_LEVEL_KEY "low-level"
+#define POLICY_CRITICAL_LEVEL_KEY "critical-level"
+#define POLICY_FULL_CAPACITY_KEY "full-capacity"
+#define POLICY_TIMEOUT_KEY "timeout"
+
+/*
+ * Thresholds applied to one battery. A Policy is immutable once built and
+ * reference counted, so a Context may keep using it after the set it came
+ * from has been replaced by a reload.
+ */
+typedef struct _Policy
+{
+    volatile gint ref_count;
+    gchar* name;
+    gint low_level;
+    gint critical_level;
+    gint full_capacity;
+    gint timeout;
+} Policy;
+
+typedef struct _PolicySet PolicySet;
+
+Policy*
+policy_new(const gchar* name, gint low_level, gint critical_level, gint full_capacity, gint timeout);
+Policy*
+policy_ref(Policy* policy);
+void
+policy_unref(Policy* policy);
+gboolean
+policy_validate(const Policy* policy, GError** error);
+
+PolicySet*
+policy_set_new(Policy* defaults);
+PolicySet*
+policy_set_load(const gchar* path, const Policy* base, GError** error);
+void
+policy_set_free(PolicySet* set);
+Policy*
+policy_set_lookup(const PolicySet* set, const Battery* battery);
+
+#endif // POLICY_H
@@ -0,0 +1,84 @@
+#include <glib.h>
+#include <string.h>
+
+#include "pool.h"
+#include "stats.h"
+
+typedef struct _FreeObject
+{
+    struct _FreeObject* next;
+} FreeObject;
+
+struct _Pool
+{
+    GMutex mutex;
+    gsize object_size;
+    guint chunk_length;
+    GSList* chunks;
+    FreeObject* free_list;
+};
+
+static void
+pool_grow(Pool* pool)
+{
+    guint i;
+    FreeObject* object;
+    gchar* chunk = g_malloc_n(pool->chunk_length, pool->object_size);
+
+    pool->chunks = g_slist_prepend(pool->chunks, chunk);
+    for (i = 0; i < pool->chunk_length; i++) {
+        object = (FreeObject*)(chunk + i * pool->object_size);
+        object->next = pool->free_list;
+        pool->free_list = object;
+    }
+}
+
+Pool*
+pool_new(gsize object_size, guint chunk_length)
+{
+    Pool* pool = g_new0(Pool, 1);
+
+    g_mutex_init(&pool->mutex);
+    /* Keep every object pointer aligned and large enough for the free list link */
+    pool->object_size = MAX(object_size, sizeof(FreeObject));
+    pool->object_size = (pool->object_size + sizeof(gpointer) - 1) & ~(sizeof(gpointer) - 1);
+    pool->chunk_length = MAX(chunk_length, 1);
+    return pool;
+}
+
+void
+pool_free(Pool* pool)
+{
+    g_slist_free_full(pool->chunks, g_free);
+    g_mutex_clear(&pool->mutex);
+    g_free(pool);
+}
+
+gpointer
+pool_alloc0(Pool* pool)
+{
+    FreeObject* object;
+
+    g_mutex_lock(&pool->mutex);
+    if (pool->free_list == NULL)
+        pool_grow(pool);
+    object = pool->free_list;
+    pool->free_list = object->next;
+    g_mutex_unlock(&pool->mutex);
+
+    stats_counter_inc(STAT_ALLOCATIONS);
+    memset(object, 0, pool->object_size);
+    return object;
+}
+
+void
+pool_release(Pool* pool, gpointer object)
+{
+    FreeObject* free_object = object;
+
+    stats_counter_inc(STAT_FREES);
+    g_mutex_lock(&pool->mutex);
+    free_object->next = pool->free_list;
+    pool->free_list = free_object;
+    g_mutex_unlock(&pool->mutex);
+}
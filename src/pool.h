@@ -0,0 +1,24 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <glib.h>
+
+/*
+ * Fixed-size object pool. Objects are carved out of chunks and recycled
+ * through a free list, so long-lived daemons do not fragment the heap with
+ * small per-battery allocations. Safe to use from any thread.
+ */
+
+typedef struct _Pool Pool;
+
+Pool*
+pool_new(gsize object_size, guint chunk_length);
+void
+pool_free(Pool* pool);
+
+gpointer
+pool_alloc0(Pool* pool);
+void
+pool_release(Pool* pool, gpointer object);
+
+#endif // POOL_H
@@ -0,0 +1,84 @@
+#define _GNU_SOURCE
+
+#include <glib.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "priority.h"
+
+G_DEFINE_QUARK(priority-error-quark, priority_error)
+
+/* From linux/ioprio.h, which is not installed everywhere */
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+
+static struct priority
+{
+    gboolean pinned;
+    cpu_set_t cpus;
+} priority;
+
+/* A comma separated list of CPUs and ranges, like 0,2-3 */
+gboolean
+priority_set_cpus(const gchar* list, GError** error)
+{
+    guint i;
+    gchar* end;
+    gchar** ranges = g_strsplit(list, ",", 0);
+    guint64 first, last, cpu;
+
+    CPU_ZERO(&priority.cpus);
+    for (i = 0; ranges[i] != NULL; i++) {
+        first = g_ascii_strtoull(ranges[i], &end, 10);
+        last = first;
+        if (end != ranges[i] && *end == '-')
+            last = g_ascii_strtoull(end + 1, &end, 10);
+        if (end == ranges[i] || *end != '\0' || last < first || last >= CPU_SETSIZE) {
+            g_set_error(error,
+                        PRIORITY_ERROR,
+                        PRIORITY_INVALID_CPUS,
+                        "Invalid CPU list \"%s\"! Use CPUs and ranges like 0,2-3",
+                        list);
+            g_strfreev(ranges);
+            return FALSE;
+        }
+        for (cpu = first; cpu <= last; cpu++)
+            CPU_SET(cpu, &priority.cpus);
+    }
+    g_strfreev(ranges);
+
+    priority.pinned = CPU_COUNT(&priority.cpus) > 0;
+    return TRUE;
+}
+
+/* Linux takes 0 as the calling thread for all of these, not the process */
+gboolean
+priority_lower(GError** error)
+{
+    const gchar* what = NULL;
+    struct sched_param param = { 0 };
+
+    if (sched_setscheduler(0, SCHED_IDLE, &param) != 0)
+        what = "SCHED_IDLE";
+    else if (syscall(SYS_ioprio_set,
+                     IOPRIO_WHO_PROCESS,
+                     0,
+                     IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) != 0)
+        what = "the idle I/O class";
+    else if (prctl(PR_SET_TIMERSLACK, (unsigned long)PRIORITY_TIMER_SLACK, 0, 0, 0) != 0)
+        what = "the timer slack";
+    else if (priority.pinned == TRUE &&
+             sched_setaffinity(0, sizeof(priority.cpus), &priority.cpus) != 0)
+        what = "the housekeeping CPUs";
+
+    if (what != NULL) {
+        g_set_error(
+          error, PRIORITY_ERROR, PRIORITY_FAILED, "Cannot set %s: %s", what, g_strerror(errno));
+        return FALSE;
+    }
+    return TRUE;
+}
@@ -0,0 +1,29 @@
+#ifndef PRIORITY_H
+#define PRIORITY_H
+
+#include <glib.h>
+
+/*
+ * Low interference mode for the thread that samples the batteries: the
+ * SCHED_IDLE policy, the idle I/O class and a large timer slack, so it
+ * only runs on CPU time and disk bandwidth nobody else wants and its
+ * timers are merged with other wakeups. Optionally the thread is pinned to
+ * housekeeping CPUs. Every setting applies to the calling thread only.
+ */
+
+#define PRIORITY_ERROR priority_error_quark()
+GQuark
+priority_error_quark(void);
+
+#define PRIORITY_INVALID_CPUS 8000
+#define PRIORITY_FAILED 8001
+
+/* A tenth of the default sampling interval, in nanoseconds */
+#define PRIORITY_TIMER_SLACK (500 * 1000 * 1000)
+
+gboolean
+priority_set_cpus(const gchar* list, GError** error);
+gboolean
+priority_lower(GError** error);
+
+#endif // PRIORITY_H
@@ -0,0 +1,32 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+/*
+ * USDT probes for the sampling and decision paths. With <sys/sdt.h> every
+ * probe compiles to a single nop plus an ELF note, so a disabled probe costs
+ * nothing; attach with e.g. `bpftrace -e 'usdt:./batify:batify:threshold { ... }'`.
+ * Without <sys/sdt.h> the probes compile away entirely.
+ *
+ *   attr_read(name, attr, latency_us, ok)      every sysfs attribute read
+ *   sample(name, status, capacity, seconds)    acquisition pushed a sample
+ *   transition(name, prev_status, status)      policy saw a status change
+ *   threshold(name, level, capacity)           policy crossed a level
+ *   notify(name, kind, value, latency_us)      delivery showed a notification
+ *   rescan(batteries, added, removed)          power supplies were rescanned
+ */
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define BATIFY_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(batify, name, a1, a2, a3)
+#define BATIFY_PROBE4(name, a1, a2, a3, a4) DTRACE_PROBE4(batify, name, a1, a2, a3, a4)
+#else
+#define BATIFY_PROBE3(name, a1, a2, a3)                                                            \
+    do {                                                                                           \
+    } while (0)
+#define BATIFY_PROBE4(name, a1, a2, a3, a4)                                                        \
+    do {                                                                                           \
+    } while (0)
+#endif
+
+#endif // PROBES_H
@@ -0,0 +1,246 @@
+#include <glib.h>
+#include <string.h>
+
+#include "profile.h"
+
+G_DEFINE_QUARK(profile-error-quark, profile_error)
+
+#define PROFILE_HEADER_SIZE (sizeof(PROFILE_MAGIC) - 1 + 1)
+#define PROFILE_RECORD_SIZE(length) (1 + (length) + PROFILE_BINS * 2)
+
+/* seconds[p] is how long the drop from p + 1 to p percent lasted */
+struct _Profile
+{
+    ProfileStore* store;
+    gchar* key;
+    guint16 seconds[PROFILE_BINS];
+    gint64 timestamp;
+    gint64 capacity;
+};
+
+struct _ProfileStore
+{
+    gchar* path;
+    GHashTable* profiles;
+    gboolean dirty;
+};
+
+static Profile*
+profile_new(ProfileStore* store, const gchar* key)
+{
+    Profile* profile = g_new0(Profile, 1);
+
+    profile->store = store;
+    profile->key = g_strdup(key);
+    profile->capacity = -1;
+    /* A later record of the same key wins, the earlier profile goes with its key */
+    g_hash_table_replace(store->profiles, profile->key, profile);
+    return profile;
+}
+
+static void
+profile_free(Profile* profile)
+{
+    g_free(profile->key);
+    g_free(profile);
+}
+
+static gboolean
+profile_store_parse(ProfileStore* store, const guchar* data, gsize length, GError** error)
+{
+    guint i;
+    gsize key_length;
+    gchar* key;
+    Profile* profile;
+    const guchar* end = data + length;
+
+    if (length < PROFILE_HEADER_SIZE ||
+        memcmp(data, PROFILE_MAGIC, sizeof(PROFILE_MAGIC) - 1) != 0 ||
+        data[PROFILE_HEADER_SIZE - 1] != PROFILE_VERSION) {
+        g_set_error(error, PROFILE_ERROR, PROFILE_INVALID_FORMAT, "Not a profile file");
+        return FALSE;
+    }
+
+    for (data += PROFILE_HEADER_SIZE; data < end; data += PROFILE_RECORD_SIZE(key_length)) {
+        key_length = data[0];
+        if ((gsize)(end - data) < PROFILE_RECORD_SIZE(key_length)) {
+            g_set_error(error, PROFILE_ERROR, PROFILE_INVALID_FORMAT, "Truncated profile record");
+            return FALSE;
+        }
+
+        key = g_strndup((const gchar*)data + 1, key_length);
+        profile = profile_new(store, key);
+        for (i = 0; i < PROFILE_BINS; i++)
+            profile->seconds[i] =
+              data[1 + key_length + i * 2] | data[1 + key_length + i * 2 + 1] << 8;
+        g_free(key);
+    }
+    return TRUE;
+}
+
+/* A missing file is an empty store, it is created on the first save */
+ProfileStore*
+profile_store_load(const gchar* path, GError** error)
+{
+    gchar* data;
+    gsize length;
+    GError* _error = NULL;
+    ProfileStore* store = g_new0(ProfileStore, 1);
+
+    store->path = g_strdup(path);
+    store->profiles =
+      g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)profile_free);
+
+    if (g_file_get_contents(path, &data, &length, &_error) == FALSE) {
+        if (g_error_matches(_error, G_FILE_ERROR, G_FILE_ERROR_NOENT) == TRUE) {
+            g_error_free(_error);
+            return store;
+        }
+        g_propagate_error(error, _error);
+        profile_store_free(store);
+        return NULL;
+    }
+
+    if (profile_store_parse(store, (const guchar*)data, length, error) == FALSE) {
+        g_prefix_error(error, "%s: ", path);
+        g_free(data);
+        profile_store_free(store);
+        return NULL;
+    }
+    g_free(data);
+    return store;
+}
+
+/* Rewritten as a whole and renamed over, a few hundred bytes per pack */
+gboolean
+profile_store_save(ProfileStore* store, GError** error)
+{
+    guint i;
+    gsize key_length;
+    GHashTableIter iter;
+    Profile* profile;
+    GString* buffer;
+    gboolean result;
+
+    if (store->dirty == FALSE)
+        return TRUE;
+
+    buffer = g_string_new(PROFILE_MAGIC);
+    g_string_append_c(buffer, PROFILE_VERSION);
+
+    g_hash_table_iter_init(&iter, store->profiles);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer*)&profile)) {
+        key_length = MIN(strlen(profile->key), G_MAXUINT8);
+        g_string_append_c(buffer, (gchar)key_length);
+        g_string_append_len(buffer, profile->key, key_length);
+        for (i = 0; i < PROFILE_BINS; i++) {
+            g_string_append_c(buffer, (gchar)(profile->seconds[i] & 0xff));
+            g_string_append_c(buffer, (gchar)(profile->seconds[i] >> 8));
+        }
+    }
+
+    result = g_file_set_contents(store->path, buffer->str, buffer->len, error);
+    g_string_free(buffer, TRUE);
+    if (result == TRUE)
+        store->dirty = FALSE;
+    return result;
+}
+
+void
+profile_store_free(ProfileStore* store)
+{
+    g_hash_table_destroy(store->profiles);
+    g_free(store->path);
+    g_free(store);
+}
+
+/*
+ * Packs without a serial cannot be told apart and get no profile. Keys are
+ * cut to what a record holds, so a saved profile is found again.
+ */
+Profile*
+profile_store_lookup(ProfileStore* store, const Battery* battery)
+{
+    gchar* key;
+    Profile* profile;
+
+    if (battery->serial_number[0] == '\0')
+        return NULL;
+
+    key = g_strjoin("|", battery->model_name, battery->serial_number, NULL);
+    if (strlen(key) > G_MAXUINT8)
+        key[G_MAXUINT8] = '\0';
+    profile = g_hash_table_lookup(store->profiles, key);
+    if (profile == NULL)
+        profile = profile_new(store, key);
+    g_free(key);
+    return profile;
+}
+
+/*
+ * Each drop of the capacity updates the bins it crossed, so a sample
+ * costs O(1). Charging or a jump up starts over, and the percent the
+ * battery was first seen in is only partly observed, so it is skipped.
+ */
+void
+profile_update(Profile* profile, gint64 timestamp, gboolean discharging, guint64 capacity)
+{
+    guint64 i, drop, seconds;
+
+    if (discharging == FALSE || capacity > PROFILE_BINS) {
+        profile->capacity = -1;
+        return;
+    }
+    if (profile->capacity < 0 || (gint64)capacity > profile->capacity) {
+        profile->capacity = capacity;
+        profile->timestamp = 0;
+        return;
+    }
+    if ((gint64)capacity == profile->capacity)
+        return;
+    if (profile->timestamp == 0) {
+        profile->capacity = capacity;
+        profile->timestamp = timestamp;
+        return;
+    }
+
+    drop = profile->capacity - capacity;
+    seconds = MIN((timestamp - profile->timestamp) / G_USEC_PER_SEC / drop, G_MAXUINT16);
+    for (i = capacity; i < (guint64)profile->capacity; i++) {
+        if (profile->seconds[i] == 0)
+            profile->seconds[i] = seconds;
+        else
+            profile->seconds[i] += ((gint64)seconds - profile->seconds[i]) / PROFILE_WEIGHT;
+    }
+
+    profile->capacity = capacity;
+    profile->timestamp = timestamp;
+    profile->store->dirty = TRUE;
+}
+
+/*
+ * Only a profile that covers every percent down to the threshold predicts.
+ * The time is down to empty: below the threshold a percent not learned yet
+ * lasts fallback seconds.
+ */
+gboolean
+profile_predict(const Profile* profile,
+                guint64 capacity,
+                guint64 threshold,
+                guint64 fallback,
+                guint64* seconds)
+{
+    guint64 i, total = 0;
+
+    capacity = MIN(capacity, PROFILE_BINS);
+    for (i = 0; i < capacity; i++) {
+        if (profile->seconds[i] != 0)
+            total += profile->seconds[i];
+        else if (i < threshold)
+            total += fallback;
+        else
+            return FALSE;
+    }
+    *seconds = total;
+    return TRUE;
+}
@@ -0,0 +1,50 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <glib.h>
+
+#include "battery.h"
+
+/*
+ * Learned discharge profiles, one per battery pack by model and serial.
+ * A profile holds the smoothed number of seconds each percent of capacity
+ * lasted while discharging, so time to a threshold follows the shape of
+ * the discharge curve of that very pack instead of a straight line. The
+ * file starts with PROFILE_MAGIC and a version byte, then holds one record
+ * per pack: the key length, the key and PROFILE_BINS little endian 16 bit
+ * values, 0 where nothing has been seen yet.
+ */
+
+#define PROFILE_ERROR profile_error_quark()
+GQuark
+profile_error_quark(void);
+
+#define PROFILE_INVALID_FORMAT 6000
+
+#define PROFILE_MAGIC "BATIFYPR"
+#define PROFILE_VERSION 1
+#define PROFILE_BINS 100
+#define PROFILE_WEIGHT 4
+
+typedef struct _Profile Profile;
+typedef struct _ProfileStore ProfileStore;
+
+ProfileStore*
+profile_store_load(const gchar* path, GError** error);
+gboolean
+profile_store_save(ProfileStore* store, GError** error);
+void
+profile_store_free(ProfileStore* store);
+Profile*
+profile_store_lookup(ProfileStore* store, const Battery* battery);
+
+void
+profile_update(Profile* profile, gint64 timestamp, gboolean discharging, guint64 capacity);
+gboolean
+profile_predict(const Profile* profile,
+                guint64 capacity,
+                guint64 threshold,
+                guint64 fallback,
+                guint64* seconds);
+
+#endif // PROFILE_H
@@ -0,0 +1,138 @@
+#define _DEFAULT_SOURCE
+
+#include <glib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "reserve.h"
+
+G_DEFINE_QUARK(reserve-error-quark, reserve_error)
+
+#define RESERVE_OOM_SCORE_ADJ_PATH "/proc/self/oom_score_adj"
+#define RESERVE_MAPS_PATH "/proc/self/maps"
+
+G_GNUC_NO_INLINE static void
+prefault_stack(void)
+{
+    gsize i;
+    volatile guchar stack[RESERVE_STACK_SIZE];
+
+    for (i = 0; i < sizeof(stack); i += 256)
+        stack[i] = 0;
+}
+
+/*
+ * The code of the binary and its libraries is faulted in and locked at
+ * once, so the first alert does not page it in. Data, heap and stacks are
+ * left to MCL_ONFAULT, which locks their pages as they are touched.
+ */
+static gboolean
+lock_code(GError** error)
+{
+    gchar* maps;
+    gchar perms[5];
+    gchar** lines;
+    gchar** line;
+    guint64 start, end;
+    gboolean result = TRUE;
+
+    if (g_file_get_contents(RESERVE_MAPS_PATH, &maps, NULL, error) == FALSE)
+        return FALSE;
+
+    lines = g_strsplit(maps, "\n", -1);
+    for (line = lines; *line != NULL && result == TRUE; line++) {
+        /* File backed and executable, [vdso] and anonymous mappings have no path */
+        if (sscanf(*line,
+                   "%" G_GINT64_MODIFIER "x-%" G_GINT64_MODIFIER "x %4s",
+                   &start,
+                   &end,
+                   perms) != 3 ||
+            perms[2] != 'x' || strchr(*line, '/') == NULL)
+            continue;
+
+        if (mlock((gconstpointer)(guintptr)start, end - start) != 0) {
+            g_set_error(
+              error, RESERVE_ERROR, RESERVE_FAILED, "Cannot lock code: %s", g_strerror(errno));
+            result = FALSE;
+        }
+    }
+    g_strfreev(lines);
+    g_free(maps);
+    return result;
+}
+
+/*
+ * Called before any thread is started. mlockall() checks the memlock limit
+ * against the whole address space, where every thread stack counts with
+ * its full size, and MCL_CURRENT without MCL_ONFAULT would fault all of it
+ * in. Without MCL_ONFAULT only the current mappings are locked, as later
+ * ones would be faulted in whole.
+ */
+gboolean
+reserve_lock(GError** error)
+{
+    gint flags = MCL_CURRENT;
+
+#if defined(__GLIBC__)
+    mallopt(M_TRIM_THRESHOLD, G_MAXINT);
+    mallopt(M_MMAP_THRESHOLD, RESERVE_MMAP_THRESHOLD);
+#endif
+
+#ifdef MCL_ONFAULT
+    flags |= MCL_FUTURE | MCL_ONFAULT;
+#endif
+    if (mlockall(flags) != 0) {
+        g_set_error(
+          error, RESERVE_ERROR, RESERVE_FAILED, "Cannot lock memory: %s", g_strerror(errno));
+        return FALSE;
+    }
+#ifdef MCL_ONFAULT
+    return lock_code(error);
+#else
+    return TRUE;
+#endif
+}
+
+/* Grows the stack and the malloc arena of the calling thread ahead of need */
+void
+reserve_prefault(void)
+{
+    gsize i;
+    guchar* heap = g_malloc(RESERVE_HEAP_SIZE);
+
+    for (i = 0; i < RESERVE_HEAP_SIZE; i += 256)
+        heap[i] = 0;
+    g_free(heap);
+    prefault_stack();
+}
+
+/* procfs files are written in place, g_file_set_contents() would rename over them */
+gboolean
+reserve_set_oom_score_adj(gint value, GError** error)
+{
+    gint fd;
+    gint length;
+    gchar text[16];
+
+    length = g_snprintf(text, sizeof(text), "%d\n", value);
+    fd = open(RESERVE_OOM_SCORE_ADJ_PATH, O_WRONLY | O_CLOEXEC);
+    if (fd < 0 || write(fd, text, length) != length) {
+        g_set_error(error,
+                    RESERVE_ERROR,
+                    RESERVE_FAILED,
+                    "Cannot set %s to %d: %s",
+                    RESERVE_OOM_SCORE_ADJ_PATH,
+                    value,
+                    g_strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return FALSE;
+    }
+    close(fd);
+    return TRUE;
+}
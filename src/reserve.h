@@ -0,0 +1,34 @@
+#ifndef RESERVE_H
+#define RESERVE_H
+
+#include <glib.h>
+
+/*
+ * Keeps the alert path out of page faults when memory runs short. Before
+ * the threads start, the code of the binary and its libraries is faulted
+ * in and locked, every other page is locked the first time it is touched,
+ * and malloc keeps freed memory instead of handing it back to the kernel.
+ * Each stage thread then prefaults a stack and heap reserve, which its
+ * later allocations reuse.
+ */
+
+#define RESERVE_ERROR reserve_error_quark()
+GQuark
+reserve_error_quark(void);
+
+#define RESERVE_FAILED 9000
+
+#define RESERVE_HEAP_SIZE (1024 * 1024)
+#define RESERVE_STACK_SIZE (64 * 1024)
+#define RESERVE_MMAP_THRESHOLD (4 * 1024 * 1024)
+/* Far below ordinary processes, yet not exempt like -1000 */
+#define RESERVE_OOM_SCORE_ADJ -900
+
+gboolean
+reserve_lock(GError** error);
+void
+reserve_prefault(void);
+gboolean
+reserve_set_oom_score_adj(gint value, GError** error);
+
+#endif // RESERVE_H
@@ -0,0 +1,108 @@
+#include <glib.h>
+#include <string.h>
+
+#include "ring.h"
+
+struct _Ring
+{
+    /* Written by the consumer only */
+    volatile gint head;
+    gchar head_pad[RING_CACHE_LINE - sizeof(gint)];
+
+    /* Written by the producer only */
+    volatile gint tail;
+    volatile gint pushed;
+    volatile gint dropped;
+    volatile gint high_water;
+    gchar tail_pad[RING_CACHE_LINE - 4 * sizeof(gint)];
+
+    guint mask;
+    gsize record_size;
+    gchar* records;
+};
+
+static guint
+round_up_pow2(guint value)
+{
+    guint result = 1;
+    while (result < value)
+        result <<= 1;
+    return result;
+}
+
+Ring*
+ring_new(gsize record_size, guint capacity)
+{
+    Ring* ring;
+
+    g_return_val_if_fail(record_size > 0, NULL);
+    g_return_val_if_fail(capacity > 0, NULL);
+
+    capacity = round_up_pow2(capacity);
+
+    ring = g_new0(Ring, 1);
+    ring->mask = capacity - 1;
+    ring->record_size = record_size;
+    ring->records = g_malloc0_n(capacity, record_size);
+    return ring;
+}
+
+void
+ring_free(Ring* ring)
+{
+    g_free(ring->records);
+    g_free(ring);
+}
+
+gboolean
+ring_push(Ring* ring, gconstpointer record)
+{
+    guint head = (guint)g_atomic_int_get(&ring->head);
+    guint tail = (guint)ring->tail;
+    guint depth = tail - head;
+
+    if (depth > ring->mask) {
+        g_atomic_int_inc(&ring->dropped);
+        return FALSE;
+    }
+
+    memcpy(ring->records + (tail & ring->mask) * ring->record_size, record, ring->record_size);
+    /* Publishes the record: the atomic store orders the copy above before it */
+    g_atomic_int_set(&ring->tail, (gint)(tail + 1));
+    g_atomic_int_inc(&ring->pushed);
+
+    if (depth + 1 > (guint)ring->high_water)
+        g_atomic_int_set(&ring->high_water, (gint)(depth + 1));
+    return TRUE;
+}
+
+gboolean
+ring_pop(Ring* ring, gpointer record)
+{
+    guint head = (guint)ring->head;
+    guint tail = (guint)g_atomic_int_get(&ring->tail);
+
+    if (head == tail)
+        return FALSE;
+
+    memcpy(record, ring->records + (head & ring->mask) * ring->record_size, ring->record_size);
+    /* Releases the slot back to the producer */
+    g_atomic_int_set(&ring->head, (gint)(head + 1));
+    return TRUE;
+}
+
+gboolean
+ring_is_empty(const Ring* ring)
+{
+    return g_atomic_int_get(&ring->head) == g_atomic_int_get(&ring->tail);
+}
+
+void
+ring_get_stats(const Ring* ring, RingStats* stats)
+{
+    stats->capacity = ring->mask + 1;
+    stats->depth = (guint)g_atomic_int_get(&ring->tail) - (guint)g_atomic_int_get(&ring->head);
+    stats->high_water = (guint)g_atomic_int_get(&ring->high_water);
+    stats->pushed = (guint)g_atomic_int_get(&ring->pushed);
+    stats->dropped = (guint)g_atomic_int_get(&ring->dropped);
+}
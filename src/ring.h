@@ -0,0 +1,42 @@
+#ifndef RING_H
+#define RING_H
+
+#include <glib.h>
+
+/*
+ * Bounded single-producer/single-consumer ring of fixed-size records.
+ *
+ * Exactly one thread may call ring_push() and exactly one thread may call
+ * ring_pop(); neither side ever blocks or takes a lock. A push into a full
+ * ring fails and is counted as a drop.
+ */
+
+#define RING_CACHE_LINE 64
+
+typedef struct _RingStats
+{
+    guint capacity;
+    guint depth;
+    guint high_water;
+    guint pushed;
+    guint dropped;
+} RingStats;
+
+typedef struct _Ring Ring;
+
+Ring*
+ring_new(gsize record_size, guint capacity);
+void
+ring_free(Ring* ring);
+
+gboolean
+ring_push(Ring* ring, gconstpointer record);
+gboolean
+ring_pop(Ring* ring, gpointer record);
+
+gboolean
+ring_is_empty(const Ring* ring);
+void
+ring_get_stats(const Ring* ring, RingStats* stats);
+
+#endif // RING_H
@@ -0,0 +1,214 @@
+#include <glib.h>
+
+#include "scheduler.h"
+
+typedef struct _Entry
+{
+    guint tag;
+    guint index;
+    gint64 due_time;
+    gint64 interval;
+    GSourceFunc func;
+    gpointer data;
+    GDestroyNotify notify;
+} Entry;
+
+typedef struct _SchedulerSource
+{
+    GSource source;
+    Scheduler* scheduler;
+} SchedulerSource;
+
+struct _Scheduler
+{
+    GPtrArray* heap;
+    GHashTable* entries;
+    GSource* source;
+    guint next_tag;
+};
+
+static void
+entry_free(Entry* entry)
+{
+    if (entry->notify != NULL)
+        entry->notify(entry->data);
+    g_free(entry);
+}
+
+static void
+heap_swap(GPtrArray* heap, guint a, guint b)
+{
+    Entry* entry_a = g_ptr_array_index(heap, a);
+    Entry* entry_b = g_ptr_array_index(heap, b);
+
+    g_ptr_array_index(heap, a) = entry_b;
+    g_ptr_array_index(heap, b) = entry_a;
+    entry_a->index = b;
+    entry_b->index = a;
+}
+
+static gboolean
+heap_less(GPtrArray* heap, guint a, guint b)
+{
+    return ((Entry*)g_ptr_array_index(heap, a))->due_time <
+           ((Entry*)g_ptr_array_index(heap, b))->due_time;
+}
+
+static void
+heap_sift_up(GPtrArray* heap, guint index)
+{
+    while (index > 0 && heap_less(heap, index, (index - 1) / 2)) {
+        heap_swap(heap, index, (index - 1) / 2);
+        index = (index - 1) / 2;
+    }
+}
+
+static void
+heap_sift_down(GPtrArray* heap, guint index)
+{
+    guint child;
+
+    for (;;) {
+        child = 2 * index + 1;
+        if (child >= heap->len)
+            break;
+        if (child + 1 < heap->len && heap_less(heap, child + 1, child))
+            child++;
+        if (heap_less(heap, child, index) == FALSE)
+            break;
+        heap_swap(heap, index, child);
+        index = child;
+    }
+}
+
+static void
+heap_remove(GPtrArray* heap, guint index)
+{
+    Entry* moved;
+    guint last = heap->len - 1;
+
+    if (index != last)
+        heap_swap(heap, index, last);
+    g_ptr_array_remove_index_fast(heap, last);
+    if (index < heap->len) {
+        moved = g_ptr_array_index(heap, index);
+        heap_sift_up(heap, index);
+        heap_sift_down(heap, moved->index);
+    }
+}
+
+static void
+scheduler_update_ready_time(Scheduler* scheduler)
+{
+    if (scheduler->heap->len == 0)
+        g_source_set_ready_time(scheduler->source, -1);
+    else
+        g_source_set_ready_time(scheduler->source,
+                                ((Entry*)g_ptr_array_index(scheduler->heap, 0))->due_time);
+}
+
+static gboolean
+scheduler_source_dispatch(GSource* source, GSourceFunc callback, gpointer user_data)
+{
+    Entry* entry;
+    Scheduler* scheduler = ((SchedulerSource*)source)->scheduler;
+    gint64 now = g_source_get_time(source);
+
+    while (scheduler->heap->len > 0) {
+        entry = g_ptr_array_index(scheduler->heap, 0);
+        if (entry->due_time > now)
+            break;
+
+        if (entry->func(entry->data) == G_SOURCE_REMOVE) {
+            scheduler_remove(scheduler, entry->tag);
+            continue;
+        }
+
+        /* Skip missed periods instead of firing a burst to catch up */
+        entry->due_time += entry->interval;
+        if (entry->due_time <= now)
+            entry->due_time = now + entry->interval;
+        heap_sift_down(scheduler->heap, 0);
+    }
+
+    scheduler_update_ready_time(scheduler);
+    return G_SOURCE_CONTINUE;
+}
+
+static GSourceFuncs scheduler_source_funcs = {
+    NULL,
+    NULL,
+    scheduler_source_dispatch,
+    NULL,
+};
+
+Scheduler*
+scheduler_new(GMainContext* context)
+{
+    Scheduler* scheduler = g_new0(Scheduler, 1);
+    scheduler->heap = g_ptr_array_new();
+    scheduler->entries =
+      g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)entry_free);
+    scheduler->next_tag = 1;
+
+    scheduler->source = g_source_new(&scheduler_source_funcs, sizeof(SchedulerSource));
+    ((SchedulerSource*)scheduler->source)->scheduler = scheduler;
+    g_source_set_name(scheduler->source, "scheduler");
+    g_source_set_ready_time(scheduler->source, -1);
+    g_source_attach(scheduler->source, context);
+    return scheduler;
+}
+
+void
+scheduler_free(Scheduler* scheduler)
+{
+    g_source_destroy(scheduler->source);
+    g_source_unref(scheduler->source);
+    g_ptr_array_free(scheduler->heap, TRUE);
+    g_hash_table_destroy(scheduler->entries);
+    g_free(scheduler);
+}
+
+guint
+scheduler_add(Scheduler* scheduler,
+              guint interval,
+              GSourceFunc func,
+              gpointer data,
+              GDestroyNotify notify)
+{
+    Entry* entry = g_new(Entry, 1);
+    entry->tag = scheduler->next_tag++;
+    entry->interval = (gint64)interval * G_USEC_PER_SEC;
+    entry->due_time = g_get_monotonic_time() + entry->interval;
+    entry->func = func;
+    entry->data = data;
+    entry->notify = notify;
+
+    entry->index = scheduler->heap->len;
+    g_ptr_array_add(scheduler->heap, entry);
+    heap_sift_up(scheduler->heap, entry->index);
+    g_hash_table_insert(scheduler->entries, GUINT_TO_POINTER(entry->tag), entry);
+
+    scheduler_update_ready_time(scheduler);
+    return entry->tag;
+}
+
+gboolean
+scheduler_remove(Scheduler* scheduler, guint tag)
+{
+    Entry* entry = g_hash_table_lookup(scheduler->entries, GUINT_TO_POINTER(tag));
+
+    if (entry == NULL)
+        return FALSE;
+
+    heap_remove(scheduler->heap, entry->index);
+    g_hash_table_remove(scheduler->entries, GUINT_TO_POINTER(tag));
+    scheduler_update_ready_time(scheduler);
+    return TRUE;
+}
+
+guint
+scheduler_size(const Scheduler* scheduler)
+{
+    return scheduler->heap->len;
+}
@@ -0,0 +1,31 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <glib.h>
+
+/*
+ * Runs many periodic callbacks from a single GSource. Entries live in a
+ * binary min-heap ordered by due time and the source sleeps until the
+ * earliest one, so a wakeup costs O(k log n) for the k entries that are due
+ * instead of touching all n of them.
+ */
+
+typedef struct _Scheduler Scheduler;
+
+Scheduler*
+scheduler_new(GMainContext* context);
+void
+scheduler_free(Scheduler* scheduler);
+
+guint
+scheduler_add(Scheduler* scheduler,
+              guint interval,
+              GSourceFunc func,
+              gpointer data,
+              GDestroyNotify notify);
+gboolean
+scheduler_remove(Scheduler* scheduler, guint tag);
+guint
+scheduler_size(const Scheduler* scheduler);
+
+#endif // SCHEDULER_H
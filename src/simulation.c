@@ -0,0 +1,392 @@
+#include <glib.h>
+#include <string.h>
+
+#include "battery.h"
+#include "simulation.h"
+
+/*
+ * Virtual batteries that live in memory only. Each one discharges and
+ * charges along its own curve on a simulated clock that runs speed times
+ * faster than the monotonic clock. The state is advanced lazily when the
+ * battery is read, so an idle battery costs nothing. Flaps toggle between
+ * charging and discharging at random, hotplug takes batteries away and
+ * brings them back under a new serial, which is a new identity.
+ */
+
+#define SIMULATION_SECONDS_PER_HOUR 3600.0
+#define SIMULATION_TAPER_LEVEL 0.8
+#define SIMULATION_MIN_TAPER 0.05
+#define SIMULATION_MAX_PLUG_LEVEL 0.15
+#define SIMULATION_UNPLUG_RATE 2.0
+#define SIMULATION_JITTER 0.2
+
+typedef struct _SimBattery
+{
+    Battery* battery;
+    guint serial;
+    gboolean present;
+    BATTERY_STATUS status;
+    gdouble level;
+    gdouble energy_full;
+    gdouble discharge;
+    gdouble charge;
+    gdouble plug_level;
+    gint64 updated;
+} SimBattery;
+
+static struct params
+{
+    guint count;
+    gdouble discharge;
+    gdouble charge;
+    gdouble noise;
+    gdouble flap;
+    gdouble hotplug;
+    gdouble speed;
+    guint32 seed;
+} params = { 1, 10.0, 40.0, 0.0, 0.0, 0.0, 1.0, 0 };
+
+static struct simulation
+{
+    SimBattery* batteries;
+    GRand* rand;
+    gint64 start;
+    gint64 scanned;
+} simulation = { NULL, NULL, 0, 0 };
+
+static gboolean _parse_double(const gchar* key, const gchar* value, gdouble* result, GError** error)
+{
+    gchar* end;
+    gdouble parsed = g_ascii_strtod(value, &end);
+
+    if (*value == '\0' || *end != '\0' || parsed < 0)
+    {
+        g_set_error(error, BATTERY_ERROR, BATTERY_INVALID_SIMULATION, "Invalid simulation %s: \"%s\"", key, value);
+        return FALSE;
+    }
+    *result = parsed;
+    return TRUE;
+}
+
+static gboolean _set_param(const gchar* key, gdouble value, GError** error)
+{
+    if (g_strcmp0(key, SIMULATION_COUNT_KEY) == 0 && value >= 1 && value <= G_MAXUINT16)
+        params.count = (guint)value;
+    else if (g_strcmp0(key, SIMULATION_DISCHARGE_KEY) == 0)
+        params.discharge = value;
+    else if (g_strcmp0(key, SIMULATION_CHARGE_KEY) == 0)
+        params.charge = value;
+    else if (g_strcmp0(key, SIMULATION_NOISE_KEY) == 0)
+        params.noise = value;
+    else if (g_strcmp0(key, SIMULATION_FLAP_KEY) == 0)
+        params.flap = value;
+    else if (g_strcmp0(key, SIMULATION_HOTPLUG_KEY) == 0)
+        params.hotplug = value;
+    else if (g_strcmp0(key, SIMULATION_SPEED_KEY) == 0 && value > 0)
+        params.speed = value;
+    else if (g_strcmp0(key, SIMULATION_SEED_KEY) == 0)
+        params.seed = (guint32)value;
+    else
+    {
+        g_set_error(error, BATTERY_ERROR, BATTERY_INVALID_SIMULATION, "Invalid simulation %s: %g", key, value);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+ * The spec is a comma separated list of key=value: count batteries,
+ * discharge and charge in percent per hour, noise in percent, flap and
+ * hotplug in events per battery and hour, speed of the simulated clock and
+ * the random seed.
+ */
+gboolean simulation_configure(const gchar* spec, GError** error)
+{
+    guint i;
+    gdouble value;
+    gboolean result = TRUE;
+    gchar** pair;
+    gchar** items = g_strsplit(spec, ",", -1);
+
+    for (i = 0; result == TRUE && items[i] != NULL; i++)
+    {
+        if (*g_strstrip(items[i]) == '\0')
+            continue;
+
+        pair = g_strsplit(items[i], "=", 2);
+        if (pair[1] == NULL)
+        {
+            g_set_error(error, BATTERY_ERROR, BATTERY_INVALID_SIMULATION, "Simulation item \"%s\" is not key=value", items[i]);
+            result = FALSE;
+        }
+        else
+        {
+            result = _parse_double(pair[0], pair[1], &value, error) && _set_param(pair[0], value, error);
+        }
+        g_strfreev(pair);
+    }
+
+    g_strfreev(items);
+    return result;
+}
+
+static gint64 _get_time(void)
+{
+    return simulation.start + (gint64)((g_get_monotonic_time() - simulation.start) * params.speed);
+}
+
+static void _sim_battery_plug(SimBattery* sim, guint index)
+{
+    gchar *name, *sys_path, *serial_number;
+
+    sim->serial++;
+    name = g_strdup_printf(SIMULATION_BATTERY_PREFIX "%u", index);
+    sys_path = g_strdup_printf(SIMULATION_BACKEND_NAME ":%u", index);
+    serial_number = g_strdup_printf("%u", sim->serial);
+
+    sim->battery = battery_new_full(name, sys_path, "Simulated", "batify", "Li-ion", serial_number);
+    sim->present = TRUE;
+
+    g_free(name);
+    g_free(sys_path);
+    g_free(serial_number);
+}
+
+static void _sim_battery_unplug(SimBattery* sim)
+{
+    battery_unref(sim->battery);
+    sim->battery = NULL;
+    sim->present = FALSE;
+}
+
+static gdouble _jitter(gdouble value)
+{
+    return value * g_rand_double_range(simulation.rand, 1.0 - SIMULATION_JITTER, 1.0 + SIMULATION_JITTER);
+}
+
+static void _sim_battery_init(SimBattery* sim, guint index, gint64 now)
+{
+    sim->level = g_rand_double(simulation.rand);
+    sim->status = g_rand_boolean(simulation.rand) ? DISCHARGING_STATUS : CHARGING_STATUS;
+    sim->energy_full = g_rand_double_range(simulation.rand, 20.0, 90.0);
+    sim->discharge = _jitter(params.discharge / 100.0);
+    sim->charge = _jitter(params.charge / 100.0);
+    sim->plug_level = g_rand_double_range(simulation.rand, 0.0, SIMULATION_MAX_PLUG_LEVEL);
+    sim->updated = now;
+    _sim_battery_plug(sim, index);
+}
+
+/* Constant current up to the taper level, then the rate falls towards full */
+static gdouble _charge_rate(const SimBattery* sim)
+{
+    if (sim->level < SIMULATION_TAPER_LEVEL)
+        return sim->charge;
+    return sim->charge * MAX((1.0 - sim->level) / (1.0 - SIMULATION_TAPER_LEVEL), SIMULATION_MIN_TAPER);
+}
+
+static void _sim_battery_advance(SimBattery* sim, gint64 now)
+{
+    gdouble hours = (now - sim->updated) / (SIMULATION_SECONDS_PER_HOUR * G_USEC_PER_SEC);
+
+    if (hours <= 0)
+        return;
+    sim->updated = now;
+
+    if (params.flap > 0 && g_rand_double(simulation.rand) < params.flap * hours)
+        sim->status = sim->status == DISCHARGING_STATUS ? CHARGING_STATUS : DISCHARGING_STATUS;
+
+    switch (sim->status)
+    {
+        case DISCHARGING_STATUS:
+            sim->level = MAX(sim->level - sim->discharge * hours, 0.0);
+            if (sim->level <= sim->plug_level)
+                sim->status = CHARGING_STATUS;
+            break;
+        case CHARGING_STATUS:
+            sim->level = MIN(sim->level + _charge_rate(sim) * hours, 1.0);
+            if (sim->level >= 1.0)
+                sim->status = CHARGED_STATUS;
+            break;
+        case CHARGED_STATUS:
+            if (g_rand_double(simulation.rand) < SIMULATION_UNPLUG_RATE * hours)
+                sim->status = DISCHARGING_STATUS;
+            break;
+        default:
+            break;
+    }
+}
+
+/* Reads are answered only for the Battery of the current plug-in */
+static SimBattery* _get_sim_battery(const Battery* battery, GError** error)
+{
+    guint64 index = g_ascii_strtoull(battery->sys_path + strlen(SIMULATION_BACKEND_NAME ":"), NULL, 10);
+    SimBattery* sim;
+
+    if (index < params.count && simulation.batteries[index].battery == battery)
+    {
+        sim = &simulation.batteries[index];
+        _sim_battery_advance(sim, _get_time());
+        return sim;
+    }
+
+    g_set_error(error, BATTERY_ERROR, BATTERY_NO_DEVICE, "Simulated battery %s is unplugged", battery->name);
+    return NULL;
+}
+
+static gboolean _simulation_init(GError** error)
+{
+    guint i;
+    gint64 now;
+
+    simulation.rand = g_rand_new_with_seed(params.seed);
+    simulation.start = g_get_monotonic_time();
+    simulation.scanned = simulation.start;
+    simulation.batteries = g_new0(SimBattery, params.count);
+
+    now = _get_time();
+    for (i = 0; i < params.count; i++)
+        _sim_battery_init(&simulation.batteries[i], i, now);
+
+    g_info("Simulate %u batteries at %gx", params.count, params.speed);
+    return TRUE;
+}
+
+static void _simulation_uninit(void)
+{
+    guint i;
+
+    for (i = 0; i < params.count; i++)
+    {
+        if (simulation.batteries[i].present == TRUE)
+            _sim_battery_unplug(&simulation.batteries[i]);
+    }
+    g_free(simulation.batteries);
+    simulation.batteries = NULL;
+    g_rand_free(simulation.rand);
+    simulation.rand = NULL;
+}
+
+static gboolean _simulation_get_batteries_supply(GSList** list, GError** error)
+{
+    guint i;
+    SimBattery* sim;
+    gint64 now = _get_time();
+    gdouble hours = (now - simulation.scanned) / (SIMULATION_SECONDS_PER_HOUR * G_USEC_PER_SEC);
+
+    simulation.scanned = now;
+    for (i = 0; i < params.count; i++)
+    {
+        sim = &simulation.batteries[i];
+        if (params.hotplug > 0 && g_rand_double(simulation.rand) < params.hotplug * hours)
+        {
+            if (sim->present == TRUE)
+                _sim_battery_unplug(sim);
+            else
+                _sim_battery_plug(sim, i);
+        }
+
+        if (sim->present == TRUE && battery_is_selected(sim->battery->name, FALSE) == TRUE)
+            (*list) = g_slist_prepend((*list), battery_ref(sim->battery));
+    }
+    return TRUE;
+}
+
+static gboolean _simulation_get_battery_status(const Battery* battery, BATTERY_STATUS* status, GError** error)
+{
+    const SimBattery* sim = _get_sim_battery(battery, error);
+
+    if (sim == NULL)
+        return FALSE;
+
+    *status = sim->status;
+    return TRUE;
+}
+
+static gboolean _simulation_get_battery_capacity(const Battery* battery, guint64* capacity, GError** error)
+{
+    gdouble percent;
+    const SimBattery* sim = _get_sim_battery(battery, error);
+
+    if (sim == NULL)
+        return FALSE;
+
+    percent = sim->level * 100.0;
+    if (params.noise > 0)
+        percent += g_rand_double_range(simulation.rand, -params.noise, params.noise);
+    *capacity = (guint64)CLAMP(percent + 0.5, 0.0, 100.0);
+    return TRUE;
+}
+
+static gboolean _simulation_get_battery_time(
+    const Battery* battery,
+    BATTERY_STATUS status,
+    guint64* seconds,
+    GError** error)
+{
+    const SimBattery* sim = _get_sim_battery(battery, error);
+
+    if (sim == NULL)
+        return FALSE;
+
+    switch (status)
+    {
+        case DISCHARGING_STATUS:
+        case NOT_CHARGING_STATUS:
+            *seconds = (guint64)(SIMULATION_SECONDS_PER_HOUR * sim->level / MAX(sim->discharge, 1e-6));
+            break;
+        case CHARGING_STATUS:
+        case CHARGED_STATUS:
+            *seconds = (guint64)(SIMULATION_SECONDS_PER_HOUR * (1.0 - sim->level) / MAX(_charge_rate(sim), 1e-6));
+            break;
+        default:
+            g_set_error(error, BATTERY_ERROR, BATTERY_INVALID_STATUS, "Invalid status for get_battery_time: \"%d\"", status);
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/* Energy in uWh and power in uW, as for sysfs */
+static gboolean _simulation_get_battery_energy(
+    const Battery* battery,
+    guint64* now,
+    guint64* full,
+    guint64* rate,
+    GError** error)
+{
+    const SimBattery* sim = _get_sim_battery(battery, error);
+
+    if (sim == NULL)
+        return FALSE;
+
+    *now = (guint64)(sim->level * sim->energy_full * 1000000);
+    *full = (guint64)(sim->energy_full * 1000000);
+    if (rate == NULL)
+        return TRUE;
+
+    switch (sim->status)
+    {
+        case DISCHARGING_STATUS:
+            *rate = (guint64)(sim->discharge * sim->energy_full * 1000000);
+            break;
+        case CHARGING_STATUS:
+            *rate = (guint64)(_charge_rate(sim) * sim->energy_full * 1000000);
+            break;
+        default:
+            *rate = 0;
+            break;
+    }
+    return TRUE;
+}
+
+const BatteryBackend simulation_backend = {
+    SIMULATION_BACKEND_NAME,
+    _simulation_init,
+    _simulation_uninit,
+    _simulation_get_batteries_supply,
+    _simulation_get_battery_status,
+    _simulation_get_battery_capacity,
+    _simulation_get_battery_time,
+    _simulation_get_battery_energy,
+    NULL,
+    NULL,
+};
@@ -0,0 +1,24 @@
+#ifndef SIMULATION_H
+#define SIMULATION_H
+
+#include <glib.h>
+
+#include "battery.h"
+
+#define SIMULATION_BACKEND_NAME "simulation"
+#define SIMULATION_BATTERY_PREFIX "SIM"
+
+#define SIMULATION_COUNT_KEY "count"
+#define SIMULATION_DISCHARGE_KEY "discharge"
+#define SIMULATION_CHARGE_KEY "charge"
+#define SIMULATION_NOISE_KEY "noise"
+#define SIMULATION_FLAP_KEY "flap"
+#define SIMULATION_HOTPLUG_KEY "hotplug"
+#define SIMULATION_SPEED_KEY "speed"
+#define SIMULATION_SEED_KEY "seed"
+
+gboolean simulation_configure(const gchar* spec, GError** error);
+
+extern const BatteryBackend simulation_backend;
+
+#endif // SIMULATION_H
@@ -0,0 +1,269 @@
+#define _DEFAULT_SOURCE
+
+#include <glib.h>
+#include <malloc.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "battery.h"
+#include "stats.h"
+
+typedef struct _Histogram
+{
+    volatile gint count;
+    volatile gsize sum;
+    volatile gint buckets[STATS_HISTOGRAM_BUCKETS];
+} Histogram;
+
+static const gchar* const counter_names[N_STAT_COUNTERS] = {
+    "wakeups",       "rescans",
+    "sysfs_reads",   "sysfs_read_errors",
+    "notifications", "notification_errors",
+    "hooks",         "hook_failures",
+    "hook_timeouts", "allocations",
+    "frees",
+};
+
+static const gchar* const histogram_names[N_STAT_HISTOGRAMS] = {
+    "notify_rtt_us",
+    "timer_lateness_us",
+    "tick_duration_us",
+};
+
+/* The last entry collects every attribute missing from the list */
+static const gchar* const attr_names[] = {
+    BATTERY_STATUS_FILENAME,
+    BATTERY_CAPACITY_FILENAME,
+    BATTERY_ENERGY_NOW_FILENAME,
+    BATTERY_ENERGY_FULL_FILENAME,
+    BATTERY_ENERGY_FULL_DESIGN_FILENAME,
+    BATTERY_POWER_NOW_FILENAME,
+    BATTERY_CHARGE_NOW_FILENAME,
+    BATTERY_CHARGE_FULL_FILENAME,
+    BATTERY_CHARGE_FULL_DESIGN_FILENAME,
+    BATTERY_CURRENT_NOW_FILENAME,
+    BATTERY_VOLTAGE_NOW_FILENAME,
+    BATTERY_MANUFACTUR_FILENAME,
+    BATTERY_MODEL_NAME_FILENAME,
+    BATTERY_TECHNOLOGY_FILENAME,
+    BATTERY_SERIAL_NUMBER_FILENAME,
+    BATTERY_TYPE_FILENAME,
+    BATTERY_SCOPE_FILENAME,
+    "other",
+};
+
+#define N_ATTRS G_N_ELEMENTS(attr_names)
+
+static struct stats
+{
+    gint64 start_time;
+    volatile gint counters[N_STAT_COUNTERS];
+    Histogram histograms[N_STAT_HISTOGRAMS];
+    Histogram attrs[N_ATTRS];
+} stats;
+
+static void
+histogram_add(Histogram* histogram, gint64 usec)
+{
+    guint bucket = 0;
+
+    if (usec < 0)
+        usec = 0;
+    /* Bucket n holds values below 2^n microseconds */
+    while (bucket < STATS_HISTOGRAM_BUCKETS - 1 && (usec >> bucket) != 0)
+        bucket++;
+
+    g_atomic_int_inc(&histogram->buckets[bucket]);
+    g_atomic_pointer_add(&histogram->sum, (gssize)usec);
+    g_atomic_int_inc(&histogram->count);
+}
+
+static void
+histogram_append_json(GString* json, const Histogram* histogram)
+{
+    guint i;
+
+    g_string_append_printf(json,
+                           "{\"count\": %d, \"sum\": %" G_GSIZE_FORMAT ", \"buckets\": [",
+                           g_atomic_int_get(&histogram->count),
+                           (gsize)g_atomic_pointer_get(&histogram->sum));
+    for (i = 0; i < STATS_HISTOGRAM_BUCKETS; i++)
+        g_string_append_printf(
+          json, "%s%d", i > 0 ? ", " : "", g_atomic_int_get(&histogram->buckets[i]));
+    g_string_append(json, "]}");
+}
+
+/* Prometheus wants seconds and cumulative buckets, the last one is +Inf */
+static void
+histogram_append_openmetrics(GString* text, const gchar* name, const Histogram* histogram)
+{
+    guint i;
+    gint count = 0;
+    gchar value[32];
+
+    g_string_append_printf(text, "# TYPE batify_%s_seconds histogram\n", name);
+    for (i = 0; i < STATS_HISTOGRAM_BUCKETS - 1; i++) {
+        count += g_atomic_int_get(&histogram->buckets[i]);
+        g_ascii_formatd(value, sizeof(value), "%g", (gdouble)((guint64)1 << i) / G_USEC_PER_SEC);
+        g_string_append_printf(
+          text, "batify_%s_seconds_bucket{le=\"%s\"} %d\n", name, value, count);
+    }
+    g_string_append_printf(text,
+                           "batify_%s_seconds_bucket{le=\"+Inf\"} %d\n",
+                           name,
+                           count + g_atomic_int_get(&histogram->buckets[i]));
+    g_ascii_formatd(value,
+                    sizeof(value),
+                    "%g",
+                    (gdouble)(gsize)g_atomic_pointer_get(&histogram->sum) / G_USEC_PER_SEC);
+    g_string_append_printf(text, "batify_%s_seconds_sum %s\n", name, value);
+    g_string_append_printf(
+      text, "batify_%s_seconds_count %d\n", name, g_atomic_int_get(&histogram->count));
+}
+
+static guint64
+get_rss_bytes(void)
+{
+    gchar* statm;
+    guint64 pages = 0;
+    gchar** fields;
+
+    if (g_file_get_contents("/proc/self/statm", &statm, NULL, NULL) == FALSE)
+        return 0;
+
+    fields = g_strsplit(statm, " ", 3);
+    if (fields[0] != NULL && fields[1] != NULL)
+        pages = g_ascii_strtoull(fields[1], NULL, 10);
+    g_strfreev(fields);
+    g_free(statm);
+    return pages * (guint64)sysconf(_SC_PAGESIZE);
+}
+
+static guint
+get_open_fds(void)
+{
+    guint count = 0;
+    GDir* dir = g_dir_open("/proc/self/fd", 0, NULL);
+
+    if (dir == NULL)
+        return 0;
+    while (g_dir_read_name(dir) != NULL)
+        count++;
+    g_dir_close(dir);
+    /* Do not count the descriptor of the listing itself */
+    return count > 0 ? count - 1 : 0;
+}
+
+static guint64
+get_heap_bytes(void)
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+#else
+    return 0;
+#endif
+}
+
+void
+stats_init(void)
+{
+    memset(&stats, 0, sizeof(stats));
+    stats.start_time = g_get_monotonic_time();
+}
+
+void
+stats_counter_inc(STAT_COUNTER counter)
+{
+    g_atomic_int_inc(&stats.counters[counter]);
+}
+
+void
+stats_histogram_add(STAT_HISTOGRAM histogram, gint64 usec)
+{
+    histogram_add(&stats.histograms[histogram], usec);
+}
+
+void
+stats_attr_read(const gchar* sys_attr, gint64 usec, gboolean result)
+{
+    guint i;
+
+    for (i = 0; i < N_ATTRS - 1; i++) {
+        if (strcmp(attr_names[i], sys_attr) == 0)
+            break;
+    }
+    histogram_add(&stats.attrs[i], usec);
+
+    stats_counter_inc(STAT_SYSFS_READS);
+    if (result == FALSE)
+        stats_counter_inc(STAT_SYSFS_READ_ERRORS);
+}
+
+void
+stats_append_json(GString* json)
+{
+    guint i;
+    struct rusage usage;
+    gdouble hours = (g_get_monotonic_time() - stats.start_time) / (3600.0 * G_USEC_PER_SEC);
+
+    g_string_append_printf(
+      json, "\"uptime_s\": %.0f, \"counters\": {", hours * 3600.0);
+    for (i = 0; i < N_STAT_COUNTERS; i++)
+        g_string_append_printf(json,
+                               "%s\"%s\": %d",
+                               i > 0 ? ", " : "",
+                               counter_names[i],
+                               g_atomic_int_get(&stats.counters[i]));
+    g_string_append_printf(
+      json,
+      "}, \"wakeups_per_hour\": %.1f, ",
+      hours > 0 ? g_atomic_int_get(&stats.counters[STAT_WAKEUPS]) / hours : 0.0);
+
+    g_string_append(json, "\"histograms\": {");
+    for (i = 0; i < N_STAT_HISTOGRAMS; i++) {
+        g_string_append_printf(json, "%s\"%s\": ", i > 0 ? ", " : "", histogram_names[i]);
+        histogram_append_json(json, &stats.histograms[i]);
+    }
+    g_string_append(json, "}, \"sysfs_read_us\": {");
+    for (i = 0; i < N_ATTRS; i++) {
+        g_string_append_printf(json, "%s\"%s\": ", i > 0 ? ", " : "", attr_names[i]);
+        histogram_append_json(json, &stats.attrs[i]);
+    }
+    g_string_append(json, "}, ");
+
+    getrusage(RUSAGE_SELF, &usage);
+    g_string_append_printf(json,
+                           "\"rss_bytes\": %" G_GUINT64_FORMAT ", \"heap_bytes\": %" G_GUINT64_FORMAT
+                           ", \"open_fds\": %u, \"minor_faults\": %ld, \"major_faults\": %ld"
+                           ", \"voluntary_switches\": %ld, \"involuntary_switches\": %ld",
+                           get_rss_bytes(),
+                           get_heap_bytes(),
+                           get_open_fds(),
+                           usage.ru_minflt,
+                           usage.ru_majflt,
+                           usage.ru_nvcsw,
+                           usage.ru_nivcsw);
+}
+
+/* Counters and histograms only, uptime would make every snapshot differ */
+void
+stats_append_openmetrics(GString* text)
+{
+    guint i;
+    gchar* name;
+
+    for (i = 0; i < N_STAT_COUNTERS; i++)
+        g_string_append_printf(text,
+                               "# TYPE batify_%s_total counter\nbatify_%s_total %d\n",
+                               counter_names[i],
+                               counter_names[i],
+                               g_atomic_int_get(&stats.counters[i]));
+    for (i = 0; i < N_STAT_HISTOGRAMS; i++) {
+        /* The _us suffix gives way to _seconds */
+        name = g_strndup(histogram_names[i], strlen(histogram_names[i]) - 3);
+        histogram_append_openmetrics(text, name, &stats.histograms[i]);
+        g_free(name);
+    }
+}
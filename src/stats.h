@@ -0,0 +1,52 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <glib.h>
+
+/*
+ * Process-wide counters and latency histograms. Every update is a single
+ * atomic operation, so any thread may record without locking.
+ */
+
+#define STATS_HISTOGRAM_BUCKETS 24
+
+typedef enum
+{
+    STAT_WAKEUPS,
+    STAT_RESCANS,
+    STAT_SYSFS_READS,
+    STAT_SYSFS_READ_ERRORS,
+    STAT_NOTIFICATIONS,
+    STAT_NOTIFICATION_ERRORS,
+    STAT_HOOKS,
+    STAT_HOOK_FAILURES,
+    STAT_HOOK_TIMEOUTS,
+    STAT_ALLOCATIONS,
+    STAT_FREES,
+    N_STAT_COUNTERS,
+} STAT_COUNTER;
+
+typedef enum
+{
+    STAT_NOTIFY_RTT,
+    STAT_TIMER_LATENESS,
+    STAT_TICK_DURATION,
+    N_STAT_HISTOGRAMS,
+} STAT_HISTOGRAM;
+
+void
+stats_init(void);
+
+void
+stats_counter_inc(STAT_COUNTER counter);
+void
+stats_histogram_add(STAT_HISTOGRAM histogram, gint64 usec);
+void
+stats_attr_read(const gchar* sys_attr, gint64 usec, gboolean result);
+
+void
+stats_append_json(GString* json);
+void
+stats_append_openmetrics(GString* text);
+
+#endif // STATS_H
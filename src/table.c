@@ -0,0 +1,116 @@
+#include <glib.h>
+#include <string.h>
+
+#include "table.h"
+
+#define TABLE_MIN_ALLOCATED 8
+
+#define TABLE_RESIZE(table, column, allocated)                                                     \
+    (table)->column = g_realloc_n((table)->column, (allocated), sizeof(*(table)->column))
+
+#define TABLE_MOVE(table, column, to, from) (table)->column[to] = (table)->column[from]
+
+static void
+table_resize(BatteryTable* table, guint allocated)
+{
+    TABLE_RESIZE(table, status, allocated);
+    TABLE_RESIZE(table, prev_status, allocated);
+    TABLE_RESIZE(table, flags, allocated);
+    TABLE_RESIZE(table, crossing, allocated);
+    TABLE_RESIZE(table, capacity, allocated);
+    TABLE_RESIZE(table, low_level, allocated);
+    TABLE_RESIZE(table, critical_level, allocated);
+    TABLE_RESIZE(table, full_capacity, allocated);
+    TABLE_RESIZE(table, seconds, allocated);
+    TABLE_RESIZE(table, timestamp, allocated);
+    TABLE_RESIZE(table, owners, allocated);
+    table->allocated = allocated;
+}
+
+void
+table_init(BatteryTable* table)
+{
+    memset(table, 0, sizeof(*table));
+}
+
+void
+table_clear(BatteryTable* table)
+{
+    g_free(table->status);
+    g_free(table->prev_status);
+    g_free(table->flags);
+    g_free(table->crossing);
+    g_free(table->capacity);
+    g_free(table->low_level);
+    g_free(table->critical_level);
+    g_free(table->full_capacity);
+    g_free(table->seconds);
+    g_free(table->timestamp);
+    g_free(table->owners);
+    table_init(table);
+}
+
+guint
+table_insert(BatteryTable* table, gpointer owner)
+{
+    guint row = table->length;
+
+    if (row == table->allocated)
+        table_resize(table, MAX(table->allocated * 2, TABLE_MIN_ALLOCATED));
+
+    table->status[row] = 0;
+    table->prev_status[row] = 0;
+    table->flags[row] = 0;
+    table->crossing[row] = 0;
+    table->capacity[row] = 0;
+    table->low_level[row] = 0;
+    table->critical_level[row] = 0;
+    table->full_capacity[row] = 0;
+    table->seconds[row] = 0;
+    table->timestamp[row] = 0;
+    table->owners[row] = owner;
+    table->length++;
+    return row;
+}
+
+/* Returns the owner that moved into the row, NULL when the last row was removed */
+gpointer
+table_remove(BatteryTable* table, guint row)
+{
+    guint last = table->length - 1;
+
+    table->length--;
+    if (row == last)
+        return NULL;
+
+    TABLE_MOVE(table, status, row, last);
+    TABLE_MOVE(table, prev_status, row, last);
+    TABLE_MOVE(table, flags, row, last);
+    TABLE_MOVE(table, crossing, row, last);
+    TABLE_MOVE(table, capacity, row, last);
+    TABLE_MOVE(table, low_level, row, last);
+    TABLE_MOVE(table, critical_level, row, last);
+    TABLE_MOVE(table, full_capacity, row, last);
+    TABLE_MOVE(table, seconds, row, last);
+    TABLE_MOVE(table, timestamp, row, last);
+    TABLE_MOVE(table, owners, row, last);
+    return table->owners[row];
+}
+
+void
+table_evaluate(BatteryTable* table, guint begin, guint end)
+{
+    guint row;
+    const gint32* capacity = table->capacity;
+    const gint32* low_level = table->low_level;
+    const gint32* critical_level = table->critical_level;
+    const gint32* full_capacity = table->full_capacity;
+    guint8* crossing = table->crossing;
+
+    for (row = begin; row < end; row++) {
+        crossing[row] = (guint8)(((capacity[row] <= low_level[row]) &
+                                  (capacity[row] > critical_level[row])) |
+                                 ((capacity[row] <= critical_level[row]) << 1) |
+                                 ((capacity[row] >= full_capacity[row]) << 2));
+    }
+}
@@ -0,0 +1,55 @@
+#ifndef TABLE_H
+#define TABLE_H
+
+#include <glib.h>
+
+/*
+ * Policy state of every watched battery in struct-of-arrays layout. Rows
+ * are dense: removing a row moves the last one into its place. The
+ * threshold pass reads and writes plain arrays with no branches, so a
+ * single linear walk checks every battery and the compiler can vectorise it.
+ */
+
+/* Row flags */
+#define TABLE_DIRTY (1 << 0)
+#define TABLE_HAS_CAPACITY (1 << 1)
+#define TABLE_LOW_NOTIFIED (1 << 2)
+#define TABLE_CRITICAL_NOTIFIED (1 << 3)
+
+/* Threshold pass output */
+#define TABLE_BELOW_LOW (1 << 0)
+#define TABLE_BELOW_CRITICAL (1 << 1)
+#define TABLE_ABOVE_FULL (1 << 2)
+
+typedef struct _BatteryTable
+{
+    guint length;
+    guint allocated;
+
+    guint8* status;
+    guint8* prev_status;
+    guint8* flags;
+    guint8* crossing;
+    gint32* capacity;
+    gint32* low_level;
+    gint32* critical_level;
+    gint32* full_capacity;
+    guint64* seconds;
+    gint64* timestamp;
+    gpointer* owners;
+} BatteryTable;
+
+void
+table_init(BatteryTable* table);
+void
+table_clear(BatteryTable* table);
+
+guint
+table_insert(BatteryTable* table, gpointer owner);
+gpointer
+table_remove(BatteryTable* table, guint row);
+
+void
+table_evaluate(BatteryTable* table, guint begin, guint end);
+
+#endif // TABLE_H
@@ -0,0 +1,213 @@
+#include <glib.h>
+#include <string.h>
+
+#include "template.h"
+
+G_DEFINE_QUARK(template-error-quark, template_error)
+
+#define TEMPLATE_LITERAL (-1)
+
+/* A literal is a slice of the template text, a field has no length */
+typedef struct _TemplateOp
+{
+    gint field;
+    guint offset;
+    guint length;
+} TemplateOp;
+
+struct _Template
+{
+    gchar* text;
+    TemplateOp* ops;
+    guint n_ops;
+    guint fields;
+};
+
+static const gchar* field_names[] = {
+    "name", "technology", "model", "manufacturer", "serial",
+    "status", "level", "percent", "remaining",
+};
+
+static void
+add_op(Template* template, gint field, gsize offset, gsize length)
+{
+    TemplateOp* op;
+
+    if (field == TEMPLATE_LITERAL && length == 0)
+        return;
+
+    op = &template->ops[template->n_ops++];
+    op->field = field;
+    op->offset = (guint)offset;
+    op->length = (guint)length;
+    if (field != TEMPLATE_LITERAL)
+        template->fields |= 1u << field;
+}
+
+static gint
+lookup_field(const gchar* name, gsize length)
+{
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS(field_names); i++) {
+        if (strlen(field_names[i]) == length && strncmp(field_names[i], name, length) == 0)
+            return (gint)i;
+    }
+    return -1;
+}
+
+Template*
+template_new(const gchar* source, GError** error)
+{
+    gint field;
+    const gchar *cursor, *literal, *close;
+    Template* template = g_new0(Template, 1);
+
+    template->text = g_strdup(source);
+    /* Every brace starts at most one literal and one field */
+    template->ops = g_new(TemplateOp, strlen(source) + 1);
+
+    literal = cursor = template->text;
+    while (*cursor != '\0') {
+        if ((cursor[0] == '{' && cursor[1] == '{') || (cursor[0] == '}' && cursor[1] == '}')) {
+            add_op(template, TEMPLATE_LITERAL, literal - template->text, cursor + 1 - literal);
+            literal = cursor += 2;
+            continue;
+        }
+        if (cursor[0] != '{') {
+            cursor++;
+            continue;
+        }
+
+        close = strchr(cursor, '}');
+        if (close == NULL) {
+            g_set_error(error,
+                        TEMPLATE_ERROR,
+                        TEMPLATE_UNTERMINATED,
+                        "Unterminated field in \"%s\"",
+                        source);
+            template_free(template);
+            return NULL;
+        }
+
+        field = lookup_field(cursor + 1, close - cursor - 1);
+        if (field < 0) {
+            g_set_error(error,
+                        TEMPLATE_ERROR,
+                        TEMPLATE_UNKNOWN_FIELD,
+                        "Unknown field \"%.*s\" in \"%s\"",
+                        (gint)(close - cursor + 1),
+                        cursor,
+                        source);
+            template_free(template);
+            return NULL;
+        }
+
+        add_op(template, TEMPLATE_LITERAL, literal - template->text, cursor - literal);
+        add_op(template, field, 0, 0);
+        literal = cursor = close + 1;
+    }
+    add_op(template, TEMPLATE_LITERAL, literal - template->text, cursor - literal);
+    return template;
+}
+
+void
+template_free(Template* template)
+{
+    g_free(template->ops);
+    g_free(template->text);
+    g_free(template);
+}
+
+gboolean
+template_has_field(const Template* template, TEMPLATE_FIELD field)
+{
+    return (template->fields & (1u << field)) != 0;
+}
+
+/* Truncates on a character boundary, buffer and size include the NUL */
+static void
+append(gchar* buffer, gsize size, gsize* position, const gchar* value, gsize length)
+{
+    gsize room = size - 1 - *position;
+
+    if (length > room) {
+        length = room;
+        while (length > 0 && (value[length] & 0xc0) == 0x80)
+            length--;
+    }
+    memcpy(buffer + *position, value, length);
+    *position += length;
+}
+
+static void
+append_string(gchar* buffer, gsize size, gsize* position, const gchar* value)
+{
+    if (value != NULL)
+        append(buffer, size, position, value, strlen(value));
+}
+
+static void
+append_field(gchar* buffer, gsize size, gsize* position, gint field, const TemplateValues* values)
+{
+    gchar number[32];
+    guint64 minutes;
+    gint length = 0;
+
+    switch (field) {
+        case TEMPLATE_NAME:
+            append_string(buffer, size, position, values->battery->name);
+            return;
+        case TEMPLATE_TECHNOLOGY:
+            append_string(buffer, size, position, values->battery->technology);
+            return;
+        case TEMPLATE_MODEL:
+            append_string(buffer, size, position, values->battery->model_name);
+            return;
+        case TEMPLATE_MANUFACTURER:
+            append_string(buffer, size, position, values->battery->manufacture);
+            return;
+        case TEMPLATE_SERIAL:
+            append_string(buffer, size, position, values->battery->serial_number);
+            return;
+        case TEMPLATE_STATUS:
+            append_string(buffer, size, position, values->status);
+            return;
+        case TEMPLATE_LEVEL:
+            append_string(buffer, size, position, values->level);
+            return;
+        case TEMPLATE_PERCENT:
+            length = g_snprintf(number, sizeof(number), "%" G_GUINT64_FORMAT, values->percent);
+            break;
+        case TEMPLATE_REMAINING:
+            minutes = values->seconds / 60;
+            length = g_snprintf(number,
+                                sizeof(number),
+                                "%02" G_GUINT64_FORMAT ":%02" G_GUINT64_FORMAT,
+                                minutes / 60,
+                                minutes % 60);
+            break;
+    }
+    append(buffer, size, position, number, MIN((gsize)length, sizeof(number) - 1));
+}
+
+/* Returns the length of the rendered text */
+gsize
+template_render(const Template* template, const TemplateValues* values, gchar* buffer, gsize size)
+{
+    guint i;
+    gsize position = 0;
+    const TemplateOp* op;
+
+    g_return_val_if_fail(size > 0, 0);
+
+    for (i = 0; i < template->n_ops; i++) {
+        op = &template->ops[i];
+        if (op->field == TEMPLATE_LITERAL)
+            append(buffer, size, &position, template->text + op->offset, op->length);
+        else
+            append_field(buffer, size, &position, op->field, values);
+    }
+    buffer[position] = '\0';
+    return position;
+}
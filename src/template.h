@@ -0,0 +1,56 @@
+#ifndef TEMPLATE_H
+#define TEMPLATE_H
+
+#include <glib.h>
+
+#include "battery.h"
+
+/*
+ * Notification text with {field} placeholders, compiled once into a list
+ * of literal and field operations. Rendering writes into a caller buffer
+ * and never allocates, so templates can be shared between threads. "{{"
+ * and "}}" stand for literal braces.
+ */
+
+#define TEMPLATE_ERROR template_error_quark()
+GQuark
+template_error_quark(void);
+
+#define TEMPLATE_UNTERMINATED 4000
+#define TEMPLATE_UNKNOWN_FIELD 4001
+
+typedef enum
+{
+    TEMPLATE_NAME,
+    TEMPLATE_TECHNOLOGY,
+    TEMPLATE_MODEL,
+    TEMPLATE_MANUFACTURER,
+    TEMPLATE_SERIAL,
+    TEMPLATE_STATUS,
+    TEMPLATE_LEVEL,
+    TEMPLATE_PERCENT,
+    TEMPLATE_REMAINING,
+} TEMPLATE_FIELD;
+
+typedef struct _TemplateValues
+{
+    const Battery* battery;
+    const gchar* status;
+    const gchar* level;
+    guint64 percent;
+    guint64 seconds;
+} TemplateValues;
+
+typedef struct _Template Template;
+
+Template*
+template_new(const gchar* source, GError** error);
+void
+template_free(Template* template);
+
+gboolean
+template_has_field(const Template* template, TEMPLATE_FIELD field);
+gsize
+template_render(const Template* template, const TemplateValues* values, gchar* buffer, gsize size);
+
+#endif // TEMPLATE_H
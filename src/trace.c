@@ -0,0 +1,315 @@
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "trace.h"
+
+G_DEFINE_QUARK(trace-error-quark, trace_error)
+
+#define TRACE_HEADER_SIZE (sizeof(TRACE_MAGIC) - 1 + 1)
+#define TRACE_BATTERY_PERIPHERAL (1 << 0)
+
+struct _TraceWriter
+{
+    gchar* path;
+    FILE* file;
+    GString* buffer;
+    guint next_id;
+    gint64 timestamp;
+};
+
+struct _TraceReader
+{
+    GMappedFile* mapped_file;
+    const guchar* cursor;
+    const guchar* end;
+    gint64 timestamp;
+};
+
+static void
+put_varint(GString* buffer, guint64 value)
+{
+    while (value >= 0x80) {
+        g_string_append_c(buffer, (gchar)(value | 0x80));
+        value >>= 7;
+    }
+    g_string_append_c(buffer, (gchar)value);
+}
+
+static void
+put_string(GString* buffer, const gchar* value)
+{
+    gsize length = strlen(value);
+
+    put_varint(buffer, length);
+    g_string_append_len(buffer, value, length);
+}
+
+/* Zigzag keeps small negative deltas small */
+static void
+put_record_header(TraceWriter* writer, TRACE_RECORD type, guint id, gint64 timestamp)
+{
+    gint64 delta = timestamp - writer->timestamp;
+
+    g_string_append_c(writer->buffer, (gchar)type);
+    put_varint(writer->buffer, ((guint64)delta << 1) ^ (guint64)(delta >> 63));
+    put_varint(writer->buffer, id);
+    writer->timestamp = timestamp;
+}
+
+TraceWriter*
+trace_writer_new(const gchar* path, GError** error)
+{
+    TraceWriter* writer;
+    FILE* file = g_fopen(path, "wb");
+
+    if (file == NULL) {
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    g_file_error_from_errno(errno),
+                    "Cannot open %s: %s",
+                    path,
+                    g_strerror(errno));
+        return NULL;
+    }
+
+    writer = g_new0(TraceWriter, 1);
+    writer->path = g_strdup(path);
+    writer->file = file;
+    writer->buffer = g_string_new(TRACE_MAGIC);
+    g_string_append_c(writer->buffer, TRACE_VERSION);
+    return writer;
+}
+
+gboolean
+trace_writer_flush(TraceWriter* writer, GError** error)
+{
+    if (writer->buffer->len > 0 &&
+        fwrite(writer->buffer->str, 1, writer->buffer->len, writer->file) != writer->buffer->len) {
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    g_file_error_from_errno(errno),
+                    "Cannot write %s: %s",
+                    writer->path,
+                    g_strerror(errno));
+        return FALSE;
+    }
+    g_string_truncate(writer->buffer, 0);
+
+    if (fflush(writer->file) != 0) {
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    g_file_error_from_errno(errno),
+                    "Cannot write %s: %s",
+                    writer->path,
+                    g_strerror(errno));
+        return FALSE;
+    }
+    return TRUE;
+}
+
+void
+trace_writer_free(TraceWriter* writer)
+{
+    GError* error = NULL;
+
+    if (trace_writer_flush(writer, &error) == FALSE) {
+        g_warning("%s", error->message);
+        g_error_free(error);
+    }
+    fclose(writer->file);
+    g_string_free(writer->buffer, TRUE);
+    g_free(writer->path);
+    g_free(writer);
+}
+
+/* Ids are never reused, a battery that comes back gets a new one */
+guint
+trace_writer_add_battery(TraceWriter* writer, gint64 timestamp, const Battery* battery)
+{
+    guint id = ++writer->next_id;
+
+    put_record_header(writer, TRACE_BATTERY, id, timestamp);
+    g_string_append_c(writer->buffer, battery->peripheral ? TRACE_BATTERY_PERIPHERAL : 0);
+    put_string(writer->buffer, battery->name);
+    put_string(writer->buffer, battery->model_name);
+    put_string(writer->buffer, battery->manufacture);
+    put_string(writer->buffer, battery->technology);
+    put_string(writer->buffer, battery->serial_number);
+    return id;
+}
+
+void
+trace_writer_sample(TraceWriter* writer,
+                    guint id,
+                    gint64 timestamp,
+                    BATTERY_STATUS status,
+                    guint flags,
+                    guint64 capacity,
+                    guint64 seconds)
+{
+    put_record_header(writer, TRACE_SAMPLE, id, timestamp);
+    g_string_append_c(writer->buffer, (gchar)status);
+    g_string_append_c(writer->buffer, (gchar)flags);
+    put_varint(writer->buffer, capacity);
+    put_varint(writer->buffer, seconds);
+}
+
+void
+trace_writer_retire(TraceWriter* writer, guint id, gint64 timestamp)
+{
+    put_record_header(writer, TRACE_RETIRE, id, timestamp);
+}
+
+static gboolean
+get_byte(TraceReader* reader, guint* value, GError** error)
+{
+    if (reader->cursor >= reader->end) {
+        g_set_error(error, TRACE_ERROR, TRACE_TRUNCATED, "Trace ends inside a record");
+        return FALSE;
+    }
+    *value = *reader->cursor++;
+    return TRUE;
+}
+
+static gboolean
+get_varint(TraceReader* reader, guint64* value, GError** error)
+{
+    guint byte, shift;
+
+    *value = 0;
+    for (shift = 0; shift < 64; shift += 7) {
+        if (get_byte(reader, &byte, error) == FALSE)
+            return FALSE;
+        *value |= (guint64)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0)
+            return TRUE;
+    }
+    g_set_error(error, TRACE_ERROR, TRACE_INVALID_FORMAT, "Varint is longer than 64 bits");
+    return FALSE;
+}
+
+static gboolean
+get_string(TraceReader* reader, gchar** value, GError** error)
+{
+    guint64 length;
+
+    if (get_varint(reader, &length, error) == FALSE)
+        return FALSE;
+    if (length > (guint64)(reader->end - reader->cursor)) {
+        g_set_error(error, TRACE_ERROR, TRACE_TRUNCATED, "Trace ends inside a string");
+        return FALSE;
+    }
+    *value = g_strndup((const gchar*)reader->cursor, length);
+    reader->cursor += length;
+    return TRUE;
+}
+
+static gboolean
+get_battery(TraceReader* reader, TraceRecord* record, GError** error)
+{
+    guint i, flags;
+    gboolean result;
+    gchar* strings[5] = { NULL };
+
+    result = get_byte(reader, &flags, error);
+    for (i = 0; result == TRUE && i < G_N_ELEMENTS(strings); i++)
+        result = get_string(reader, &strings[i], error);
+
+    if (result == TRUE) {
+        record->battery =
+          battery_new_full(strings[0], "", strings[1], strings[2], strings[3], strings[4]);
+        record->battery->peripheral = (flags & TRACE_BATTERY_PERIPHERAL) != 0;
+    }
+    for (i = 0; i < G_N_ELEMENTS(strings); i++)
+        g_free(strings[i]);
+    return result;
+}
+
+static gboolean
+get_sample(TraceReader* reader, TraceRecord* record, GError** error)
+{
+    guint status, flags;
+
+    if (get_byte(reader, &status, error) == FALSE || get_byte(reader, &flags, error) == FALSE ||
+        get_varint(reader, &record->capacity, error) == FALSE ||
+        get_varint(reader, &record->seconds, error) == FALSE)
+        return FALSE;
+
+    if (status < UNKNOWN_STATUS || status > CHARGED_STATUS) {
+        g_set_error(error, TRACE_ERROR, TRACE_INVALID_FORMAT, "Invalid status %u", status);
+        return FALSE;
+    }
+    record->status = (BATTERY_STATUS)status;
+    record->flags = flags;
+    return TRUE;
+}
+
+TraceReader*
+trace_reader_new(const gchar* path, GError** error)
+{
+    TraceReader* reader;
+    const guchar* contents;
+    gsize length;
+    GMappedFile* mapped_file = g_mapped_file_new(path, FALSE, error);
+
+    if (mapped_file == NULL)
+        return NULL;
+
+    contents = (const guchar*)g_mapped_file_get_contents(mapped_file);
+    length = g_mapped_file_get_length(mapped_file);
+    if (length < TRACE_HEADER_SIZE || memcmp(contents, TRACE_MAGIC, TRACE_HEADER_SIZE - 1) != 0 ||
+        contents[TRACE_HEADER_SIZE - 1] != TRACE_VERSION) {
+        g_set_error(error, TRACE_ERROR, TRACE_INVALID_FORMAT, "%s is not a batify trace", path);
+        g_mapped_file_unref(mapped_file);
+        return NULL;
+    }
+
+    reader = g_new0(TraceReader, 1);
+    reader->mapped_file = mapped_file;
+    reader->cursor = contents + TRACE_HEADER_SIZE;
+    reader->end = contents + length;
+    return reader;
+}
+
+/* FALSE with no error set at the end of the trace */
+gboolean
+trace_reader_next(TraceReader* reader, TraceRecord* record, GError** error)
+{
+    guint type;
+    guint64 delta, id;
+
+    if (reader->cursor == reader->end)
+        return FALSE;
+
+    memset(record, 0, sizeof(*record));
+    if (get_byte(reader, &type, error) == FALSE || get_varint(reader, &delta, error) == FALSE ||
+        get_varint(reader, &id, error) == FALSE)
+        return FALSE;
+
+    reader->timestamp += (gint64)(delta >> 1) ^ -(gint64)(delta & 1);
+    record->type = (TRACE_RECORD)type;
+    record->id = (guint)id;
+    record->timestamp = reader->timestamp;
+
+    switch (type) {
+        case TRACE_BATTERY:
+            return get_battery(reader, record, error);
+        case TRACE_SAMPLE:
+            return get_sample(reader, record, error);
+        case TRACE_RETIRE:
+            return TRUE;
+        default:
+            g_set_error(error, TRACE_ERROR, TRACE_INVALID_FORMAT, "Invalid record type %u", type);
+            return FALSE;
+    }
+}
+
+void
+trace_reader_free(TraceReader* reader)
+{
+    g_mapped_file_unref(reader->mapped_file);
+    g_free(reader);
+}
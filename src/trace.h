@@ -0,0 +1,75 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <glib.h>
+
+#include "battery.h"
+
+/*
+ * Binary trace of the samples seen by the policy stage. The file starts
+ * with TRACE_MAGIC and a version byte, then holds one record per battery,
+ * sample or removal. Every record starts with its type, the time since the
+ * previous record and the battery id; integers are LEB128 varints, so a
+ * sample takes about ten bytes.
+ */
+
+#define TRACE_ERROR trace_error_quark()
+GQuark
+trace_error_quark(void);
+
+#define TRACE_INVALID_FORMAT 3000
+#define TRACE_TRUNCATED 3001
+
+#define TRACE_MAGIC "BATIFYTR"
+#define TRACE_VERSION 1
+
+typedef enum
+{
+    TRACE_BATTERY = 1,
+    TRACE_SAMPLE,
+    TRACE_RETIRE,
+} TRACE_RECORD;
+
+typedef struct _TraceRecord
+{
+    TRACE_RECORD type;
+    guint id;
+    gint64 timestamp;
+    Battery* battery;
+    BATTERY_STATUS status;
+    guint flags;
+    guint64 capacity;
+    guint64 seconds;
+} TraceRecord;
+
+typedef struct _TraceWriter TraceWriter;
+typedef struct _TraceReader TraceReader;
+
+TraceWriter*
+trace_writer_new(const gchar* path, GError** error);
+gboolean
+trace_writer_flush(TraceWriter* writer, GError** error);
+void
+trace_writer_free(TraceWriter* writer);
+
+guint
+trace_writer_add_battery(TraceWriter* writer, gint64 timestamp, const Battery* battery);
+void
+trace_writer_sample(TraceWriter* writer,
+                    guint id,
+                    gint64 timestamp,
+                    BATTERY_STATUS status,
+                    guint flags,
+                    guint64 capacity,
+                    guint64 seconds);
+void
+trace_writer_retire(TraceWriter* writer, guint id, gint64 timestamp);
+
+TraceReader*
+trace_reader_new(const gchar* path, GError** error);
+gboolean
+trace_reader_next(TraceReader* reader, TraceRecord* record, GError** error);
+void
+trace_reader_free(TraceReader* reader);
+
+#endif // TRACE_H
@@ -0,0 +1,599 @@
+#include <gio/gio.h>
+#include <glib.h>
+
+#include "battery.h"
+#include "upower.h"
+
+/*
+ * Batteries are the org.freedesktop.UPower.Device objects of upowerd. Each
+ * device gets a proxy whose property cache is kept current by the
+ * PropertiesChanged signal, so the battery operations never leave the
+ * process. Once subscribed, DeviceAdded and DeviceRemoved keep the device
+ * table current and rescans answer from it; unsubscribed, every rescan
+ * enumerates the devices again. The system bus is taken from
+ * DBUS_SYSTEM_BUS_ADDRESS when set, which lets the backend run against a
+ * mock upowerd on a private bus.
+ */
+
+typedef struct _Device
+{
+    GDBusProxy* proxy;
+    Battery* battery;
+} Device;
+
+static struct upower
+{
+    GDBusConnection* connection;
+    GHashTable* devices;
+    guint added_id;
+    guint removed_id;
+} upower = { NULL, NULL, 0, 0 };
+
+static const gchar* technologies[] = { "Unknown", "Li-ion", "Li-poly", "LiFe", "Pb", "NiCd", "NiMH" };
+
+static void _device_free(Device* device)
+{
+    g_signal_handlers_disconnect_by_data(device->proxy, device);
+    g_object_unref(device->proxy);
+    if (device->battery != NULL)
+        battery_unref(device->battery);
+    g_free(device);
+}
+
+static GVariant* _get_property(GDBusProxy* proxy, const gchar* property, const GVariantType* type)
+{
+    GVariant* value = g_dbus_proxy_get_cached_property(proxy, property);
+
+    if (value != NULL && g_variant_is_of_type(value, type) == FALSE)
+    {
+        g_variant_unref(value);
+        return NULL;
+    }
+    return value;
+}
+
+static gboolean _get_property_boolean(GDBusProxy* proxy, const gchar* property)
+{
+    gboolean result = FALSE;
+    GVariant* value = _get_property(proxy, property, G_VARIANT_TYPE_BOOLEAN);
+
+    if (value != NULL)
+    {
+        result = g_variant_get_boolean(value);
+        g_variant_unref(value);
+    }
+    return result;
+}
+
+static guint32 _get_property_uint32(GDBusProxy* proxy, const gchar* property)
+{
+    guint32 result = 0;
+    GVariant* value = _get_property(proxy, property, G_VARIANT_TYPE_UINT32);
+
+    if (value != NULL)
+    {
+        result = g_variant_get_uint32(value);
+        g_variant_unref(value);
+    }
+    return result;
+}
+
+static gint64 _get_property_int64(GDBusProxy* proxy, const gchar* property)
+{
+    gint64 result = 0;
+    GVariant* value = _get_property(proxy, property, G_VARIANT_TYPE_INT64);
+
+    if (value != NULL)
+    {
+        result = g_variant_get_int64(value);
+        g_variant_unref(value);
+    }
+    return result;
+}
+
+static gdouble _get_property_double(GDBusProxy* proxy, const gchar* property)
+{
+    gdouble result = 0.0;
+    GVariant* value = _get_property(proxy, property, G_VARIANT_TYPE_DOUBLE);
+
+    if (value != NULL)
+    {
+        result = g_variant_get_double(value);
+        g_variant_unref(value);
+    }
+    return result;
+}
+
+static gchar* _get_property_string(GDBusProxy* proxy, const gchar* property)
+{
+    gchar* result;
+    GVariant* value = _get_property(proxy, property, G_VARIANT_TYPE_STRING);
+
+    if (value == NULL)
+        return g_strdup("");
+
+    result = g_strstrip(g_variant_dup_string(value, NULL));
+    g_variant_unref(value);
+    return result;
+}
+
+static gboolean _has_property(GVariant* properties, const gchar* property)
+{
+    GVariant* value = g_variant_lookup_value(properties, property, NULL);
+
+    if (value == NULL)
+        return FALSE;
+
+    g_variant_unref(value);
+    return TRUE;
+}
+
+/* NULL unless the device is a battery the selection asks for */
+static Battery* _device_battery_new(const gchar* object_path, GDBusProxy* proxy)
+{
+    Battery* battery;
+    guint32 type, technology;
+    gboolean peripheral;
+    gchar *native_path, *name, *model_name, *manufacture, *serial_number;
+
+    type = _get_property_uint32(proxy, UPOWER_TYPE_PROPERTY);
+    if (type == UPOWER_TYPE_UNKNOWN || type == UPOWER_TYPE_LINE_POWER)
+        return NULL;
+    if (_get_property_boolean(proxy, UPOWER_IS_PRESENT_PROPERTY) == FALSE)
+        return NULL;
+
+    native_path = _get_property_string(proxy, UPOWER_NATIVE_PATH_PROPERTY);
+    if (*native_path != '\0')
+        name = g_path_get_basename(native_path);
+    else
+        name = g_path_get_basename(object_path);
+    g_free(native_path);
+
+    peripheral = type != UPOWER_TYPE_BATTERY ||
+                 _get_property_boolean(proxy, UPOWER_POWER_SUPPLY_PROPERTY) == FALSE;
+    if (battery_is_selected(name, peripheral) == FALSE)
+    {
+        g_free(name);
+        return NULL;
+    }
+
+    technology = _get_property_uint32(proxy, UPOWER_TECHNOLOGY_PROPERTY);
+    model_name = _get_property_string(proxy, UPOWER_MODEL_PROPERTY);
+    manufacture = _get_property_string(proxy, UPOWER_VENDOR_PROPERTY);
+    serial_number = _get_property_string(proxy, UPOWER_SERIAL_PROPERTY);
+
+    battery = battery_new_full(
+        name,
+        object_path,
+        model_name,
+        manufacture,
+        technologies[technology < G_N_ELEMENTS(technologies) ? technology : 0],
+        serial_number);
+    battery->peripheral = peripheral;
+
+    g_free(name);
+    g_free(model_name);
+    g_free(manufacture);
+    g_free(serial_number);
+    return battery;
+}
+
+/* A cached device gains its battery when a pack is inserted and loses it when removed */
+static void _device_update(Device* device, const gchar* object_path)
+{
+    if (device->battery == NULL)
+        device->battery = _device_battery_new(object_path, device->proxy);
+    else if (_get_property_boolean(device->proxy, UPOWER_IS_PRESENT_PROPERTY) == FALSE)
+        g_clear_pointer(&device->battery, battery_unref);
+}
+
+static void _on_properties_changed(
+    GDBusProxy* proxy,
+    GVariant* changed_properties,
+    const gchar* const* invalidated_properties,
+    Device* device)
+{
+    const Battery* battery = device->battery;
+
+    /* A pack was inserted or removed */
+    if (_has_property(changed_properties, UPOWER_IS_PRESENT_PROPERTY) == TRUE)
+    {
+        _device_update(device, g_dbus_proxy_get_object_path(proxy));
+        if ((battery == NULL) != (device->battery == NULL))
+        {
+            battery_supply_changed();
+            return;
+        }
+    }
+
+    /* upowerd also refreshes UpdateTime and the energy figures on every poll */
+    if (device->battery == NULL)
+        return;
+    if (_has_property(changed_properties, UPOWER_STATE_PROPERTY) == TRUE ||
+        _has_property(changed_properties, UPOWER_PERCENTAGE_PROPERTY) == TRUE)
+        battery_changed(device->battery->identity);
+}
+
+/*
+ * The proxy dispatches PropertiesChanged to the thread default context of
+ * the caller, that is the context get_batteries_supply and subscribe run
+ * on. Devices that are no battery yet keep their proxy, so a pack inserted
+ * later shows up through IsPresent.
+ */
+static Device* _device_new(const gchar* object_path, GError** error)
+{
+    Device* device;
+    GDBusProxy* proxy = g_dbus_proxy_new_sync(
+        upower.connection,
+        G_DBUS_PROXY_FLAGS_DO_NOT_CONNECT_SIGNALS | G_DBUS_PROXY_FLAGS_GET_INVALIDATED_PROPERTIES,
+        NULL,
+        UPOWER_BUS_NAME,
+        object_path,
+        UPOWER_DEVICE_INTERFACE,
+        NULL,
+        error);
+    if (proxy == NULL)
+        return NULL;
+
+    device = g_new0(Device, 1);
+    device->proxy = proxy;
+    device->battery = _device_battery_new(object_path, proxy);
+    if (device->battery == NULL)
+        g_debug("UPower device %s has no battery to watch yet", object_path);
+    g_signal_connect(proxy, "g-properties-changed", G_CALLBACK(_on_properties_changed), device);
+    return device;
+}
+
+static const Device* _get_device(const Battery* battery, GError** error)
+{
+    const Device* device = g_hash_table_lookup(upower.devices, battery->sys_path);
+
+    if (device == NULL)
+    {
+        g_set_error(error, BATTERY_ERROR, BATTERY_NO_DEVICE, "UPower device %s is gone", battery->sys_path);
+        return NULL;
+    }
+    return device;
+}
+
+static gboolean _upower_init(GError** error)
+{
+    GVariant *reply, *version;
+
+    upower.connection = g_bus_get_sync(G_BUS_TYPE_SYSTEM, NULL, error);
+    if (upower.connection == NULL)
+        return FALSE;
+
+    reply = g_dbus_connection_call_sync(
+        upower.connection,
+        UPOWER_BUS_NAME,
+        UPOWER_OBJECT_PATH,
+        DBUS_PROPERTIES_INTERFACE,
+        "Get",
+        g_variant_new("(ss)", UPOWER_INTERFACE, UPOWER_DAEMON_VERSION_PROPERTY),
+        G_VARIANT_TYPE("(v)"),
+        G_DBUS_CALL_FLAGS_NONE,
+        -1,
+        NULL,
+        error);
+    if (reply == NULL)
+    {
+        g_clear_object(&upower.connection);
+        return FALSE;
+    }
+
+    g_variant_get(reply, "(v)", &version);
+    if (g_variant_is_of_type(version, G_VARIANT_TYPE_STRING) == TRUE)
+        g_info("UPower daemon %s", g_variant_get_string(version, NULL));
+    g_variant_unref(version);
+    g_variant_unref(reply);
+
+    upower.devices = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)_device_free);
+    return TRUE;
+}
+
+static void _upower_uninit(void)
+{
+    if (upower.added_id != 0)
+    {
+        g_dbus_connection_signal_unsubscribe(upower.connection, upower.added_id);
+        g_dbus_connection_signal_unsubscribe(upower.connection, upower.removed_id);
+        upower.added_id = upower.removed_id = 0;
+    }
+    g_hash_table_destroy(upower.devices);
+    upower.devices = NULL;
+    g_clear_object(&upower.connection);
+}
+
+/* Devices still listed move to the new table, the ones left behind are gone */
+static gboolean _upower_enumerate(GError** error)
+{
+    Device* device;
+    GVariant* reply;
+    GVariantIter* paths;
+    GHashTable* devices;
+    const gchar* object_path;
+    gpointer key, value;
+    GError* _error = NULL;
+
+    reply = g_dbus_connection_call_sync(
+        upower.connection,
+        UPOWER_BUS_NAME,
+        UPOWER_OBJECT_PATH,
+        UPOWER_INTERFACE,
+        "EnumerateDevices",
+        NULL,
+        G_VARIANT_TYPE("(ao)"),
+        G_DBUS_CALL_FLAGS_NONE,
+        -1,
+        NULL,
+        error);
+    if (reply == NULL)
+        return FALSE;
+
+    devices = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)_device_free);
+    g_variant_get(reply, "(ao)", &paths);
+    while (g_variant_iter_loop(paths, "&o", &object_path))
+    {
+        if (g_hash_table_lookup_extended(upower.devices, object_path, &key, &value) == TRUE)
+        {
+            g_hash_table_steal(upower.devices, object_path);
+            device = value;
+        }
+        else
+        {
+            device = _device_new(object_path, &_error);
+            if (device == NULL)
+            {
+                g_warning("Skip UPower device \"%s\": %s", object_path, _error->message);
+                g_clear_error(&_error);
+                continue;
+            }
+            key = g_strdup(object_path);
+        }
+        g_hash_table_insert(devices, key, device);
+    }
+    g_variant_iter_free(paths);
+    g_variant_unref(reply);
+
+    g_hash_table_destroy(upower.devices);
+    upower.devices = devices;
+    return TRUE;
+}
+
+/* Subscribed, the device table is current and the rescan stays off the bus */
+static gboolean _upower_get_batteries_supply(GSList** list, GError** error)
+{
+    Device* device;
+    GHashTableIter iter;
+    gpointer key, value;
+
+    if (upower.added_id == 0 && _upower_enumerate(error) == FALSE)
+        return FALSE;
+
+    g_hash_table_iter_init(&iter, upower.devices);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+    {
+        device = value;
+        _device_update(device, key);
+        if (device->battery != NULL)
+            (*list) = g_slist_prepend((*list), battery_ref(device->battery));
+    }
+    return TRUE;
+}
+
+static void _on_device_added(
+    GDBusConnection* connection,
+    const gchar* sender_name,
+    const gchar* object_path,
+    const gchar* interface_name,
+    const gchar* signal_name,
+    GVariant* parameters,
+    gpointer user_data)
+{
+    Device* device;
+    const gchar* device_path;
+    GError* error = NULL;
+
+    if (g_variant_is_of_type(parameters, G_VARIANT_TYPE("(o)")) == FALSE)
+        return;
+    g_variant_get(parameters, "(&o)", &device_path);
+    if (g_hash_table_contains(upower.devices, device_path) == TRUE)
+        return;
+
+    device = _device_new(device_path, &error);
+    if (device == NULL)
+    {
+        g_warning("Skip UPower device \"%s\": %s", device_path, error->message);
+        g_error_free(error);
+        return;
+    }
+    g_hash_table_insert(upower.devices, g_strdup(device_path), device);
+    if (device->battery != NULL)
+        battery_supply_changed();
+}
+
+static void _on_device_removed(
+    GDBusConnection* connection,
+    const gchar* sender_name,
+    const gchar* object_path,
+    const gchar* interface_name,
+    const gchar* signal_name,
+    GVariant* parameters,
+    gpointer user_data)
+{
+    const Device* device;
+    const gchar* device_path;
+    gboolean had_battery;
+
+    if (g_variant_is_of_type(parameters, G_VARIANT_TYPE("(o)")) == FALSE)
+        return;
+    g_variant_get(parameters, "(&o)", &device_path);
+    device = g_hash_table_lookup(upower.devices, device_path);
+    if (device == NULL)
+        return;
+
+    had_battery = device->battery != NULL;
+    g_hash_table_remove(upower.devices, device_path);
+    if (had_battery == TRUE)
+        battery_supply_changed();
+}
+
+/*
+ * Subscribing before enumerating loses no device added in between; the
+ * signals are dispatched to the thread default context of the caller.
+ */
+static gboolean _upower_subscribe(GError** error)
+{
+    upower.added_id = g_dbus_connection_signal_subscribe(
+        upower.connection,
+        UPOWER_BUS_NAME,
+        UPOWER_INTERFACE,
+        UPOWER_DEVICE_ADDED_SIGNAL,
+        UPOWER_OBJECT_PATH,
+        NULL,
+        G_DBUS_SIGNAL_FLAGS_NONE,
+        _on_device_added,
+        NULL,
+        NULL);
+    upower.removed_id = g_dbus_connection_signal_subscribe(
+        upower.connection,
+        UPOWER_BUS_NAME,
+        UPOWER_INTERFACE,
+        UPOWER_DEVICE_REMOVED_SIGNAL,
+        UPOWER_OBJECT_PATH,
+        NULL,
+        G_DBUS_SIGNAL_FLAGS_NONE,
+        _on_device_removed,
+        NULL,
+        NULL);
+
+    if (_upower_enumerate(error) == FALSE)
+    {
+        g_dbus_connection_signal_unsubscribe(upower.connection, upower.added_id);
+        g_dbus_connection_signal_unsubscribe(upower.connection, upower.removed_id);
+        upower.added_id = upower.removed_id = 0;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static gboolean _upower_get_battery_status(const Battery* battery, BATTERY_STATUS* status, GError** error)
+{
+    const Device* device = _get_device(battery, error);
+
+    if (device == NULL)
+        return FALSE;
+
+    switch (_get_property_uint32(device->proxy, UPOWER_STATE_PROPERTY))
+    {
+        case UPOWER_STATE_CHARGING:
+            *status = CHARGING_STATUS;
+            break;
+        case UPOWER_STATE_DISCHARGING:
+        case UPOWER_STATE_EMPTY:
+            *status = DISCHARGING_STATUS;
+            break;
+        case UPOWER_STATE_FULLY_CHARGED:
+            *status = CHARGED_STATUS;
+            break;
+        case UPOWER_STATE_PENDING_CHARGE:
+        case UPOWER_STATE_PENDING_DISCHARGE:
+            *status = NOT_CHARGING_STATUS;
+            break;
+        default:
+            *status = UNKNOWN_STATUS;
+            break;
+    }
+    return TRUE;
+}
+
+static gboolean _upower_get_battery_capacity(const Battery* battery, guint64* capacity, GError** error)
+{
+    gdouble percentage;
+    const Device* device = _get_device(battery, error);
+
+    if (device == NULL)
+        return FALSE;
+
+    percentage = _get_property_double(device->proxy, UPOWER_PERCENTAGE_PROPERTY);
+    *capacity = (guint64)CLAMP(percentage + 0.5, 0.0, 100.0);
+    return TRUE;
+}
+
+static gboolean _upower_get_battery_time(
+    const Battery* battery,
+    BATTERY_STATUS status,
+    guint64* seconds,
+    GError** error)
+{
+    gint64 time;
+    const Device* device = _get_device(battery, error);
+
+    if (device == NULL)
+        return FALSE;
+
+    switch (status)
+    {
+        case DISCHARGING_STATUS:
+        case NOT_CHARGING_STATUS:
+            time = _get_property_int64(device->proxy, UPOWER_TIME_TO_EMPTY_PROPERTY);
+            break;
+        case CHARGING_STATUS:
+        case CHARGED_STATUS:
+            time = _get_property_int64(device->proxy, UPOWER_TIME_TO_FULL_PROPERTY);
+            break;
+        default:
+            g_set_error(error, BATTERY_ERROR, BATTERY_INVALID_STATUS, "Invalid status for get_battery_time: \"%d\"", status);
+            return FALSE;
+    }
+
+    /* upowerd reports 0 until it has an estimate */
+    *seconds = (guint64)MAX(time, 0);
+    return TRUE;
+}
+
+/* upowerd reports Wh and W, the battery API uses uWh and uW */
+static gboolean _upower_get_battery_energy(
+    const Battery* battery,
+    guint64* now,
+    guint64* full,
+    guint64* rate,
+    GError** error)
+{
+    const Device* device = _get_device(battery, error);
+
+    if (device == NULL)
+        return FALSE;
+
+    *now = (guint64)(MAX(_get_property_double(device->proxy, UPOWER_ENERGY_PROPERTY), 0.0) * 1000000);
+    *full = (guint64)(MAX(_get_property_double(device->proxy, UPOWER_ENERGY_FULL_PROPERTY), 0.0) * 1000000);
+    if (rate != NULL)
+        *rate = (guint64)(MAX(_get_property_double(device->proxy, UPOWER_ENERGY_RATE_PROPERTY), 0.0) * 1000000);
+    return TRUE;
+}
+
+/* Capacity is the full energy in percent of the design energy */
+static gboolean _upower_get_battery_health(const Battery* battery, gdouble* health, GError** error)
+{
+    const Device* device = _get_device(battery, error);
+
+    if (device == NULL)
+        return FALSE;
+
+    *health = MAX(_get_property_double(device->proxy, UPOWER_CAPACITY_PROPERTY), 0.0) / 100;
+    return TRUE;
+}
+
+const BatteryBackend upower_backend = {
+    "upower",
+    _upower_init,
+    _upower_uninit,
+    _upower_get_batteries_supply,
+    _upower_get_battery_status,
+    _upower_get_battery_capacity,
+    _upower_get_battery_time,
+    _upower_get_battery_energy,
+    _upower_get_battery_health,
+    _upower_subscribe,
+};
@@ -0,0 +1,54 @@
+#ifndef UPOWER_H
+#define UPOWER_H
+
+#include <glib.h>
+
+#include "battery.h"
+
+#define UPOWER_BUS_NAME "org.freedesktop.UPower"
+#define UPOWER_OBJECT_PATH "/org/freedesktop/UPower"
+#define UPOWER_INTERFACE "org.freedesktop.UPower"
+#define UPOWER_DEVICE_INTERFACE "org.freedesktop.UPower.Device"
+#define DBUS_PROPERTIES_INTERFACE "org.freedesktop.DBus.Properties"
+
+#define UPOWER_DEVICE_ADDED_SIGNAL "DeviceAdded"
+#define UPOWER_DEVICE_REMOVED_SIGNAL "DeviceRemoved"
+
+#define UPOWER_DAEMON_VERSION_PROPERTY "DaemonVersion"
+#define UPOWER_TYPE_PROPERTY "Type"
+#define UPOWER_POWER_SUPPLY_PROPERTY "PowerSupply"
+#define UPOWER_IS_PRESENT_PROPERTY "IsPresent"
+#define UPOWER_NATIVE_PATH_PROPERTY "NativePath"
+#define UPOWER_MODEL_PROPERTY "Model"
+#define UPOWER_VENDOR_PROPERTY "Vendor"
+#define UPOWER_SERIAL_PROPERTY "Serial"
+#define UPOWER_TECHNOLOGY_PROPERTY "Technology"
+#define UPOWER_STATE_PROPERTY "State"
+#define UPOWER_PERCENTAGE_PROPERTY "Percentage"
+#define UPOWER_TIME_TO_EMPTY_PROPERTY "TimeToEmpty"
+#define UPOWER_TIME_TO_FULL_PROPERTY "TimeToFull"
+#define UPOWER_ENERGY_PROPERTY "Energy"
+#define UPOWER_ENERGY_FULL_PROPERTY "EnergyFull"
+#define UPOWER_ENERGY_RATE_PROPERTY "EnergyRate"
+#define UPOWER_CAPACITY_PROPERTY "Capacity"
+
+/* org.freedesktop.UPower.Device Type */
+#define UPOWER_TYPE_UNKNOWN 0
+#define UPOWER_TYPE_LINE_POWER 1
+#define UPOWER_TYPE_BATTERY 2
+
+/* org.freedesktop.UPower.Device State */
+typedef enum 
+{
+    UPOWER_STATE_UNKNOWN,
+    UPOWER_STATE_CHARGING,
+    UPOWER_STATE_DISCHARGING,
+    UPOWER_STATE_EMPTY,
+    UPOWER_STATE_FULLY_CHARGED,
+    UPOWER_STATE_PENDING_CHARGE,
+    UPOWER_STATE_PENDING_DISCHARGE,
+} UPOWER_STATE;
+
+extern const BatteryBackend upower_backend;
+
+#endif // UPOWER_H
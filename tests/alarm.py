@@ -0,0 +1,77 @@
+#!/usr/bin/env python3
+"""
+--alarm on a fake sysfs tree: the alarm attribute gets the critical level of
+the battery policy, not the command line one, a change uevent samples the
+battery at once, and the value found in alarm is written back on exit.
+Sending the uevent needs CAP_NET_ADMIN, without it that step is skipped.
+"""
+
+import os
+import socket
+import sys
+import time
+
+import harness
+
+ORIGINAL = "1234"
+# 15% of energy_full, from the rule below
+ARMED = "7500000"
+ARM_TIMEOUT = 15
+UEVENT_TIMEOUT = 2
+
+
+def wait_alarm(power_supply, value, timeout):
+    deadline = time.monotonic() + timeout
+    while time.monotonic() < deadline:
+        if power_supply.read("BAT0", "alarm") == value:
+            return True
+        time.sleep(0.05)
+    return False
+
+
+def send_uevent(name):
+    message = "\0".join(
+        [
+            "change@/devices/platform/test/power_supply/%s" % name,
+            "ACTION=change",
+            "SUBSYSTEM=power_supply",
+            "POWER_SUPPLY_NAME=%s" % name,
+        ]
+    )
+    uevent = socket.socket(socket.AF_NETLINK, socket.SOCK_DGRAM, socket.NETLINK_KOBJECT_UEVENT)
+    try:
+        uevent.sendto(message.encode() + b"\0", (0, 1))
+        return True
+    except PermissionError:
+        return False
+    finally:
+        uevent.close()
+
+
+session = harness.Session()
+power_supply = session.power_supply()
+power_supply.add("BAT0", alarm=ORIGINAL)
+
+os.makedirs(os.path.join(session.directory, "batify"))
+with open(os.path.join(session.directory, "batify", "batify.conf"), "w") as config:
+    config.write("[test-pack]\nmodel=Test\ncritical-level=15\n")
+
+batify = session.batify(
+    sys.argv[1], "--sysfs-path", power_supply.path, "--alarm", "--critical-level", "5", "--interval", "60"
+)
+
+if wait_alarm(power_supply, ARMED, ARM_TIMEOUT) is False:
+    batify.fail("alarm is %s, expected %s" % (power_supply.read("BAT0", "alarm"), ARMED))
+if session.wait_notification("is discharging", ARM_TIMEOUT) is None:
+    batify.fail("battery was never sampled")
+
+power_supply.set_capacity("BAT0", 12)
+if send_uevent("BAT0") is False:
+    print("Cannot send uevents without CAP_NET_ADMIN, skip the uevent check")
+elif session.wait_notification("level is critical", UEVENT_TIMEOUT) is None:
+    batify.fail("change uevent did not sample the battery")
+
+if batify.stop() != 0:
+    batify.fail("batify did not exit cleanly")
+if power_supply.read("BAT0", "alarm") != ORIGINAL:
+    batify.fail("alarm is %s after exit, expected %s" % (power_supply.read("BAT0", "alarm"), ORIGINAL))
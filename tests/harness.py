@@ -0,0 +1,206 @@
+"""
+Shared pieces of the batify integration tests: private buses with mock
+services, a fake power supply tree and the daemon running against both.
+A test that cannot set up its environment exits with SKIP, which CTest
+reports as skipped rather than failed.
+"""
+
+import atexit
+import os
+import re
+import shutil
+import signal
+import subprocess
+import sys
+import tempfile
+import time
+
+SKIP = 77
+
+
+def skip(reason):
+    print("SKIP: %s" % reason)
+    sys.exit(SKIP)
+
+
+try:
+    import dbus
+    import dbusmock
+except ImportError:
+    skip("python-dbusmock is not installed")
+
+if shutil.which("dbus-daemon") is None:
+    skip("dbus-daemon is not installed")
+
+
+def percentile(values, fraction):
+    """Nearest rank, so p99 of a short run is its worst value"""
+    ordered = sorted(values)
+    rank = max(int(round(fraction * len(ordered) + 0.5)) - 1, 0)
+    return ordered[min(rank, len(ordered) - 1)]
+
+
+class PowerSupply:
+    """A directory laid out like /sys/class/power_supply"""
+
+    def __init__(self, root):
+        self.root = root
+        self.path = os.path.join(root, "power_supply")
+        os.mkdir(self.path)
+
+    def add(self, name, status="Discharging", capacity=50, serial="0001", **attributes):
+        """Builds the battery aside and moves it in, returns when it appeared"""
+        directory = os.path.join(self.root, name)
+        values = {
+            "type": "Battery",
+            "manufacturer": "batify",
+            "model_name": "Test",
+            "technology": "Li-ion",
+            "serial_number": serial,
+            "status": status,
+            "capacity": capacity,
+            "energy_now": capacity * 500000,
+            "energy_full": 50000000,
+            "energy_full_design": 50000000,
+            "power_now": 10000000,
+        }
+        values.update(attributes)
+        os.mkdir(directory)
+        for attribute, value in values.items():
+            with open(os.path.join(directory, attribute), "w") as f:
+                f.write("%s\n" % value)
+        flipped = time.time()
+        os.rename(directory, os.path.join(self.path, name))
+        return flipped
+
+    def remove(self, name):
+        shutil.rmtree(os.path.join(self.path, name))
+
+    def read(self, name, attribute):
+        with open(os.path.join(self.path, name, attribute)) as f:
+            return f.read().strip()
+
+    def write(self, name, attribute, value):
+        """Replaces the attribute in one rename, returns when it changed"""
+        filename = os.path.join(self.path, name, attribute)
+        with open(filename + "~", "w") as f:
+            f.write("%s\n" % value)
+        flipped = time.time()
+        os.rename(filename + "~", filename)
+        return flipped
+
+    def set_capacity(self, name, capacity):
+        self.write(name, "energy_now", capacity * 500000)
+        return self.write(name, "capacity", capacity)
+
+
+class Session:
+    """
+    Private session and system buses, org.freedesktop.Notifications on the
+    session bus and a scratch directory that doubles as $HOME, so neither
+    the user's configuration nor their desktop take part.
+    """
+
+    def __init__(self):
+        self.directory = tempfile.mkdtemp(prefix="batify-test-")
+        self.processes = []
+        atexit.register(self.close)
+
+        for variable in ("HOME", "XDG_CONFIG_HOME", "XDG_DATA_HOME", "XDG_STATE_HOME", "XDG_CACHE_HOME"):
+            os.environ[variable] = self.directory
+        os.environ["DBUS_SESSION_BUS_ADDRESS"] = self._start_bus()
+        os.environ["DBUS_SYSTEM_BUS_ADDRESS"] = self._start_bus()
+
+        self.notifications_log = os.path.join(self.directory, "notifications.log")
+        self.spawn_template("notification_daemon", {}, self.notifications_log, system_bus=False)
+        self.offset = 0
+
+    def _start_bus(self):
+        daemon = subprocess.Popen(
+            ["dbus-daemon", "--session", "--nofork", "--print-address=1"],
+            stdout=subprocess.PIPE,
+            universal_newlines=True,
+        )
+        self.processes.append(daemon)
+        return daemon.stdout.readline().strip()
+
+    def spawn_template(self, template, parameters, log, system_bus):
+        """Starts a dbusmock template and returns its mock interface"""
+        with open(log, "w") as stdout:
+            process, proxy = dbusmock.DBusTestCase.spawn_server_template(
+                template, parameters, stdout, system_bus=system_bus
+            )
+        self.processes.append(process)
+        return dbus.Interface(proxy, dbusmock.MOCK_IFACE)
+
+    def power_supply(self):
+        return PowerSupply(self.directory)
+
+    def batify(self, executable, *arguments, env=None):
+        return Batify(self, executable, arguments, env)
+
+    def wait_notification(self, text, timeout):
+        """Time of the first Notify carrying text, None once timeout runs out"""
+        deadline = time.monotonic() + timeout
+        while time.monotonic() < deadline:
+            with open(self.notifications_log) as f:
+                f.seek(self.offset)
+                while True:
+                    line = f.readline()
+                    if line == "" or not line.endswith("\n"):
+                        break
+                    self.offset = f.tell()
+                    match = re.match(r"^(\d+\.\d+) Notify (.*)$", line)
+                    if match is not None and text in match.group(2):
+                        return float(match.group(1))
+            time.sleep(0.01)
+        return None
+
+    def skip_notifications(self):
+        self.offset = os.path.getsize(self.notifications_log)
+
+    def close(self):
+        for process in reversed(self.processes):
+            if process.poll() is None:
+                process.terminate()
+                try:
+                    process.wait(10)
+                except subprocess.TimeoutExpired:
+                    process.kill()
+        self.processes = []
+        shutil.rmtree(self.directory, ignore_errors=True)
+
+
+class Batify:
+    """The daemon under test, its output goes to batify.log in the session"""
+
+    def __init__(self, session, executable, arguments, env=None):
+        self.log = os.path.join(session.directory, "batify.log")
+        with open(self.log, "w") as output:
+            self.process = subprocess.Popen(
+                [executable] + list(arguments), stdout=output, stderr=subprocess.STDOUT, env=env
+            )
+        session.processes.append(self.process)
+
+    def stop(self):
+        """Exit status after SIGTERM"""
+        self.process.send_signal(signal.SIGTERM)
+        return self.process.wait(30)
+
+    def output(self):
+        with open(self.log) as f:
+            return f.read()
+
+    def wait_output(self, text, timeout):
+        """True once text shows up in the log, False when timeout runs out"""
+        deadline = time.monotonic() + timeout
+        while time.monotonic() < deadline:
+            if text in self.output():
+                return True
+            time.sleep(0.05)
+        return False
+
+    def fail(self, message):
+        print("FAIL: %s" % message)
+        print(self.output())
+        sys.exit(1)
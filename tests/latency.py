@@ -0,0 +1,81 @@
+#!/usr/bin/env python3
+"""
+End to end notification latency on a fake sysfs tree: the time from the
+rename that changes an attribute, or moves a new pack in, to the Notify
+call seen by the mock notification server. Each run unplugs the pack,
+drains it below the low and then the critical level and hotplugs a second
+pack; p50 and p99 of every scenario are printed and a missed notification
+fails the test. BATIFY_LATENCY_RUNS sets the number of runs (default 20).
+"""
+
+import os
+import sys
+import time
+
+import harness
+
+INTERVAL = 1
+RUNS = int(os.environ.get("BATIFY_LATENCY_RUNS", "20"))
+# Status and levels are polled on the interval, new packs wait for a rescan
+SAMPLE_TIMEOUT = 3 * INTERVAL
+HOTPLUG_TIMEOUT = 15
+SCENARIOS = ("unplug", "low", "critical", "hotplug")
+
+session = harness.Session()
+power_supply = session.power_supply()
+power_supply.add("BAT0", status="Charging", capacity=50)
+
+batify = session.batify(
+    sys.argv[1],
+    "--sysfs-path",
+    power_supply.path,
+    "--interval",
+    str(INTERVAL),
+    "--low-level",
+    "20",
+    "--critical-level",
+    "10",
+)
+latencies = {scenario: [] for scenario in SCENARIOS}
+
+
+def measure(scenario, flipped, text, timeout):
+    notified = session.wait_notification(text, timeout)
+    if notified is None:
+        batify.fail("%s: no \"%s\" notification within %d s" % (scenario, text, timeout))
+    latencies[scenario].append(notified - flipped)
+
+
+def reset():
+    """Back to a charging pack at 50%, which also rearms both levels"""
+    power_supply.set_capacity("BAT0", 50)
+    power_supply.write("BAT0", "status", "Charging")
+    session.wait_notification("is charging", SAMPLE_TIMEOUT)
+    time.sleep(2 * INTERVAL)
+    session.skip_notifications()
+
+
+if session.wait_notification("is charging", HOTPLUG_TIMEOUT) is None:
+    batify.fail("battery was never sampled")
+
+for run in range(RUNS):
+    reset()
+    measure("unplug", power_supply.write("BAT0", "status", "Discharging"), "is discharging", SAMPLE_TIMEOUT)
+    measure("low", power_supply.set_capacity("BAT0", 15), "level is low", SAMPLE_TIMEOUT)
+    measure("critical", power_supply.set_capacity("BAT0", 5), "level is critical", SAMPLE_TIMEOUT)
+
+    name = "BAT%d" % (run + 1)
+    flipped = power_supply.add(name, serial="%04d" % (run + 2))
+    measure("hotplug", flipped, name + " (", HOTPLUG_TIMEOUT)
+    power_supply.remove(name)
+
+print("%-10s %8s %8s %8s" % ("scenario", "runs", "p50 ms", "p99 ms"))
+for scenario in SCENARIOS:
+    values = latencies[scenario]
+    print(
+        "%-10s %8d %8.1f %8.1f"
+        % (scenario, len(values), harness.percentile(values, 0.5) * 1000, harness.percentile(values, 0.99) * 1000)
+    )
+
+if batify.stop() != 0:
+    batify.fail("batify did not exit cleanly")
@@ -0,0 +1,104 @@
+#!/usr/bin/env python3
+"""
+--lock-memory under memory pressure: batify shares a transient scope with
+a process that keeps touching several times the scope's memory limit, so
+everything unlocked in it gets swapped out. The critical notification must
+still come within a couple of intervals of the capacity change.
+Needs systemd-run with a scope it may start and enough free swap.
+"""
+
+import os
+import shutil
+import subprocess
+import sys
+import time
+
+import harness
+
+MEMORY_MAX = "128M"
+HOG_MEGABYTES = 512
+SWAP_NEEDED = 600 * 1024
+WARM_UP_TIMEOUT = 15
+PRESSURE_SECONDS = 10
+CRITICAL_TIMEOUT = 3
+
+# Dirties one byte per page of a buffer larger than the scope, over and
+# over, until the shell it was started from has been replaced and exits
+HOG = """
+import os
+parent = os.getppid()
+buffer = bytearray(%d << 20)
+while os.getppid() == parent:
+    for offset in range(0, len(buffer), 4096):
+        buffer[offset] = (buffer[offset] + 1) & 0xff
+""" % HOG_MEGABYTES
+
+
+def swap_free():
+    with open("/proc/meminfo") as f:
+        for line in f:
+            if line.startswith("SwapFree:"):
+                return int(line.split()[1])
+    return 0
+
+
+def systemd_run():
+    """The scope prefix, None when no systemd manager lets us start one"""
+    if shutil.which("systemd-run") is None:
+        return None
+    for user in (["--user"], []):
+        command = ["systemd-run"] + user + ["--scope", "--quiet"]
+        if subprocess.call(command + ["true"], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL) == 0:
+            return command
+    return None
+
+
+if swap_free() < SWAP_NEEDED:
+    harness.skip("less than %d kB of free swap" % SWAP_NEEDED)
+scope = systemd_run()
+if scope is None:
+    harness.skip("systemd-run cannot start a scope")
+
+session = harness.Session()
+power_supply = session.power_supply()
+power_supply.add("BAT0", capacity=50)
+
+batify = session.batify(
+    scope[0],
+    *scope[1:],
+    "-p",
+    "MemoryMax=" + MEMORY_MAX,
+    "-p",
+    "MemorySwapMax=infinity",
+    "--",
+    "sh",
+    "-c",
+    'python3 -c "$HOG" & exec "$0" "$@"',
+    sys.argv[1],
+    "--sysfs-path",
+    power_supply.path,
+    "--lock-memory",
+    "--interval",
+    "1",
+    "--debug",
+    env=dict(os.environ, HOG=HOG),
+)
+
+if session.wait_notification("is discharging", WARM_UP_TIMEOUT) is None:
+    batify.fail("battery was never sampled")
+if "Memory has been locked" not in batify.output():
+    batify.stop()
+    harness.skip("memory could not be locked, raise the memlock limit")
+
+time.sleep(PRESSURE_SECONDS)
+if batify.process.poll() is not None:
+    batify.fail("batify did not survive the memory pressure")
+
+session.skip_notifications()
+flipped = power_supply.set_capacity("BAT0", 3)
+notified = session.wait_notification("level is critical", CRITICAL_TIMEOUT)
+if notified is None:
+    batify.fail("no critical notification within %d seconds under pressure" % CRITICAL_TIMEOUT)
+print("critical after %.3f s under pressure" % (notified - flipped))
+
+batify.stop()
@@ -0,0 +1,105 @@
+#!/usr/bin/env python3
+"""
+Hotplug churn soak on a fake sysfs tree: a handful of packs is kept under
+--sysfs-path and one of them is pulled and replaced by a pack with a new
+serial every CHURN_INTERVAL seconds, so every rescan opens and drops
+battery directories, attribute descriptors and caches. The stats file is
+read every few seconds; once warmed up, neither the resident set nor the
+number of open descriptors may grow.
+BATIFY_SOAK_SECONDS sets the length of the run (default 600).
+"""
+
+import itertools
+import json
+import os
+import sys
+import time
+
+import harness
+
+SECONDS = int(os.environ.get("BATIFY_SOAK_SECONDS", "600"))
+PACKS = 8
+CHURN_INTERVAL = 0.5
+STATS_INTERVAL = 2
+WARM_UP = min(60, SECONDS // 4)
+# Allocator noise, a leak of one record per add or remove is far above it
+RSS_SLACK = 2 << 20
+FD_SLACK = 2
+
+
+def read_stats(path):
+    try:
+        with open(path) as f:
+            stats = json.load(f)
+    except (OSError, ValueError):
+        return None
+    return stats["rss_bytes"], stats["open_fds"]
+
+
+def mean(values):
+    return sum(values) / len(values)
+
+
+session = harness.Session()
+power_supply = session.power_supply()
+serials = itertools.count(1)
+packs = []
+for slot in range(PACKS):
+    name = "BAT%d" % slot
+    power_supply.add(name, capacity=20 + 10 * (slot % 8), serial="%04d" % next(serials))
+    packs.append(name)
+
+stats_file = os.path.join(session.directory, "stats.json")
+batify = session.batify(
+    sys.argv[1],
+    "--sysfs-path",
+    power_supply.path,
+    "--interval",
+    "1",
+    "--stats-file",
+    stats_file,
+    "--stats-interval",
+    str(STATS_INTERVAL),
+)
+
+start = time.monotonic()
+next_stats = start + STATS_INTERVAL
+samples = []
+churned = 0
+while time.monotonic() - start < SECONDS:
+    time.sleep(CHURN_INTERVAL)
+    slot = churned % PACKS
+    power_supply.remove(packs[slot])
+    # A new name as well, so watchers are dropped and added, not reused
+    packs[slot] = "BAT%d" % (PACKS + churned)
+    power_supply.add(packs[slot], capacity=20 + 10 * (churned % 8), serial="%04d" % next(serials))
+    churned += 1
+
+    if time.monotonic() < next_stats:
+        continue
+    next_stats += STATS_INTERVAL
+    if batify.process.poll() is not None:
+        batify.fail("batify exited during the soak")
+    stats = read_stats(stats_file)
+    if stats is not None and time.monotonic() - start >= WARM_UP:
+        samples.append(stats)
+
+print("%d packs replaced" % churned)
+if len(samples) < 4:
+    batify.fail("only %d stats snapshots after the warm-up" % len(samples))
+
+half = len(samples) // 2
+rss = [sample[0] for sample in samples]
+fds = [sample[1] for sample in samples]
+growth = mean(rss[half:]) - mean(rss[:half])
+# A snapshot taken between a remove and an add misses one pack
+fd_growth = mean(fds[half:]) - mean(fds[:half])
+print("rss %d..%d bytes, growth %+d bytes" % (min(rss), max(rss), growth))
+print("open fds %d..%d, growth %+.1f" % (min(fds), max(fds), fd_growth))
+
+if growth > RSS_SLACK:
+    batify.fail("resident set grew by %d bytes under churn" % growth)
+if fd_growth > FD_SLACK:
+    batify.fail("open descriptors grew by %.1f under churn" % fd_growth)
+if batify.stop() != 0:
+    batify.fail("batify did not exit cleanly")
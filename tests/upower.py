@@ -0,0 +1,44 @@
+#!/usr/bin/env python3
+"""
+The upower backend follows upowerd instead of polling it. Sampling is slowed
+down to a minute, so every notification below has to come from a signal:
+a pack inserted into a device batify already enumerated (IsPresent), its
+percentage dropping (PropertiesChanged) and a second battery appearing
+(DeviceAdded). The insertion waits until batify has reported the empty
+device, so it cannot be picked up by the first enumeration.
+"""
+
+import sys
+
+import dbus
+
+import harness
+
+ENUMERATE_TIMEOUT = 15
+SIGNAL_TIMEOUT = 5
+
+session = harness.Session()
+upower = session.spawn_template(
+    "upower", {"DaemonVersion": "0.99"}, session.directory + "/upower.log", system_bus=True
+)
+device = upower.AddDischargingBattery("BAT0", "Mock Battery", 50.0, 3600)
+upower.SetDeviceProperties(device, {"IsPresent": dbus.Boolean(False)})
+
+batify = session.batify(sys.argv[1], "--backend", "upower", "--interval", "60", "--debug")
+if batify.wait_output("has no battery to watch yet", ENUMERATE_TIMEOUT) is False:
+    batify.fail("empty device was never enumerated")
+
+upower.SetDeviceProperties(device, {"IsPresent": dbus.Boolean(True), "Percentage": dbus.Double(15.0)})
+if session.wait_notification("level is low", SIGNAL_TIMEOUT) is None:
+    batify.fail("inserted pack was not picked up")
+
+upower.SetDeviceProperties(device, {"Percentage": dbus.Double(5.0)})
+if session.wait_notification("level is critical", SIGNAL_TIMEOUT) is None:
+    batify.fail("no PropertiesChanged handler on the inserted pack")
+
+upower.AddDischargingBattery("BAT1", "Mock Battery", 15.0, 1800)
+if session.wait_notification("level is low", SIGNAL_TIMEOUT) is None:
+    batify.fail("battery added at runtime was not picked up")
+
+if batify.stop() != 0:
+    batify.fail("batify did not exit cleanly")